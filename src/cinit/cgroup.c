@@ -0,0 +1,320 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
+
+#include "cgroup.h"
+#include "utils.h"
+
+/** Name of the cgroup holding the process supervisor. */
+#define CGROUP_SUPERVISOR_NAME "supervisor"
+
+/** Name of the cgroup holding cgroups of services. */
+#define CGROUP_SERVICES_NAME "services"
+
+/** Path of the cgroup holding cgroups of services. */
+#define CGROUP_SERVICES_PATH CGROUP_ROOT "/" CGROUP_SERVICES_NAME
+
+/** Controllers enabled for services. */
+static const char * const controllers[] = {
+    "cpu",
+    "io",
+    "memory",
+    "pids",
+};
+
+static const char * const limit_names[] = {
+    [CGROUP_LIMIT_MEMORY_MAX] = "memory.max",
+    [CGROUP_LIMIT_MEMORY_HIGH] = "memory.high",
+    [CGROUP_LIMIT_CPU_WEIGHT] = "cpu.weight",
+    [CGROUP_LIMIT_CPU_MAX] = "cpu.max",
+    [CGROUP_LIMIT_PIDS_MAX] = "pids.max",
+    [CGROUP_LIMIT_IO_WEIGHT] = "io.weight",
+};
+
+static bool g_available = false;
+
+/**
+ * Write a string to a file.
+ *
+ * @param[in] path Path of the file.
+ * @param[in] value String to write.
+ *
+ * @return -1 if an error occurred, 0 otherwise.
+ */
+static int write_file(const char *path, const char *value)
+{
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+
+    ssize_t len = strlen(value);
+    if (write(fd, value, len) != len) {
+        int errsv = errno;
+        close(fd);
+        errno = errsv;
+        return -1;
+    }
+
+    close(fd);
+    return 0;
+}
+
+/**
+ * Read the content of a file.
+ *
+ * @param[in] path Path of the file.
+ * @param[out] buf Where to store the content, null terminated.
+ * @param[in] bufsize Size of the buffer.
+ *
+ * @return -1 if an error occurred, 0 otherwise.
+ */
+static int read_small_file(const char *path, char *buf, size_t bufsize)
+{
+    size_t used = 0;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+
+    while (used < bufsize - 1) {
+        ssize_t n = read(fd, buf + used, bufsize - 1 - used);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            int errsv = errno;
+            close(fd);
+            errno = errsv;
+            return -1;
+        }
+        else if (n == 0) {
+            break;
+        }
+        used += n;
+    }
+    buf[used] = '\0';
+
+    close(fd);
+    return 0;
+}
+
+/**
+ * Move all processes of a cgroup to another one.
+ *
+ * @param[in] from Path of the source cgroup.
+ * @param[in] to Path of the destination cgroup.
+ *
+ * @return -1 if an error occurred, 0 otherwise.
+ */
+static int move_processes(const char *from, const char *to)
+{
+    char path[PATH_MAX];
+    char buf[16];
+
+    snprintf(path, sizeof(path), "%s/cgroup.procs", from);
+    FILE *procs = fopen(path, "re");
+    if (!procs) {
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "%s/cgroup.procs", to);
+
+    int rc = 0;
+    while (fgets(buf, sizeof(buf), procs)) {
+        terminate_at_first_eol(buf);
+        // Processes that terminated in the meantime are ignored.
+        if (write_file(path, buf) < 0 && errno != ESRCH) {
+            rc = -1;
+            break;
+        }
+    }
+
+    fclose(procs);
+    return rc;
+}
+
+/**
+ * Enable controllers in a cgroup, for its children.
+ *
+ * Controllers that are not available are skipped.
+ *
+ * @param[in] path Path of the cgroup.
+ */
+static void enable_controllers(const char *path)
+{
+    char file[PATH_MAX];
+    char available[256];
+
+    snprintf(file, sizeof(file), "%s/cgroup.controllers", path);
+    if (read_small_file(file, available, sizeof(available)) < 0) {
+        return;
+    }
+
+    snprintf(file, sizeof(file), "%s/cgroup.subtree_control", path);
+    for (int i = 0; i < DIM(controllers); i++) {
+        char *p = strstr(available, controllers[i]);
+        size_t len = strlen(controllers[i]);
+
+        if (p && (p == available || p[-1] == ' ') &&
+            (p[len] == ' ' || p[len] == '\n' || p[len] == '\0')) {
+            char value[32];
+            snprintf(value, sizeof(value), "+%s", controllers[i]);
+            write_file(file, value);
+        }
+    }
+}
+
+int cgroup_init()
+{
+    struct statfs fs;
+
+    g_available = false;
+
+    // Make sure the cgroup v2 hierarchy is mounted.
+    if (statfs(CGROUP_ROOT, &fs) < 0) {
+        return -1;
+    }
+    else if (fs.f_type != CGROUP2_SUPER_MAGIC) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    // Make sure the hierarchy is delegated to us.
+    if (access(CGROUP_ROOT "/cgroup.procs", W_OK) < 0 ||
+        access(CGROUP_ROOT "/cgroup.subtree_control", W_OK) < 0) {
+        return -1;
+    }
+
+    // Controllers can be enabled for children only when the cgroup itself
+    // has no process. Thus, move existing processes to a leaf cgroup.
+    if (mkdir(CGROUP_ROOT "/" CGROUP_SUPERVISOR_NAME, 0755) < 0 && errno != EEXIST) {
+        return -1;
+    }
+    if (move_processes(CGROUP_ROOT, CGROUP_ROOT "/" CGROUP_SUPERVISOR_NAME) < 0) {
+        return -1;
+    }
+
+    // Create the parent cgroup of services.
+    enable_controllers(CGROUP_ROOT);
+    if (mkdir(CGROUP_SERVICES_PATH, 0755) < 0 && errno != EEXIST) {
+        return -1;
+    }
+    enable_controllers(CGROUP_SERVICES_PATH);
+
+    g_available = true;
+    return 0;
+}
+
+bool cgroup_available()
+{
+    return g_available;
+}
+
+const char *cgroup_limit_name(cgroup_limit_t limit)
+{
+    return limit_names[limit];
+}
+
+int cgroup_create(const char *name)
+{
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), CGROUP_SERVICES_PATH "/%s", name);
+    if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+        return -1;
+    }
+    return 0;
+}
+
+int cgroup_destroy(const char *name)
+{
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), CGROUP_SERVICES_PATH "/%s", name);
+    return rmdir(path);
+}
+
+int cgroup_write(const char *name, const char *file, const char *value)
+{
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), CGROUP_SERVICES_PATH "/%s/%s", name, file);
+    return write_file(path, value);
+}
+
+int cgroup_read(const char *name, const char *file, char *buf, size_t bufsize)
+{
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), CGROUP_SERVICES_PATH "/%s/%s", name, file);
+    return read_small_file(path, buf, bufsize);
+}
+
+int cgroup_attach(const char *name)
+{
+    // Writing 0 moves the writing process.
+    return cgroup_write(name, "cgroup.procs", "0");
+}
+
+int cgroup_kill(const char *name, int sig)
+{
+    char path[PATH_MAX];
+    char buf[16];
+    int count = 0;
+
+    snprintf(path, sizeof(path), CGROUP_SERVICES_PATH "/%s/cgroup.procs", name);
+    FILE *procs = fopen(path, "re");
+    if (!procs) {
+        return -1;
+    }
+
+    while (fgets(buf, sizeof(buf), procs)) {
+        pid_t pid = atoi(buf);
+        // Processes that terminated in the meantime are ignored.
+        if (pid > 0 && kill(pid, sig) == 0) {
+            count++;
+        }
+    }
+
+    fclose(procs);
+    return count;
+}
+
+int cgroup_find(pid_t pid, char *name, size_t size)
+{
+    char path[64];
+    char buf[512];
+    const char *prefix = "0::/" CGROUP_SERVICES_NAME "/";
+
+    snprintf(path, sizeof(path), "/proc/%d/cgroup", pid);
+    if (read_small_file(path, buf, sizeof(buf)) < 0) {
+        return -1;
+    }
+
+    // With cgroup v2, the file contains a single line: '0::<path>'.
+    char *p = strstr(buf, prefix);
+    if (!p || (p != buf && p[-1] != '\n')) {
+        return -1;
+    }
+    p += strlen(prefix);
+
+    size_t len = strcspn(p, "/\n");
+    if (len == 0 || len >= size) {
+        return -1;
+    }
+    memcpy(name, p, len);
+    name[len] = '\0';
+
+    return 0;
+}
@@ -0,0 +1,139 @@
+#ifndef __CINIT_CGROUP_H__
+#define __CINIT_CGROUP_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * Mount point of the cgroup v2 hierarchy.
+ */
+#ifndef CGROUP_ROOT
+#define CGROUP_ROOT "/sys/fs/cgroup"
+#endif
+
+/**
+ * Maximum size of a cgroup limit value.
+ */
+#define CGROUP_VALUE_SIZE 64
+
+/**
+ * Resource limits that can be applied to the cgroup of a service.
+ */
+typedef enum {
+    CGROUP_LIMIT_MEMORY_MAX = 0,    /**< memory.max */
+    CGROUP_LIMIT_MEMORY_HIGH,       /**< memory.high */
+    CGROUP_LIMIT_CPU_WEIGHT,        /**< cpu.weight */
+    CGROUP_LIMIT_CPU_MAX,           /**< cpu.max */
+    CGROUP_LIMIT_PIDS_MAX,          /**< pids.max */
+    CGROUP_LIMIT_IO_WEIGHT,         /**< io.weight */
+    CGROUP_NUM_LIMITS,
+} cgroup_limit_t;
+
+/**
+ * Initialize cgroups.
+ *
+ * This succeeds only when a writable cgroup v2 hierarchy is delegated to us.
+ * Existing processes are moved to a leaf cgroup and controllers are enabled
+ * for the cgroups of services.
+ *
+ * @return -1 if cgroups are not available, 0 otherwise.
+ */
+int cgroup_init();
+
+/**
+ * Check if cgroups are available.
+ *
+ * @return true if cgroups have been initialized successfully.
+ */
+bool cgroup_available();
+
+/**
+ * Get the name of the cgroup file controlling a limit.
+ *
+ * @param[in] limit The limit.
+ *
+ * @return Name of the file (e.g. 'memory.max').
+ */
+const char *cgroup_limit_name(cgroup_limit_t limit);
+
+/**
+ * Create the cgroup of a service.
+ *
+ * @param[in] name Name of the service.
+ *
+ * @return -1 if an error occurred, 0 otherwise.
+ */
+int cgroup_create(const char *name);
+
+/**
+ * Remove the cgroup of a service.
+ *
+ * This fails if the cgroup still contains processes.
+ *
+ * @param[in] name Name of the service.
+ *
+ * @return -1 if an error occurred, 0 otherwise.
+ */
+int cgroup_destroy(const char *name);
+
+/**
+ * Write a value to a file of a service's cgroup.
+ *
+ * @param[in] name Name of the service.
+ * @param[in] file Name of the cgroup file.
+ * @param[in] value Value to write.
+ *
+ * @return -1 if an error occurred, 0 otherwise.
+ */
+int cgroup_write(const char *name, const char *file, const char *value);
+
+/**
+ * Read a file of a service's cgroup.
+ *
+ * @param[in] name Name of the service.
+ * @param[in] file Name of the cgroup file.
+ * @param[out] buf Where to store the content, null terminated.
+ * @param[in] bufsize Size of the buffer.
+ *
+ * @return -1 if an error occurred, 0 otherwise.
+ */
+int cgroup_read(const char *name, const char *file, char *buf, size_t bufsize);
+
+/**
+ * Move the calling process to the cgroup of a service.
+ *
+ * This is intended to be called by a child process, before executing the
+ * service.
+ *
+ * @param[in] name Name of the service.
+ *
+ * @return -1 if an error occurred, 0 otherwise.
+ */
+int cgroup_attach(const char *name);
+
+/**
+ * Send a signal to all processes of a service's cgroup.
+ *
+ * A signal of 0 can be used to count processes of the cgroup.
+ *
+ * @param[in] name Name of the service.
+ * @param[in] sig Signal to send.
+ *
+ * @return -1 if an error occurred, the number of processes signaled
+ *         otherwise.
+ */
+int cgroup_kill(const char *name, int sig);
+
+/**
+ * Get the name of the service cgroup a process belongs to.
+ *
+ * @param[in] pid PID of the process.
+ * @param[out] name Where to store the name of the service.
+ * @param[in] size Size of the name buffer.
+ *
+ * @return -1 if the process doesn't belong to a service cgroup, 0 otherwise.
+ */
+int cgroup_find(pid_t pid, char *name, size_t size);
+
+#endif // __CINIT_CGROUP_H__
@@ -16,11 +16,25 @@
 #include <sys/stat.h>
 #include <stdarg.h>
 #include <ctype.h>
+#include <math.h>
 #include <pty.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <syslog.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <sys/prctl.h>
+#include <linux/mempolicy.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include "utils.h"
 #include "log.h"
+#include "logrecv.h"
+#include "cgroup.h"
+#include "sampler.h"
+#include "psi.h"
+#include "probe.h"
 #include "CException.h"
 
 #if ATOMIC_BOOL_LOCK_FREE != 2
@@ -46,6 +60,40 @@
  */
 #define CMD_FIFO_PATH "/tmp/.cinit_cmd"
 
+/*
+ * Name of the environment variable exporting the path of the native log
+ * socket to services.
+ */
+#define LOG_SOCKET_ENV_VAR "CINIT_LOG_SOCKET"
+
+/*
+ * Name of the environment variable exporting the path of the notification
+ * socket to services, as expected by sd_notify(3) compatible libraries.
+ */
+#define NOTIFY_SOCKET_ENV_VAR "NOTIFY_SOCKET"
+
+/**
+ * Maximum size of a message received on the notification socket.
+ */
+#define NOTIFY_MAX_MSG_SIZE 4096
+
+/**
+ * Maximum amount of time (in msec) to wait for the reader of a command's reply
+ * to open its side of the named pipe.
+ */
+#define CMD_REPLY_TIMEOUT 100
+
+/**
+ * Size (in bytes) requested for the named pipe of a command's reply.  Replies
+ * are written without blocking, so the pipe should hold a complete reply.
+ */
+#define CMD_REPLY_PIPE_SIZE 1048576
+
+/**
+ * Default maximum amount of data (in bytes) that can be queued for logging.
+ */
+#define LOG_QUEUE_DEFAULT_SIZE 1048576
+
 /**
  * The maximum number of supported services.
  */
@@ -58,6 +106,37 @@
  */
 #define MIN_LOG_PREFIX_LENGTH 12
 
+/**
+ * The maximum number of listening sockets a service can have.
+ */
+#define MAX_NUM_SERVICE_LISTEN_FDS 16
+
+/**
+ * The maximum number of file descriptors a service can store.
+ */
+#define MAX_NUM_SERVICE_STORED_FDS 32
+
+/**
+ * Maximum size of the name of a stored file descriptor.
+ */
+#define STORED_FD_NAME_SIZE 64
+
+/**
+ * Name of stored file descriptors sent without name.
+ */
+#define STORED_FD_DEFAULT_NAME "stored"
+
+/**
+ * Name of listening sockets passed to services.
+ */
+#define LISTEN_FD_NAME "listen"
+
+/**
+ * First file descriptor of listening sockets passed to services, as expected
+ * by sd_listen_fds(3) compatible libraries.
+ */
+#define LISTEN_FDS_START 3
+
 /**
  * The maximum number of parameters a service's run program can have.
  */
@@ -116,17 +195,110 @@
  */
 #define SERVICE_SGID_LIST_SIZE 32
 
+/**
+ * Default size (in bytes) of pipes used to collect the output of services.
+ */
+#define SERVICE_DEFAULT_PIPE_SIZE 262144
+
+/**
+ * Default I/O priority level of services.
+ */
+#define SERVICE_DEFAULT_IOPRIO_LEVEL 4
+
+/**
+ * Default interval (in msec) between liveness probes of a service.
+ */
+#define SERVICE_DEFAULT_LIVENESS_INTERVAL 10000
+
+/**
+ * Default timeout (in msec) of liveness probes.
+ */
+#define SERVICE_DEFAULT_LIVENESS_TIMEOUT 1000
+
+/**
+ * Default number of consecutive liveness probe failures after which a
+ * service is restarted.
+ */
+#define SERVICE_DEFAULT_LIVENESS_FAILURE_THRESHOLD 3
+
+/**
+ * Maximum time (in msec) to wait for processes of a service to terminate
+ * after they have been killed.
+ */
+#define SERVICE_KILL_TIMEOUT 1000
+
+/**
+ * Default signal sent to a service exceeding its soft memory limit.
+ */
+#define SERVICE_DEFAULT_MEMORY_LIMIT_SIGNAL SIGHUP
+
+/**
+ * Percentage of the soft memory limit under which the memory usage of a
+ * service must go back before the limit signal can be sent again.
+ */
+#define MEMORY_SOFT_LIMIT_REARM_PERCENT 90
+
+/**
+ * Interval (in msec) of the resource sampler when started automatically to
+ * enforce memory limits.
+ */
+#define DEFAULT_MEMORY_LIMIT_SAMPLER_INTERVAL 5000
+
+/**
+ * Time window (in usec) of pressure triggers used for load shedding.  Two
+ * seconds is the smallest window allowed for unprivileged triggers.
+ */
+#define LOAD_SHEDDING_PSI_WINDOW 2000000
+
+/**
+ * Minimum time (in msec) load shedding stays active after the last pressure
+ * event.
+ */
+#define LOAD_SHEDDING_MIN_DURATION 30000
+
+/**
+ * Default load, per instance, above which a template is scaled up.
+ */
+#define SERVICE_DEFAULT_SCALE_UP_THRESHOLD 80
+
+/**
+ * Default load, per instance, below which a template is scaled down.
+ */
+#define SERVICE_DEFAULT_SCALE_DOWN_THRESHOLD 30
+
+/**
+ * Default minimum time (in msec) between two scalings of a template.
+ */
+#define SERVICE_DEFAULT_SCALE_COOLDOWN 30000
+
+/**
+ * Interval (in msec) at which the load of autoscaled templates is checked.
+ */
+#define SCALE_CHECK_INTERVAL 5000
+
+/**
+ * I/O scheduling classes and helpers, as defined by the kernel.
+ */
+#define IOPRIO_CLASS_NONE 0
+#define IOPRIO_CLASS_RT 1
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_PRIO_VALUE(class, data) (((class) << 13) | (data))
+
 #define FMT_LONG 41 /* enough space to hold -2^127 in decimal, plus \0 */
 
 #define MEMBER_SIZE(t, f) (sizeof(((t*)0)->f))
 
-#define FOR_EACH_SERVICE(s) for (int s = 0; s < DIM(g_ctx.services) && g_ctx.services[s].name[0] != '\0'; s++)
+// Slots of services removed by a rescan are left empty.
+#define FOR_EACH_SERVICE(s) for (int s = 0; s < DIM(g_ctx.services); s++) if (g_ctx.services[s].name[0] != '\0')
 
 #define SRV(i) g_ctx.services[i]
 
 #define SRV_ROOT() g_ctx.services_root
 
 #define MAX(a, b) ((a)>=(b)?(a):(b))
+#define MIN(a, b) ((a)<=(b)?(a):(b))
 
 #define ASSERT_LOG(a, ...) do { if (!(a)) { log_stdout("ASSERT: " __VA_ARGS__); log_stdout("\n"); assert(a); } } while(0)
 #define ASSERT_VALID_SERVICE_NAME(service) assert(service != NULL && service[0] != '\0')
@@ -146,12 +318,99 @@
 #define REQUEST_SHUTDOWN() do { do_shutdown = true; } while(0);
 #define BREAK_IF_SHUTDOWN_REQUESTED() if (SHUTDOWN_REQUESTED()) break
 
+/** Transport used to collect the output of a service. */
+typedef enum {
+    OUTPUT_MODE_PTY = 0,   /**< Single pseudo-terminal, stdout and stderr merged. */
+    OUTPUT_MODE_PTY_SPLIT, /**< One pseudo-terminal for each of stdout and stderr. */
+    OUTPUT_MODE_PIPE,      /**< One pipe for each of stdout and stderr. */
+} output_mode_t;
+
+/** Processes signaled when stopping a service. */
+typedef enum {
+    KILL_MODE_GROUP = 0,   /**< All processes of the service's process group. */
+    KILL_MODE_PROCESS,     /**< The main process only. */
+    KILL_MODE_CGROUP,      /**< All processes of the service's cgroup. */
+} kill_mode_t;
+
+/** Action taken on a service when shedding load. */
+typedef enum {
+    SHED_MODE_NONE = 0,    /**< Service is not sheddable. */
+    SHED_MODE_PAUSE,       /**< Processes of the service are paused. */
+    SHED_MODE_STOP,        /**< Service is stopped. */
+} shed_mode_t;
+
+/** How a service is restarted on request. */
+typedef enum {
+    RESTART_MODE_STOP = 0, /**< Stopped, then started again. */
+    RESTART_MODE_OVERLAP,  /**< New instance started, previous one stopped once it is ready. */
+} restart_mode_t;
+
+/** Load from which instances of a template are scaled. */
+typedef enum {
+    SCALE_METRIC_NONE = 0, /**< Fixed number of instances. */
+    SCALE_METRIC_CPU,      /**< Average CPU usage of instances (percent of one CPU). */
+    SCALE_METRIC_PSI,      /**< CPU pressure of the container (percent). */
+    SCALE_METRIC_NOTIFY,   /**< Average value reported by instances through notifications. */
+    SCALE_METRIC_FILE,     /**< Value read from a file, divided by the number of instances. */
+} scale_metric_t;
+
+/** Argument of a logger thread, freed once the thread is joined. */
+typedef struct {
+    int service;           /**< Index of the service. */
+    atomic_bool exit;      /**< Whether the logger should exit. */
+} logger_arg_t;
+
+/** Previous instance of a service, alive during an overlapped restart. */
+typedef struct {
+    pid_t pid;             /**< PID, 0 when terminated. */
+    pid_t pgid;            /**< Process group, 0 once empty. */
+    unsigned long start_time;
+    int stdout_fd;
+    int stderr_fd;
+    pthread_t logger;
+    logger_arg_t *logger_arg;
+    bool stopping;
+    bool stop_killed;
+    unsigned long stop_time;
+} service_run_t;
+
+/** When a service is started. */
+typedef enum {
+    START_MODE_ALWAYS = 0, /**< With other services. */
+    START_MODE_ON_DEMAND,  /**< On the first connection to its listening sockets. */
+} start_mode_t;
+
+/** Resource usage of a service, accumulated across runs. */
+typedef struct {
+    unsigned long runs;                   /**< Number of terminated runs. */
+    unsigned long long utime;             /**< User CPU time (usec). */
+    unsigned long long stime;             /**< System CPU time (usec). */
+    long max_rss;                         /**< Highest maximum resident set size (KiB). */
+    unsigned long long minflt;            /**< Minor page faults. */
+    unsigned long long majflt;            /**< Major page faults. */
+    unsigned long long nvcsw;             /**< Voluntary context switches. */
+    unsigned long long nivcsw;            /**< Involuntary context switches. */
+} service_usage_t;
+
 /** Definition of a service. */
 typedef struct {
     char name[255 + 1];
 
     bool disabled;
     bool is_service_group;
+    uint64_t config_hash;
+    bool scanned;
+    bool is_template;
+    unsigned int num_instances;
+    bool is_instance;
+    unsigned int instance;
+    unsigned int instances_min;
+    unsigned int instances_max;
+    scale_metric_t scale_metric;
+    char scale_metric_file[255 + 1];
+    unsigned int scale_up_threshold;
+    unsigned int scale_down_threshold;
+    unsigned int scale_cooldown;
 
     char *run_abs_path;
     char *param_list[MAX_NUM_SERVICE_RUN_PARAMS];
@@ -174,19 +433,77 @@ typedef struct {
     unsigned int min_running_time;
     unsigned int ready_timeout;
     unsigned int interval;
+    output_mode_t output_mode;
+    unsigned int pipe_size;
+    unsigned int log_ring_size;
+    char cgroup_limits[CGROUP_NUM_LIMITS][CGROUP_VALUE_SIZE];
+    bool cpu_affinity_set;
+    bool cpu_affinity_auto;
+    cpu_set_t cpu_affinity;
+    bool numa_policy_set;
+    int numa_policy;
+    cpu_set_t numa_nodes;
+    bool sched_policy_set;
+    int sched_policy;
+    int ioprio_class;
+    unsigned int ioprio_level;
+    bool timerslack_set;
+    unsigned int timerslack;
+    bool rlimit_set[RLIMIT_NLIMITS];
+    struct rlimit rlimits[RLIMIT_NLIMITS];
+    unsigned long long memory_soft_limit;
+    unsigned long long memory_hard_limit;
+    int memory_limit_signal;
+    bool oom_score_adj_set;
+    int oom_score_adj;
+    shed_mode_t shed_mode;
+    start_mode_t start_mode;
+    unsigned int idle_timeout;
+    int stop_signal;
+    unsigned int stop_timeout;
+    int reload_signal;
+    kill_mode_t kill_mode;
+    restart_mode_t restart_mode;
+    probe_t liveness;
+    unsigned int watchdog_interval;
+    int listen_fds[MAX_NUM_SERVICE_LISTEN_FDS];
+    size_t num_listen_fds;
+    unsigned int fdstore_max;
+    int stored_fds[MAX_NUM_SERVICE_STORED_FDS];
+    char stored_fd_names[MAX_NUM_SERVICE_STORED_FDS][STORED_FD_NAME_SIZE];
+    size_t num_stored_fds;
+    char directory[PATH_MAX];
 
     pid_t pid;
     unsigned long start_time;
-#ifdef SINGLE_CHILD_STDOUT_STDERR_STREAM
-    int output_fd;
-#else
     int stdout_fd;
     int stderr_fd;
-#endif
+    log_ring_t *log_ring;
     pthread_t logger;
-    atomic_bool logger_exit;
+    logger_arg_t *logger_arg;
     bool logger_started;
     bool restart_requested;
+    bool cgroup_created;
+    bool memory_soft_limit_reached;
+    bool shed;
+    pid_t pgid;
+    bool stopping;
+    bool stop_killed;
+    unsigned long stop_time;
+    bool reloading;
+    bool reload_unready;
+    unsigned long reload_time;
+    unsigned long watchdog_deadline;
+    bool activated;
+    bool idle_stopped;
+    unsigned long active_time;
+    unsigned long scale_time;
+    unsigned long scale_check_time;
+    bool retiring;
+    bool metric_set;
+    double metric;
+    service_run_t previous;
+    service_usage_t usage;
 } service_t;
 
 /** Context definition. */
@@ -197,14 +514,29 @@ typedef struct {
     bool debug;                           /**< Whether or not debug is enabled. */
     unsigned int services_gracetime;      /**< Services gracetimes (msec). */
     unsigned int default_srv_ready_timeout; /**< Maximum time (in msec) to wait for a service to be ready. */
+    unsigned int log_queue_size;          /**< Maximum amount of data (in bytes) queued for logging. */
+    log_overflow_policy_t log_overflow_policy; /**< Policy applied when the log queue is full. */
+    char syslog_socket[107 + 1];          /**< Path of the syslog socket, empty when disabled. */
+    int syslog_min_severity;              /**< Syslog messages less severe than this are discarded. */
+    char log_socket[107 + 1];             /**< Path of the native log socket, empty when disabled. */
+    char notify_socket[107 + 1];          /**< Path of the notification socket, empty when disabled. */
+    unsigned int sampler_interval;        /**< Interval (in msec) of the resource sampler, 0 when disabled. */
+    unsigned int load_shedding_threshold; /**< Pressure (in percent) above which load is shed, 0 when disabled. */
 
     uid_t default_srv_uid;                /**< Default UID of services. */
     gid_t default_srv_gid;                /**< Default GID of services. */
     gid_t default_srv_sgid_list[SERVICE_SGID_LIST_SIZE]; /**< Default supplementary group list of services. */
     size_t default_srv_sgid_list_size;    /**< Size of the default supplementary group list. */
     mode_t default_srv_umask;             /**< Default umask value of services. */
+    cpu_set_t allowed_cpus;               /**< CPUs we are allowed to run on. */
+    unsigned int next_auto_cpu;           /**< Next CPU to assign to services with automatic affinity. */
+    int psi_fds[PSI_NUM_RESOURCES];       /**< Pressure triggers, -1 when not available. */
+    bool load_shedding;                   /**< Whether or not load is currently shed. */
+    unsigned long load_shedding_time;     /**< Time of the latest pressure event. */
+    int notify_fd;                        /**< Notification socket, -1 when not available. */
 
     service_t services[MAX_NUM_SERVICES]; /**< Table of services. */
+    pthread_mutex_t services_mutex;       /**< Protects names of services, read by the log receiver's thread. */
     int start_order[MAX_NUM_SERVICES];    /**< Start order of services. */
     int exit_code;                        /**< Exit code to use when exiting. */
 } context_t;
@@ -212,6 +544,8 @@ typedef struct {
 extern char **environ;
 
 static volatile bool do_shutdown = false;
+static volatile bool do_rescan = false;
+static volatile sig_atomic_t shutdown_signal = 0;
 
 /* Declare the global context. */
 static context_t g_ctx = {
@@ -221,16 +555,49 @@ static context_t g_ctx = {
     .debug = false,
     .services_gracetime = SERVICES_DEFAULT_GRACETIME,
     .default_srv_ready_timeout = SERVICE_DEFAULT_READY_TIMEOUT,
+    .log_queue_size = LOG_QUEUE_DEFAULT_SIZE,
+    .log_overflow_policy = LOG_OVERFLOW_POLICY_DROP_OLDEST,
+    .syslog_socket = "",
+    .syslog_min_severity = LOG_DEBUG,
+    .log_socket = "",
+    .notify_socket = "",
+    .sampler_interval = 0,
+    .load_shedding_threshold = 0,
     .default_srv_uid = SERVICE_DEFAULT_UID,
     .default_srv_gid = SERVICE_DEFAULT_GID,
     .default_srv_sgid_list = { 0 },
     .default_srv_sgid_list_size = 0,
     .default_srv_umask = SERVICE_DEFAULT_UMASK,
+    .notify_fd = -1,
     .services = {},
+    .services_mutex = PTHREAD_MUTEX_INITIALIZER,
     .exit_code = 0,
 };
 
-static const char* const short_options = "dhr:g:t:p:u:i:m:s:";
+/* Resource limits that can be set per service. */
+static const struct {
+    const char *filename;
+    int resource;
+} rlimit_files[] = {
+    { "rlimit_as", RLIMIT_AS },
+    { "rlimit_core", RLIMIT_CORE },
+    { "rlimit_cpu", RLIMIT_CPU },
+    { "rlimit_data", RLIMIT_DATA },
+    { "rlimit_fsize", RLIMIT_FSIZE },
+    { "rlimit_locks", RLIMIT_LOCKS },
+    { "rlimit_memlock", RLIMIT_MEMLOCK },
+    { "rlimit_msgqueue", RLIMIT_MSGQUEUE },
+    { "rlimit_nice", RLIMIT_NICE },
+    { "rlimit_nofile", RLIMIT_NOFILE },
+    { "rlimit_nproc", RLIMIT_NPROC },
+    { "rlimit_rss", RLIMIT_RSS },
+    { "rlimit_rtprio", RLIMIT_RTPRIO },
+    { "rlimit_rttime", RLIMIT_RTTIME },
+    { "rlimit_sigpending", RLIMIT_SIGPENDING },
+    { "rlimit_stack", RLIMIT_STACK },
+};
+
+static const char* const short_options = "dhr:g:t:p:u:i:m:s:q:o:l:v:n:N:c:P:";
 static struct option long_options[] = {
     { "debug", no_argument, NULL, 'd' },
     { "progname", required_argument, NULL, 'p' },
@@ -241,12 +608,20 @@ static struct option long_options[] = {
     { "default-service-gid", required_argument, NULL, 'i' },
     { "default-service-sgid-list", required_argument, NULL, 's' },
     { "default-service-umask", required_argument, NULL, 'm' },
+    { "log-queue-size", required_argument, NULL, 'q' },
+    { "log-queue-overflow-policy", required_argument, NULL, 'o' },
+    { "syslog-socket", required_argument, NULL, 'l' },
+    { "syslog-min-severity", required_argument, NULL, 'v' },
+    { "log-socket", required_argument, NULL, 'n' },
+    { "notify-socket", required_argument, NULL, 'N' },
+    { "sampler-interval", required_argument, NULL, 'c' },
+    { "load-shedding-threshold", required_argument, NULL, 'P' },
     { "help", no_argument, NULL, 'h' },
     { NULL, 0, NULL, 0 }
 };
 
 // Forward declarations of internal functions.
-static void handle_killed(pid_t killed, int status);
+static void handle_killed(pid_t killed, int status, const struct rusage *usage);
 
 /**
  * Print error message with the latest errno and exit.
@@ -265,6 +640,22 @@ static void err(int eval, const char *fmt, ...)
     _exit(eval);
 }
 
+/**
+ * Print warning message with the latest errno.
+ *
+ * @param[in] fmt Format of the warning message.
+ * @param[in] ... Parameters of the warning message.
+ */
+static void warn(const char *fmt, ...)
+{
+    int errsv = errno;
+    va_list args;
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    fprintf(stderr, ": %s\n", strerror(errsv));
+}
+
 /**
  * Handler of the CHLD signal.
  *
@@ -278,25 +669,55 @@ static void sigchild(int sig)
 /**
  * Handler of the INT signal.
  *
+ * The signal is reported by the main loop: logging is not async-signal-safe.
+ *
  * @param[in] sig Signal received.
  */
 static void sigint(int sig)
 {
-    log("SIGINT received, shutting down...");
+    shutdown_signal = sig;
     REQUEST_SHUTDOWN();
 }
 
 /**
  * Handler of the TERM signal.
  *
+ * The signal is reported by the main loop: logging is not async-signal-safe.
+ *
  * @param[in] sig Signal received.
  */
 static void sigterm(int sig)
 {
-    log("SIGTERM received, shutting down...");
+    shutdown_signal = sig;
     REQUEST_SHUTDOWN();
 }
 
+/**
+ * Handler of the HUP signal.
+ *
+ * The signal is reported by the main loop: logging is not async-signal-safe.
+ *
+ * @param[in] sig Signal received.
+ */
+static void sighup(int sig)
+{
+    do_rescan = true;
+}
+
+/**
+ * Handler of the PIPE signal.
+ *
+ * The signal is handled, instead of being ignored, to make sure the default
+ * behavior is restored for executed programs.  Writing to a closed pipe then
+ * simply fails with EPIPE.
+ *
+ * @param[in] sig Signal received.
+ */
+static void sigpipe(int sig)
+{
+    // Nothing to do.
+}
+
 /**
  * Get string representation of a signal.
  *
@@ -467,7 +888,7 @@ static int exec_service_cmd(int service, const char *cmd, const char *cmd_path,
  * to both stdin and stderr of a service, by prefixing the name of the service
  * to every lines.
  *
- * @param[in] p Parameter to be casted as a service index.
+ * @param[in] p Parameter to be casted as a logger argument.
  *
  * @return NULL;
  */
@@ -478,21 +899,20 @@ static void *service_logger(void *p)
 
     // Service ID is passed as argument.
     ASSERT_LOG(p != NULL, "No argument passed to logger thread.");
-    service = *((int*)p);
+    logger_arg_t *arg = p;
+    service = arg->service;
     ASSERT_VALID_SERVICE_INDEX(service);
 
-    // Free argument.
-    free(p);
-
     // Build the prefix.
     snprintf(prefix, sizeof(prefix), "[%-*s] ", g_ctx.log_prefix_length, SRV(service).name);
 
-    // Start the logger.
-#ifdef SINGLE_CHILD_STDOUT_STDERR_STREAM
-    log_prefixer(prefix, SRV(service).output_fd, -1, &SRV(service).logger_exit);
-#else
-    log_prefixer(prefix, SRV(service).stdout_fd, SRV(service).stderr_fd, &SRV(service).logger_exit);
-#endif
+    // Start the logger. With a merged output stream, the stderr file
+    // descriptor is not used.
+    log_prefixer(prefix,
+            SRV(service).stdout_fd,
+            SRV(service).stderr_fd,
+            SRV(service).log_ring,
+            &arg->exit);
 
     return NULL;
 }
@@ -523,6 +943,53 @@ static void add_to_start_order(int service, int before_service)
     }
 }
 
+/**
+ * Remove a service from the start order.
+ *
+ * @param[in] service Index of the service.
+ */
+static void remove_from_start_order(int service)
+{
+    int n = 0;
+
+    for (int i = 0; i < DIM(g_ctx.start_order); i++) {
+        if (g_ctx.start_order[i] != service) {
+            g_ctx.start_order[n++] = g_ctx.start_order[i];
+        }
+    }
+    while (n < DIM(g_ctx.start_order)) {
+        g_ctx.start_order[n++] = -1;
+    }
+}
+
+/**
+ * Get the name of the directory defining a service.
+ *
+ * Instances of a template (e.g. 'worker@1') are defined by the directory of
+ * their template ('worker@').  A name only looks like an instance when the
+ * template directory doesn't exist: it is then a regular service.
+ *
+ * @param[in] service Name of the service.
+ * @param[out] dir Where to store the name of the directory.
+ * @param[in] size Size of the buffer.
+ */
+static void get_service_directory(const char *service, char *dir, size_t size)
+{
+    snprintf(dir, size, "%s", service);
+
+    char *at = strrchr(dir, '@');
+    if (at && at[1] != '\0' && strspn(at + 1, "0123456789") == strlen(at + 1)) {
+        char path[PATH_MAX];
+        struct stat st;
+
+        at[1] = '\0';
+        snprintf(path, sizeof(path), "%s/%s", SRV_ROOT(), dir);
+        if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+            snprintf(dir, size, "%s", service);
+        }
+    }
+}
+
 /**
  * Change the working directory to the service directory.
  *
@@ -530,9 +997,12 @@ static void add_to_start_order(int service, int before_service)
  */
 static void chdir_to_service(const char *service)
 {
+    char dir[MEMBER_SIZE(service_t, name)];
+
     ASSERT_VALID_SERVICE_NAME(service);
 
-    if (chdir(SRV_ROOT()) || chdir(service)) {
+    get_service_directory(service, dir, sizeof(dir));
+    if (chdir(SRV_ROOT()) || chdir(dir)) {
         switch (errno) {
             case ENOENT:
                 ThrowMessage("service directory not found");
@@ -561,6 +1031,23 @@ static int alloc_service_index()
     return -1;
 }
 
+/**
+ * Get the number of unused service indexes.
+ *
+ * @return The number of unused service indexes.
+ */
+static unsigned int count_free_service_indexes()
+{
+    unsigned int count = 0;
+
+    for (int sid = 0; sid < DIM(g_ctx.services); ++sid) {
+        if (strlen(SRV(sid).name) == 0) {
+            count++;
+        }
+    }
+    return count;
+}
+
 /**
  * Find the index of a service.
  *
@@ -597,6 +1084,52 @@ static int find_service_by_pid(pid_t pid)
     return -1;
 }
 
+/**
+ * Find the index of a service by the PID of its previous run.
+ *
+ * @param[in] pid PID of the previous run.
+ *
+ * @return Index of service in table or -1 if not found.
+ */
+static int find_service_by_previous_pid(pid_t pid)
+{
+    FOR_EACH_SERVICE(sid) {
+        if (SRV(sid).previous.pid == pid) {
+            return sid;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Find the index of the service a process belongs to.
+ *
+ * Services run in their own process group, so a process belongs to a service
+ * if it is the service itself or a member of its process group.  Processes
+ * that changed their process group are found via the cgroup of the service.
+ *
+ * @param[in] pid PID of the process.
+ *
+ * @return Index of service in table or -1 if not found.
+ */
+static int find_service_by_member(pid_t pid)
+{
+    int sid = find_service_by_pid(pid);
+    if (sid < 0) {
+        pid_t pgid = getpgid(pid);
+        if (pgid > 0) {
+            sid = find_service_by_pid(pgid);
+        }
+    }
+    if (sid < 0 && cgroup_available()) {
+        char name[MEMBER_SIZE(service_t, name)];
+        if (cgroup_find(pid, name, sizeof(name)) == 0) {
+            sid = find_service(name);
+        }
+    }
+    return sid;
+}
+
 /**
  * Check if a service is started.
  *
@@ -642,54 +1175,268 @@ static void unload_service(int service)
         SRV(service).run_abs_path = NULL;
     }
 
+    if (SRV(service).log_ring) {
+        log_ring_destroy(SRV(service).log_ring);
+        SRV(service).log_ring = NULL;
+    }
+
+    if (SRV(service).cgroup_created) {
+        cgroup_destroy(SRV(service).name);
+        SRV(service).cgroup_created = false;
+    }
+
+    for (unsigned int i = 0; i < SRV(service).num_listen_fds; i++) {
+        struct sockaddr_un addr;
+        socklen_t addrlen = sizeof(addr);
+
+        // Remove the file of Unix sockets. Instances share the sockets of
+        // their template.
+        if (!SRV(service).is_instance &&
+            getsockname(SRV(service).listen_fds[i], (struct sockaddr *)&addr, &addrlen) == 0 &&
+            addr.sun_family == AF_UNIX && addr.sun_path[0] != '\0') {
+            unlink(addr.sun_path);
+        }
+        close_fd(&SRV(service).listen_fds[i]);
+    }
+    SRV(service).num_listen_fds = 0;
+
+    for (unsigned int i = 0; i < SRV(service).num_stored_fds; i++) {
+        close_fd(&SRV(service).stored_fds[i]);
+    }
+    SRV(service).num_stored_fds = 0;
+
+    pthread_mutex_lock(&g_ctx.services_mutex);
     memset(&SRV(service), 0, sizeof(SRV(service)));
+    pthread_mutex_unlock(&g_ctx.services_mutex);
 }
 
 /**
- * Load a service in service table.
+ * Set the name of a service.
  *
- * @param[in] service Name of the service to be added.
+ * The service becomes visible to FOR_EACH_SERVICE() once named.
  *
- * @return Index of the added service in table or -1 on error.
+ * @param[in] service Index of the service.
+ * @param[in] name Name of the service.
  */
-static int load_service(const char *service)
+static void set_service_name(int service, const char *name)
 {
-    CEXCEPTION_T e;
+    pthread_mutex_lock(&g_ctx.services_mutex);
+    strcpy(SRV(service).name, name);
+    pthread_mutex_unlock(&g_ctx.services_mutex);
+}
 
-    int sid = -1;
+/**
+ * Create the cgroup of a service and apply its resource limits.
+ *
+ * @param[in] sid Index of the service.
+ * @param[in] service Name of the service.
+ */
+static void setup_service_cgroup(int sid, const char *service)
+{
+    bool has_limits = false;
 
-    ASSERT_VALID_SERVICE_NAME(service);
+    for (int i = 0; i < CGROUP_NUM_LIMITS; i++) {
+        if (SRV(sid).cgroup_limits[i][0] != '\0') {
+            has_limits = true;
+            break;
+        }
+    }
 
-    // Check if the service already exists.
-    sid = find_service(service);
-    if (sid >= 0) {
-        return sid;
+    if (!cgroup_available()) {
+        if (has_limits) {
+            log_err("cgroup limits of service '%s' ignored: cgroups not available.", service);
+        }
+        return;
     }
 
-    // Validate length of the service name.
-    if (strlen(service) >= MEMBER_SIZE(service_t, name)) {
-        ThrowMessage("name too long");
+    if (cgroup_create(service) < 0) {
+        log_err("could not create cgroup of service '%s': %s.", service, strerror(errno));
+        return;
     }
+    SRV(sid).cgroup_created = true;
 
-    // Change the working directory to the service directory.
-    chdir_to_service(service);
+    for (int i = 0; i < CGROUP_NUM_LIMITS; i++) {
+        if (SRV(sid).cgroup_limits[i][0] == '\0') {
+            continue;
+        }
+        if (cgroup_write(service, cgroup_limit_name(i), SRV(sid).cgroup_limits[i]) < 0) {
+            // A missing file means the controller is not enabled.
+            log_err("could not set '%s' of service '%s' to '%s': %s.",
+                    cgroup_limit_name(i), service, SRV(sid).cgroup_limits[i],
+                    errno == ENOENT ? "controller not available" : strerror(errno));
+        }
+        else {
+            log_debug("'%s' of service '%s' set to '%s'.",
+                    cgroup_limit_name(i), service, SRV(sid).cgroup_limits[i]);
+        }
+    }
+}
 
-    // Get a free index for the service.
-    sid = alloc_service_index();
-    if (sid < 0) {
-        ThrowMessage("maximum number of services reached");
+/**
+ * Create the listening sockets of a service.
+ *
+ * Addresses are read from a file of the service directory, one per line:
+ * '[ADDRESS:]PORT' for TCP sockets or an absolute path for Unix sockets.  A
+ * port alone means any IPv4 address.
+ *
+ * @param[in] sid Index of the service.
+ * @param[in] filename Name of the file listing addresses.
+ * @param[in] family Address family of the sockets (AF_INET or AF_UNIX).
+ */
+static void load_listen_sockets(int sid, const char *filename, int family)
+{
+    CEXCEPTION_T e;
+    char *buf = NULL;
+    char **lines = NULL;
+    size_t num_lines;
+
+    load_value_as_string(filename, &buf, 0);
+    if (!buf) {
+        return;
     }
 
-    // Now fill the entry.
+    // Before spliting on line-endings, make sure there is no Windows-style
+    // line-endings ('\r\n').
+    remove_all_char(buf, '\r');
+
+    lines = split(trim(buf), '\n', &num_lines, 0, 0);
+
     Try {
-        // Initialize service's structure.
+        if (!lines) {
+            ThrowMessage("out of memory");
+        }
+        for (size_t i = 0; i < num_lines; i++) {
+            struct sockaddr_storage addr;
+            socklen_t addrlen;
+            char *line = trim(lines[i]);
+
+            if (line[0] == '\0') {
+                continue;
+            }
+            else if (SRV(sid).num_listen_fds >= DIM(SRV(sid).listen_fds)) {
+                ThrowMessage("too many listening sockets");
+            }
+
+            if (family == AF_UNIX) {
+                struct sockaddr_un *un = (struct sockaddr_un *)&addr;
+                if (line[0] != '/' || strlen(line) >= sizeof(un->sun_path)) {
+                    ThrowMessage("invalid socket path '%.64s'", line);
+                }
+                memset(&addr, 0, sizeof(addr));
+                un->sun_family = AF_UNIX;
+                strcpy(un->sun_path, line);
+                addrlen = sizeof(*un);
+            }
+            else {
+                char any[16];
+                const char *address = line;
+                if (strspn(line, "0123456789") == strlen(line)) {
+                    snprintf(any, sizeof(any), "0.0.0.0:%.5s", line);
+                    address = any;
+                }
+                if (parse_inet_address(address, strlen(address), 0, &addr, &addrlen) < 0) {
+                    ThrowMessage("invalid address '%.64s'", line);
+                }
+            }
+
+            int fd = create_listening_socket(&addr, addrlen);
+            if (fd < 0) {
+                ThrowMessageWithErrno("could not listen on '%.64s': ", line);
+            }
+            SRV(sid).listen_fds[SRV(sid).num_listen_fds++] = fd;
+        }
+        free(lines);
+        free(buf);
+    }
+    Catch (e) {
+        free(lines);
+        free(buf);
+        ThrowMessage("could not load '%s': %s", filename, e.mMessage);
+    }
+}
+
+/**
+ * Pin a service to the next CPU we are allowed to use.
+ *
+ * Services are spread across the CPUs, one CPU per service.
+ *
+ * @param[in] sid Index of the service.
+ */
+static void assign_auto_cpu_affinity(int sid)
+{
+    int n = g_ctx.next_auto_cpu++ % MAX(CPU_COUNT(&g_ctx.allowed_cpus), 1);
+    CPU_ZERO(&SRV(sid).cpu_affinity);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &g_ctx.allowed_cpus) && n-- == 0) {
+            CPU_SET(cpu, &SRV(sid).cpu_affinity);
+            SRV(sid).cpu_affinity_set = true;
+            break;
+        }
+    }
+}
+
+/**
+ * Load a service in service table.
+ *
+ * @param[in] service Name of the service to be added.
+ *
+ * @return Index of the added service in table or -1 on error.
+ */
+static int load_service(const char *service)
+{
+    CEXCEPTION_T e;
+
+    int sid = -1;
+    bool is_template = ends_with(service, "@");
+
+    ASSERT_VALID_SERVICE_NAME(service);
+
+    // Check if the service already exists.
+    sid = find_service(service);
+    if (sid >= 0) {
+        return sid;
+    }
+
+    // Validate length of the service name.
+    if (strlen(service) >= MEMBER_SIZE(service_t, name)) {
+        ThrowMessage("name too long");
+    }
+
+    // Instances are created from their template only.
+    {
+        char dir[MEMBER_SIZE(service_t, name)];
+        get_service_directory(service, dir, sizeof(dir));
+        if (strcmp(dir, service) != 0) {
+            ThrowMessage("instance of template '%s' cannot be loaded directly", dir);
+        }
+    }
+
+    // Change the working directory to the service directory.
+    chdir_to_service(service);
+
+    // Get a free index for the service.
+    sid = alloc_service_index();
+    if (sid < 0) {
+        ThrowMessage("maximum number of services reached");
+    }
+
+    // Now fill the entry.
+    Try {
+        // Initialize service's structure.
         memset(&SRV(sid), 0, sizeof(SRV(sid)));
-#ifdef SINGLE_CHILD_STDOUT_STDERR_STREAM
-        SRV(sid).output_fd = -1;
-#else
         SRV(sid).stdout_fd = -1;
         SRV(sid).stderr_fd = -1;
-#endif
+        SRV(sid).previous.stdout_fd = -1;
+        SRV(sid).previous.stderr_fd = -1;
+        SRV(sid).output_mode = OUTPUT_MODE_PTY;
+        SRV(sid).pipe_size = SERVICE_DEFAULT_PIPE_SIZE;
+        SRV(sid).ioprio_level = SERVICE_DEFAULT_IOPRIO_LEVEL;
+        SRV(sid).memory_limit_signal = SERVICE_DEFAULT_MEMORY_LIMIT_SIGNAL;
+        SRV(sid).stop_signal = SIGTERM;
+        SRV(sid).liveness.interval = SERVICE_DEFAULT_LIVENESS_INTERVAL;
+        SRV(sid).liveness.timeout = SERVICE_DEFAULT_LIVENESS_TIMEOUT;
+        SRV(sid).liveness.failure_threshold = SERVICE_DEFAULT_LIVENESS_FAILURE_THRESHOLD;
+        SRV(sid).stop_timeout = g_ctx.services_gracetime;
         SRV(sid).uid = g_ctx.default_srv_uid;
         SRV(sid).gid = g_ctx.default_srv_gid;
         memcpy(SRV(sid).sgid_list, g_ctx.default_srv_sgid_list, sizeof(SRV(sid).sgid_list));
@@ -698,6 +1445,12 @@ static int load_service(const char *service)
         SRV(sid).ready_timeout = g_ctx.default_srv_ready_timeout;
         SRV(sid).min_running_time = SERVICE_DEFAULT_MIN_RUNNING_TIME;
 
+        // Hash the definition of the service, to detect changes on rescan.
+        // Dependencies don't change the service itself.
+        if (hash_directory(".", ".dep", &SRV(sid).config_hash) < 0) {
+            ThrowMessageWithErrno("could not read service directory");
+        }
+
         // Check if this is a service group.
         SRV(sid).is_service_group = (access("run", F_OK) != 0);
 
@@ -706,7 +1459,7 @@ static int load_service(const char *service)
 
         // Return now if nothing else to load.
         if (SRV(sid).is_service_group || SRV(sid).disabled) {
-            strcpy(SRV(sid).name, service);
+            set_service_name(sid, service);
             ExitTry();
         }
 
@@ -951,6 +1704,385 @@ static int load_service(const char *service)
         load_value_as_uint("min_running_time", &SRV(sid).min_running_time);
         load_value_as_uint("ready_timeout", &SRV(sid).ready_timeout);
         load_value_as_interval("interval", &SRV(sid).interval);
+        {
+            char buf[32];
+            char *ptr = buf;
+            if (load_value_as_string("output_mode", &ptr, sizeof(buf))) {
+                terminate_at_first_eol(buf);
+                trim(buf);
+                if (strcasecmp(buf, "pty") == 0) {
+                    SRV(sid).output_mode = OUTPUT_MODE_PTY;
+                }
+                else if (strcasecmp(buf, "pty-split") == 0) {
+                    SRV(sid).output_mode = OUTPUT_MODE_PTY_SPLIT;
+                }
+                else if (strcasecmp(buf, "pipe") == 0) {
+                    SRV(sid).output_mode = OUTPUT_MODE_PIPE;
+                }
+                else {
+                    ThrowMessage("could not load 'output_mode': invalid value '%s'", buf);
+                }
+            }
+        }
+        {
+            char buf[32];
+            char *ptr = buf;
+            if (load_value_as_string("sheddable", &ptr, sizeof(buf))) {
+                terminate_at_first_eol(buf);
+                trim(buf);
+                if (strcasecmp(buf, "pause") == 0) {
+                    SRV(sid).shed_mode = SHED_MODE_PAUSE;
+                }
+                else if (strcasecmp(buf, "stop") == 0) {
+                    SRV(sid).shed_mode = SHED_MODE_STOP;
+                }
+                else {
+                    ThrowMessage("could not load 'sheddable': invalid value '%s'", buf);
+                }
+            }
+        }
+        {
+            char buf[32];
+            char *ptr = buf;
+            if (load_value_as_string("start_mode", &ptr, sizeof(buf))) {
+                terminate_at_first_eol(buf);
+                trim(buf);
+                if (strcasecmp(buf, "always") == 0) {
+                    SRV(sid).start_mode = START_MODE_ALWAYS;
+                }
+                else if (strcasecmp(buf, "on_demand") == 0) {
+                    SRV(sid).start_mode = START_MODE_ON_DEMAND;
+                }
+                else {
+                    ThrowMessage("could not load 'start_mode': invalid value '%s'", buf);
+                }
+            }
+        }
+        load_value_as_uint("idle_timeout", &SRV(sid).idle_timeout);
+        if (is_template) {
+            char buf[32];
+            char *ptr = buf;
+
+            SRV(sid).num_instances = 1;
+            if (load_value_as_string("instances", &ptr, sizeof(buf))) {
+                terminate_at_first_eol(buf);
+                trim(buf);
+                if (strcasecmp(buf, "auto") == 0) {
+                    // One instance per CPU we are allowed to use, within the
+                    // free entries of the table of services.
+                    unsigned int num_free = count_free_service_indexes();
+                    SRV(sid).num_instances = MAX(CPU_COUNT(&g_ctx.allowed_cpus), 1);
+                    if (SRV(sid).num_instances > num_free) {
+                        log("service '%s' limited to %u instance(s): maximum number of services reached.",
+                                service, num_free);
+                        SRV(sid).num_instances = num_free;
+                    }
+                }
+                else {
+                    Try {
+                        string_to_uint(buf, &SRV(sid).num_instances);
+                    }
+                    Catch (e) {
+                        ThrowMessage("could not load 'instances': %s", e.mMessage);
+                    }
+                }
+            }
+            if (SRV(sid).num_instances == 0) {
+                ThrowMessage("could not load 'instances': at least one instance required");
+            }
+
+            // Scale instances according to a load metric.
+            char metric[sizeof(SRV(sid).scale_metric_file) + 8];
+            ptr = metric;
+            if (load_value_as_string("scale_metric", &ptr, sizeof(metric))) {
+                terminate_at_first_eol(metric);
+                trim(metric);
+                if (strcasecmp(metric, "cpu") == 0) {
+                    SRV(sid).scale_metric = SCALE_METRIC_CPU;
+                }
+                else if (strcasecmp(metric, "psi") == 0) {
+                    SRV(sid).scale_metric = SCALE_METRIC_PSI;
+                }
+                else if (strcasecmp(metric, "notify") == 0) {
+                    SRV(sid).scale_metric = SCALE_METRIC_NOTIFY;
+                }
+                else if (strncasecmp(metric, "file:", 5) == 0 && metric[5] == '/') {
+                    SRV(sid).scale_metric = SCALE_METRIC_FILE;
+                    strcpy(SRV(sid).scale_metric_file, metric + 5);
+                }
+                else {
+                    ThrowMessage("could not load 'scale_metric': invalid value '%s'", metric);
+                }
+            }
+            if (SRV(sid).scale_metric != SCALE_METRIC_NONE) {
+                SRV(sid).instances_min = 1;
+                SRV(sid).instances_max = MAX(CPU_COUNT(&g_ctx.allowed_cpus), 1);
+                SRV(sid).scale_up_threshold = SERVICE_DEFAULT_SCALE_UP_THRESHOLD;
+                SRV(sid).scale_down_threshold = SERVICE_DEFAULT_SCALE_DOWN_THRESHOLD;
+                SRV(sid).scale_cooldown = SERVICE_DEFAULT_SCALE_COOLDOWN;
+                load_value_as_uint("instances_min", &SRV(sid).instances_min);
+                load_value_as_uint("instances_max", &SRV(sid).instances_max);
+                load_value_as_uint("scale_up_threshold", &SRV(sid).scale_up_threshold);
+                load_value_as_uint("scale_down_threshold", &SRV(sid).scale_down_threshold);
+                load_value_as_uint("scale_cooldown", &SRV(sid).scale_cooldown);
+                if (SRV(sid).instances_min == 0 || SRV(sid).instances_max < SRV(sid).instances_min) {
+                    ThrowMessage("invalid range of instances: %u to %u",
+                            SRV(sid).instances_min, SRV(sid).instances_max);
+                }
+                else if (SRV(sid).scale_down_threshold >= SRV(sid).scale_up_threshold) {
+                    ThrowMessage("scale down threshold must be lower than scale up threshold");
+                }
+                SRV(sid).num_instances = MAX(SRV(sid).num_instances, SRV(sid).instances_min);
+                SRV(sid).num_instances = MIN(SRV(sid).num_instances, SRV(sid).instances_max);
+            }
+        }
+        {
+            char buf[32];
+            char *ptr = buf;
+            if (load_value_as_string("restart_mode", &ptr, sizeof(buf))) {
+                terminate_at_first_eol(buf);
+                trim(buf);
+                if (strcasecmp(buf, "stop") == 0) {
+                    SRV(sid).restart_mode = RESTART_MODE_STOP;
+                }
+                else if (strcasecmp(buf, "overlap") == 0) {
+                    SRV(sid).restart_mode = RESTART_MODE_OVERLAP;
+                }
+                else {
+                    ThrowMessage("could not load 'restart_mode': invalid value '%s'", buf);
+                }
+            }
+        }
+        load_value_as_signal("stop_signal", &SRV(sid).stop_signal);
+        load_value_as_uint("stop_timeout", &SRV(sid).stop_timeout);
+        load_value_as_signal("reload_signal", &SRV(sid).reload_signal);
+        {
+            char buf[32];
+            char *ptr = buf;
+            if (load_value_as_string("kill_mode", &ptr, sizeof(buf))) {
+                terminate_at_first_eol(buf);
+                trim(buf);
+                if (strcasecmp(buf, "group") == 0) {
+                    SRV(sid).kill_mode = KILL_MODE_GROUP;
+                }
+                else if (strcasecmp(buf, "process") == 0) {
+                    SRV(sid).kill_mode = KILL_MODE_PROCESS;
+                }
+                else if (strcasecmp(buf, "cgroup") == 0) {
+                    SRV(sid).kill_mode = KILL_MODE_CGROUP;
+                }
+                else {
+                    ThrowMessage("could not load 'kill_mode': invalid value '%s'", buf);
+                }
+            }
+        }
+        {
+            char buf[PROBE_PATH_SIZE + 64];
+            char *ptr = buf;
+            if (load_value_as_string("liveness", &ptr, sizeof(buf))) {
+                terminate_at_first_eol(buf);
+                trim(buf);
+                if (probe_parse(buf, &SRV(sid).liveness) < 0) {
+                    ThrowMessage("could not load 'liveness': invalid value '%s'", buf);
+                }
+            }
+        }
+        load_value_as_uint("liveness_interval", &SRV(sid).liveness.interval);
+        load_value_as_uint("liveness_timeout", &SRV(sid).liveness.timeout);
+        load_value_as_uint("liveness_failure_threshold", &SRV(sid).liveness.failure_threshold);
+        if (SRV(sid).liveness.interval == 0 || SRV(sid).liveness.failure_threshold == 0) {
+            ThrowMessage("liveness interval and failure threshold cannot be 0");
+        }
+        load_value_as_uint("watchdog_interval", &SRV(sid).watchdog_interval);
+        load_value_as_uint("fdstore_max", &SRV(sid).fdstore_max);
+        if (SRV(sid).fdstore_max > MAX_NUM_SERVICE_STORED_FDS) {
+            ThrowMessage("file descriptor store cannot hold more than %d file descriptors",
+                    MAX_NUM_SERVICE_STORED_FDS);
+        }
+        load_value_as_uint("pipe_size", &SRV(sid).pipe_size);
+        load_value_as_uint("log_ring_size", &SRV(sid).log_ring_size);
+        {
+            char buf[256];
+            char *ptr = buf;
+            if (load_value_as_string("cpu_affinity", &ptr, sizeof(buf))) {
+                terminate_at_first_eol(buf);
+                trim(buf);
+                if (strcasecmp(buf, "auto") == 0) {
+                    // With a template, a CPU is assigned to each instance.
+                    SRV(sid).cpu_affinity_auto = true;
+                    if (!is_template) {
+                        assign_auto_cpu_affinity(sid);
+                    }
+                }
+                else {
+                    Try {
+                        string_to_cpu_set(buf, &SRV(sid).cpu_affinity);
+                    }
+                    Catch (e) {
+                        ThrowMessage("could not load 'cpu_affinity': %s", e.mMessage);
+                    }
+                    SRV(sid).cpu_affinity_set = true;
+                }
+            }
+        }
+        {
+            char buf[256];
+            char *ptr = buf;
+            if (load_value_as_string("numa_policy", &ptr, sizeof(buf))) {
+                terminate_at_first_eol(buf);
+                trim(buf);
+
+                // The policy is optionally followed by a list of nodes.
+                char *nodes = strchr(buf, ':');
+                if (nodes) {
+                    *nodes++ = '\0';
+                }
+
+                if (strcasecmp(buf, "default") == 0) {
+                    SRV(sid).numa_policy = MPOL_DEFAULT;
+                }
+                else if (strcasecmp(buf, "local") == 0) {
+                    SRV(sid).numa_policy = MPOL_LOCAL;
+                }
+                else if (strcasecmp(buf, "interleave") == 0) {
+                    SRV(sid).numa_policy = MPOL_INTERLEAVE;
+                }
+                else if (strcasecmp(buf, "bind") == 0) {
+                    SRV(sid).numa_policy = MPOL_BIND;
+                }
+                else if (strcasecmp(buf, "preferred") == 0) {
+                    SRV(sid).numa_policy = MPOL_PREFERRED;
+                }
+                else {
+                    ThrowMessage("could not load 'numa_policy': invalid policy '%s'", buf);
+                }
+
+                CPU_ZERO(&SRV(sid).numa_nodes);
+                if (SRV(sid).numa_policy == MPOL_DEFAULT || SRV(sid).numa_policy == MPOL_LOCAL) {
+                    if (nodes) {
+                        ThrowMessage("could not load 'numa_policy': policy '%s' doesn't take nodes", buf);
+                    }
+                }
+                else if (nodes) {
+                    Try {
+                        string_to_cpu_set(nodes, &SRV(sid).numa_nodes);
+                    }
+                    Catch (e) {
+                        ThrowMessage("could not load 'numa_policy': %s", e.mMessage);
+                    }
+                }
+                else if (SRV(sid).numa_policy == MPOL_INTERLEAVE) {
+                    // Interleave across all online nodes.
+                    char online[256];
+                    char *online_ptr = online;
+                    Try {
+                        read_file("/sys/devices/system/node/online", &online_ptr, sizeof(online));
+                        terminate_at_first_eol(online);
+                        string_to_cpu_set(online, &SRV(sid).numa_nodes);
+                    }
+                    Catch (e) {
+                        CPU_SET(0, &SRV(sid).numa_nodes);
+                    }
+                }
+                else {
+                    ThrowMessage("could not load 'numa_policy': policy '%s' requires nodes", buf);
+                }
+                SRV(sid).numa_policy_set = true;
+            }
+        }
+        {
+            char buf[32];
+            char *ptr = buf;
+            if (load_value_as_string("sched_policy", &ptr, sizeof(buf))) {
+                terminate_at_first_eol(buf);
+                trim(buf);
+                if (strcasecmp(buf, "other") == 0) {
+                    SRV(sid).sched_policy = SCHED_OTHER;
+                }
+                else if (strcasecmp(buf, "batch") == 0) {
+                    SRV(sid).sched_policy = SCHED_BATCH;
+                }
+                else if (strcasecmp(buf, "idle") == 0) {
+                    SRV(sid).sched_policy = SCHED_IDLE;
+                }
+                else {
+                    ThrowMessage("could not load 'sched_policy': invalid value '%s'", buf);
+                }
+                SRV(sid).sched_policy_set = true;
+            }
+        }
+        {
+            char buf[32];
+            char *ptr = buf;
+            if (load_value_as_string("ioprio_class", &ptr, sizeof(buf))) {
+                terminate_at_first_eol(buf);
+                trim(buf);
+                if (strcasecmp(buf, "idle") == 0) {
+                    SRV(sid).ioprio_class = IOPRIO_CLASS_IDLE;
+                }
+                else if (strcasecmp(buf, "best-effort") == 0) {
+                    SRV(sid).ioprio_class = IOPRIO_CLASS_BE;
+                }
+                else if (strcasecmp(buf, "realtime") == 0) {
+                    SRV(sid).ioprio_class = IOPRIO_CLASS_RT;
+                }
+                else {
+                    ThrowMessage("could not load 'ioprio_class': invalid value '%s'", buf);
+                }
+            }
+        }
+        if (load_value_as_uint("ioprio_level", &SRV(sid).ioprio_level)) {
+            if (SRV(sid).ioprio_level > 7) {
+                ThrowMessage("could not load 'ioprio_level': out of range");
+            }
+            else if (SRV(sid).ioprio_class == IOPRIO_CLASS_NONE) {
+                SRV(sid).ioprio_class = IOPRIO_CLASS_BE;
+            }
+        }
+        SRV(sid).timerslack_set = load_value_as_uint("timerslack", &SRV(sid).timerslack);
+        for (int i = 0; i < DIM(rlimit_files); i++) {
+            char buf[64];
+            char *ptr = buf;
+            int resource = rlimit_files[i].resource;
+            if (load_value_as_string(rlimit_files[i].filename, &ptr, sizeof(buf))) {
+                terminate_at_first_eol(buf);
+                trim(buf);
+                Try {
+                    string_to_rlimit(buf, &SRV(sid).rlimits[resource]);
+                }
+                Catch (e) {
+                    ThrowMessage("could not load '%s': %s", rlimit_files[i].filename, e.mMessage);
+                }
+                SRV(sid).rlimit_set[resource] = true;
+            }
+        }
+        load_value_as_size("memory_soft_limit", &SRV(sid).memory_soft_limit);
+        load_value_as_size("memory_hard_limit", &SRV(sid).memory_hard_limit);
+        if (SRV(sid).memory_soft_limit > 0 && SRV(sid).memory_hard_limit > 0 &&
+            SRV(sid).memory_soft_limit >= SRV(sid).memory_hard_limit) {
+            ThrowMessage("'memory_soft_limit' must be lower than 'memory_hard_limit'");
+        }
+        load_value_as_signal("memory_limit_signal", &SRV(sid).memory_limit_signal);
+        if (load_value_as_int("oom_score_adj", &SRV(sid).oom_score_adj)) {
+            if (SRV(sid).oom_score_adj < -1000 || SRV(sid).oom_score_adj > 1000) {
+                ThrowMessage("could not load 'oom_score_adj': out of range");
+            }
+            SRV(sid).oom_score_adj_set = true;
+        }
+        for (int i = 0; i < CGROUP_NUM_LIMITS; i++) {
+            // The name of the file is the name of the cgroup file, with the
+            // dot replaced by an underscore (e.g. 'memory_max').
+            char filename[32];
+            char *ptr = SRV(sid).cgroup_limits[i];
+
+            snprintf(filename, sizeof(filename), "%s", cgroup_limit_name(i));
+            *strchr(filename, '.') = '_';
+
+            if (load_value_as_string(filename, &ptr, sizeof(SRV(sid).cgroup_limits[i]))) {
+                terminate_at_first_eol(SRV(sid).cgroup_limits[i]);
+                trim(SRV(sid).cgroup_limits[i]);
+            }
+        }
 
         // Do some validations.
         if (SRV(sid).respawn && SRV(sid).sync) {
@@ -959,6 +2091,15 @@ static int load_service(const char *service)
         else if (SRV(sid).respawn && SRV(sid).interval > 0) {
             ThrowMessage("interval cannot be used with respawned service");
         }
+        else if (SRV(sid).restart_mode == RESTART_MODE_OVERLAP &&
+                 (SRV(sid).sync || SRV(sid).interval > 0)) {
+            ThrowMessage("overlapped restart cannot be used with sync or interval service");
+        }
+        else if (SRV(sid).restart_mode == RESTART_MODE_OVERLAP &&
+                 SRV(sid).kill_mode == KILL_MODE_CGROUP) {
+            // Both runs share the cgroup: stopping one would kill the other.
+            ThrowMessage("overlapped restart cannot be used with the cgroup kill mode");
+        }
 
         // The per-service ready timeout is configured statically, while the
         // default value can be adjusted dynamically. If the default value is
@@ -966,11 +2107,45 @@ static int load_service(const char *service)
         // value should be taken instead.
         SRV(sid).ready_timeout = MAX(SRV(sid).ready_timeout, g_ctx.default_srv_ready_timeout);
 
+        // Create the ring buffer keeping the most recent lines of the
+        // service.
+        if (SRV(sid).log_ring_size > 0) {
+            SRV(sid).log_ring = log_ring_create(SRV(sid).log_ring_size);
+            if (!SRV(sid).log_ring) {
+                ThrowMessage("could not create log ring buffer: out of memory");
+            }
+        }
+
+        // Create listening sockets. They are owned by us, so clients can
+        // connect before the service is started and while it restarts.
+        load_listen_sockets(sid, "listen_tcp", AF_INET);
+        load_listen_sockets(sid, "listen_unix", AF_UNIX);
+        if (SRV(sid).start_mode == START_MODE_ON_DEMAND) {
+            if (SRV(sid).num_listen_fds == 0) {
+                ThrowMessage("on demand start requires listening sockets");
+            }
+            else if (SRV(sid).sync || SRV(sid).interval > 0) {
+                ThrowMessage("on demand start cannot be used with 'sync' or 'interval'");
+            }
+        }
+
         // PID of 0 means service not running.
         SRV(sid).pid = 0;
 
+        // Create the cgroup of the service. Failures are not fatal: the
+        // service then runs in the cgroup of the process supervisor. A
+        // template is never run itself: like a service group, it is only
+        // part of the start order, in place of its instances.
+        if (is_template) {
+            SRV(sid).is_template = true;
+            SRV(sid).is_service_group = true;
+        }
+        else {
+            setup_service_cgroup(sid, service);
+        }
+
         // Set the service name at the end, when all validation is done.
-        strcpy(SRV(sid).name, service);
+        set_service_name(sid, service);
     }
     Catch (e) {
         unload_service(sid);
@@ -981,64 +2156,276 @@ static int load_service(const char *service)
 }
 
 /**
- * Fork and exec into a service.
- *
- * NOTE: Must be called from inside the service directory.
+ * Copy a list of strings of a template to one of its instances.
  *
- * @param[in] service Index of the service.
+ * Occurences of '%i' are replaced by the instance number.
  *
- * @return PID of the service or 0 on error.
+ * @param[in] src List of the template.
+ * @param[in] src_size Size of the list of the template.
+ * @param[out] dst List of the instance.
+ * @param[out] dst_size Size of the list of the instance.
+ * @param[in] instance Instance number.
  */
-static pid_t fork_and_exec(int service)
+static void copy_template_list(char * const *src, size_t src_size, char **dst, size_t *dst_size,
+                               const char *instance)
+{
+    for (size_t i = 0; i < src_size; i++) {
+        // An empty environment is a single NULL entry.
+        if (src[i] == NULL) {
+            dst[(*dst_size)++] = NULL;
+            continue;
+        }
+
+        dst[*dst_size] = replace_all_str(src[i], "%i", instance);
+        if (!dst[*dst_size]) {
+            ThrowMessage("out of memory");
+        }
+        (*dst_size)++;
+    }
+}
+
+/**
+ * Create an instance of a template.
+ *
+ * The instance gets a copy of the definition of its template, with its own
+ * copy of listening sockets, log ring buffer and cgroup.
+ *
+ * @param[in] tid Index of the template.
+ * @param[in] instance Instance number.
+ *
+ * @return Index of the instance.
+ */
+static int create_instance(int tid, unsigned int instance)
+{
+    CEXCEPTION_T e;
+
+    char name[MEMBER_SIZE(service_t, name)];
+    char instance_str[FMT_LONG];
+
+    snprintf(instance_str, sizeof(instance_str), "%u", instance);
+    if (snprintf(name, sizeof(name), "%s%s", SRV(tid).name, instance_str) >= sizeof(name)) {
+        ThrowMessage("name of instance %u too long", instance);
+    }
+
+    int sid = alloc_service_index();
+    if (sid < 0) {
+        ThrowMessage("maximum number of services reached");
+    }
+
+    Try {
+        memcpy(&SRV(sid), &SRV(tid), sizeof(SRV(sid)));
+
+        // Resources of the template are not shared.
+        SRV(sid).name[0] = '\0';
+        SRV(sid).is_template = false;
+        SRV(sid).is_service_group = false;
+        SRV(sid).is_instance = true;
+        SRV(sid).instance = instance;
+        SRV(sid).run_abs_path = NULL;
+        SRV(sid).param_list_size = 0;
+        SRV(sid).environment_size = 0;
+        SRV(sid).environment_extra_size = 0;
+        SRV(sid).log_ring = NULL;
+        SRV(sid).num_listen_fds = 0;
+        SRV(sid).cgroup_created = false;
+        SRV(sid).num_stored_fds = 0;
+
+        SRV(sid).run_abs_path = strdup(SRV(tid).run_abs_path);
+        if (!SRV(sid).run_abs_path) {
+            ThrowMessage("out of memory");
+        }
+        copy_template_list(SRV(tid).param_list, SRV(tid).param_list_size,
+                SRV(sid).param_list, &SRV(sid).param_list_size, instance_str);
+        copy_template_list(SRV(tid).environment, SRV(tid).environment_size,
+                SRV(sid).environment, &SRV(sid).environment_size, instance_str);
+        copy_template_list(SRV(tid).environment_extra, SRV(tid).environment_extra_size,
+                SRV(sid).environment_extra, &SRV(sid).environment_extra_size, instance_str);
+
+        if (SRV(sid).log_ring_size > 0) {
+            SRV(sid).log_ring = log_ring_create(SRV(sid).log_ring_size);
+            if (!SRV(sid).log_ring) {
+                ThrowMessage("could not create log ring buffer: out of memory");
+            }
+        }
+
+        // Instances accept connections from the same listening sockets.
+        for (unsigned int i = 0; i < SRV(tid).num_listen_fds; i++) {
+            int fd = fcntl(SRV(tid).listen_fds[i], F_DUPFD_CLOEXEC, 0);
+            if (fd < 0) {
+                ThrowMessageWithErrno("could not duplicate listening socket");
+            }
+            SRV(sid).listen_fds[SRV(sid).num_listen_fds++] = fd;
+        }
+
+        if (SRV(sid).cpu_affinity_auto) {
+            assign_auto_cpu_affinity(sid);
+        }
+
+        setup_service_cgroup(sid, name);
+
+        set_service_name(sid, name);
+    }
+    Catch (e) {
+        unload_service(sid);
+        ThrowMessage("could not create instance '%s': %s", name, e.mMessage);
+    }
+
+    return sid;
+}
+
+/**
+ * Check if a service is an instance of a template.
+ *
+ * @param[in] sid Index of the service.
+ * @param[in] tid Index of the template.
+ *
+ * @return True if the service is an instance of the template.
+ */
+static bool is_instance_of(int sid, int tid)
+{
+    const char *at = strrchr(SRV(sid).name, '@');
+
+    if (!SRV(sid).is_instance || at == NULL) {
+        return false;
+    }
+    return strlen(SRV(tid).name) == at - SRV(sid).name + 1 &&
+           strncmp(SRV(sid).name, SRV(tid).name, at - SRV(sid).name + 1) == 0;
+}
+
+/**
+ * Create the instances of a template.
+ *
+ * On failure, the template and its instances are unloaded.
+ *
+ * @param[in] tid Index of the template.
+ */
+static void instantiate_template(int tid)
+{
+    CEXCEPTION_T e;
+
+    Try {
+        for (unsigned int i = 0; i < SRV(tid).num_instances; i++) {
+            create_instance(tid, i);
+        }
+        SRV(tid).scale_time = get_time();
+    }
+    Catch (e) {
+        FOR_EACH_SERVICE(sid) {
+            if (is_instance_of(sid, tid)) {
+                unload_service(sid);
+            }
+        }
+        unload_service(tid);
+        ThrowMessage("%s", e.mMessage);
+    }
+}
+
+/**
+ * Check if a service uses the notification socket.
+ *
+ * Programs using sd_notify(3) change their behavior when the socket is
+ * available, so it is passed only to services that opted in.
+ *
+ * @param[in] service Index of the service.
+ *
+ * @return True if the service uses the notification socket.
+ */
+static bool uses_notify_socket(int service)
+{
+    return SRV(service).watchdog_interval > 0 ||
+           SRV(service).fdstore_max > 0 ||
+           SRV(service).scale_metric == SCALE_METRIC_NOTIFY;
+}
+
+/**
+ * Fork and exec into a service.
+ *
+ * NOTE: Must be called from inside the service directory.
+ *
+ * @param[in] service Index of the service.
+ *
+ * @return PID of the service or 0 on error.
+ */
+static pid_t fork_and_exec(int service)
 {
     pid_t p;
-#ifdef SINGLE_CHILD_STDOUT_STDERR_STREAM
-    int pty_master;
-#else
-    int pty_stdout[2] = { -1, -1 };
-    int pty_stderr[2] = { -1, -1 };
-#endif
+    // For each link, the first file descriptor is kept by us, while the second
+    // one is given to the child.
+    int stdout_link[2] = { -1, -1 };
+    int stderr_link[2] = { -1, -1 };
 
     ASSERT_VALID_SERVICE_INDEX(service);
 
-#ifndef SINGLE_CHILD_STDOUT_STDERR_STREAM
-    // Create pseudo-terminals for stdout and stderr. The stdout and stderr
-    // of the child process will be connected to 2 different pseudo-terminals.
-    // Pseudo-terminals are needed to disable buffering on the child side. Also,
-    // 2 differents pseudo-terminals are needed because we want to be able to
-    // differentiate the 2 streams (i.e. we want to tell is a message comes from
-    // stdout or stderr).
-    // https://reviews.llvm.org/D15073
-    // https://github.com/microsoft/node-pty/issues/71
-    // https://stackoverflow.com/questions/4057985
-    if (openpty(&pty_stdout[0], &pty_stdout[1], NULL, NULL, NULL) < 0) {
-        //ThrowMessageWithErrno("could not create pseudo-terminal for stdout";
-        return 0;
-    }
-    if (openpty(&pty_stderr[0], &pty_stderr[1], NULL, NULL, NULL) < 0) {
-        //ThrowMessageWithErrno("could not create pseudo-terminal for stderr";
-        close_fd(&pty_stdout[0]);
-        close_fd(&pty_stdout[1]);
-        return 0;
+    switch (SRV(service).output_mode) {
+        case OUTPUT_MODE_PTY:
+            // The pseudo-terminal is created by forkpty().
+            break;
+        case OUTPUT_MODE_PTY_SPLIT:
+            // Create pseudo-terminals for stdout and stderr. The stdout and
+            // stderr of the child process will be connected to 2 different
+            // pseudo-terminals. Pseudo-terminals are needed to disable
+            // buffering on the child side. Also, 2 differents pseudo-terminals
+            // are needed because we want to be able to differentiate the 2
+            // streams (i.e. we want to tell is a message comes from stdout or
+            // stderr).
+            // https://reviews.llvm.org/D15073
+            // https://github.com/microsoft/node-pty/issues/71
+            // https://stackoverflow.com/questions/4057985
+            if (openpty(&stdout_link[0], &stdout_link[1], NULL, NULL, NULL) < 0) {
+                //ThrowMessageWithErrno("could not create pseudo-terminal for stdout";
+                return 0;
+            }
+            if (openpty(&stderr_link[0], &stderr_link[1], NULL, NULL, NULL) < 0) {
+                //ThrowMessageWithErrno("could not create pseudo-terminal for stderr";
+                close_fd(&stdout_link[0]);
+                close_fd(&stdout_link[1]);
+                return 0;
+            }
+            break;
+        case OUTPUT_MODE_PIPE:
+            // Plain pipes avoid the pseudo-terminal line discipline, at the
+            // cost of the child's stdio being fully buffered.
+            if (pipe2(stdout_link, O_CLOEXEC) < 0) {
+                //ThrowMessageWithErrno("could not create pipe for stdout";
+                return 0;
+            }
+            if (pipe2(stderr_link, O_CLOEXEC) < 0) {
+                //ThrowMessageWithErrno("could not create pipe for stderr";
+                close_fd(&stdout_link[0]);
+                close_fd(&stdout_link[1]);
+                return 0;
+            }
+
+            // Enlarge pipes so a burst of output doesn't block the service
+            // while its logger is busy. Failure is not fatal: the default
+            // size is kept.
+            if (SRV(service).pipe_size > 0) {
+                if (fcntl(stdout_link[0], F_SETPIPE_SZ, SRV(service).pipe_size) < 0 ||
+                    fcntl(stderr_link[0], F_SETPIPE_SZ, SRV(service).pipe_size) < 0) {
+                    log_debug("could not set pipe size of service '%s' to %u: %s.",
+                            SRV(service).name, SRV(service).pipe_size, strerror(errno));
+                }
+            }
+            break;
     }
-#endif
 
-#ifdef SINGLE_CHILD_STDOUT_STDERR_STREAM
-    // Use forkpty() to disable buffering on child side. forkpty() redirects
-    // stdout and stderr into a single stream.
-    switch (p = forkpty(&pty_master, NULL, NULL, NULL)) {
-#else
-    switch (p = fork()) {
-#endif
+    if (SRV(service).output_mode == OUTPUT_MODE_PTY) {
+        // Use forkpty() to disable buffering on child side. forkpty()
+        // redirects stdout and stderr into a single stream.
+        p = forkpty(&stdout_link[0], NULL, NULL, NULL);
+    }
+    else {
+        p = fork();
+    }
+
+    switch (p) {
         case (pid_t)-1:
         {
             // Fork failed.
-#ifndef SINGLE_CHILD_STDOUT_STDERR_STREAM
-            close_fd(&pty_stdout[0]);
-            close_fd(&pty_stdout[1]);
-            close_fd(&pty_stderr[0]);
-            close_fd(&pty_stderr[1]);
-#endif
+            close_fd(&stdout_link[0]);
+            close_fd(&stdout_link[1]);
+            close_fd(&stderr_link[0]);
+            close_fd(&stderr_link[1]);
             //ThrowMessageWithErrno("fork failed");
             return 0;
         }
@@ -1046,16 +2433,18 @@ static pid_t fork_and_exec(int service)
         {
             // Child.
 
-#ifndef SINGLE_CHILD_STDOUT_STDERR_STREAM
-            // Map stdout and stderr of the child to the pseudo-terminals
-            // slave file descriptors.
-            dup2(pty_stdout[1], STDOUT_FILENO);
-            dup2(pty_stderr[1], STDERR_FILENO);
-
-            // Master file descriptors of pseudo-terminals are not used.
-            close_fd(&pty_stdout[0]);
-            close_fd(&pty_stderr[0]);
-#endif
+            if (SRV(service).output_mode != OUTPUT_MODE_PTY) {
+                // Map stdout and stderr of the child to the slave side of the
+                // links.
+                dup2(stdout_link[1], STDOUT_FILENO);
+                dup2(stderr_link[1], STDERR_FILENO);
+
+                // Original file descriptors are not used anymore.
+                close_fd(&stdout_link[0]);
+                close_fd(&stdout_link[1]);
+                close_fd(&stderr_link[0]);
+                close_fd(&stderr_link[1]);
+            }
 
 #if 0
             ioctl(0, TIOCNOTTY, 0);
@@ -1065,6 +2454,35 @@ static pid_t fork_and_exec(int service)
             setpgrp();
 #endif
 
+            // Move to the cgroup of the service. On failure, the service
+            // simply stays in the cgroup of the process supervisor.
+            if (SRV(service).cgroup_created) {
+                cgroup_attach(SRV(service).name);
+            }
+
+            // Pass listening sockets, followed by stored file descriptors,
+            // starting at LISTEN_FDS_START. They are first duplicated above
+            // the target range, so none is overwritten before being moved.
+            // Duplicates are closed on exec.
+            size_t num_listen_fds = SRV(service).num_listen_fds + SRV(service).num_stored_fds;
+            if (num_listen_fds > 0) {
+                int fds[num_listen_fds];
+                for (unsigned int i = 0; i < num_listen_fds; i++) {
+                    int fd = i < SRV(service).num_listen_fds ?
+                        SRV(service).listen_fds[i] :
+                        SRV(service).stored_fds[i - SRV(service).num_listen_fds];
+                    fds[i] = fcntl(fd, F_DUPFD_CLOEXEC, LISTEN_FDS_START + num_listen_fds);
+                    if (fds[i] < 0) {
+                        err(50, "fcntl(F_DUPFD_CLOEXEC)");
+                    }
+                }
+                for (unsigned int i = 0; i < num_listen_fds; i++) {
+                    if (dup2(fds[i], LISTEN_FDS_START + i) < 0) {
+                        err(50, "dup2(%d)", LISTEN_FDS_START + i);
+                    }
+                }
+            }
+
             // Get the canonical, absolute path of the program to run.
             char *argv0 = SRV(service).run_abs_path;
             if (!argv0) {
@@ -1133,6 +2551,127 @@ static pid_t fork_and_exec(int service)
                 env_p = environ;
             }
 
+            // Tell the service about its watchdog and listening sockets,
+            // the same way as systemd.
+            char watchdog_usec[32];
+            char watchdog_pid[32];
+            char listen_fds[32];
+            char listen_pid[32];
+            char listen_fdnames[sizeof("LISTEN_FDNAMES=") +
+                (MAX_NUM_SERVICE_LISTEN_FDS + MAX_NUM_SERVICE_STORED_FDS) * STORED_FD_NAME_SIZE];
+            char instance[32];
+            char log_socket[sizeof(LOG_SOCKET_ENV_VAR "=") + sizeof(g_ctx.log_socket)];
+            char notify_socket[sizeof(NOTIFY_SOCKET_ENV_VAR "=") + sizeof(g_ctx.notify_socket)];
+            char *supervisor_environment[8];
+            size_t supervisor_environment_size = 0;
+            if (g_ctx.notify_fd >= 0 && uses_notify_socket(service)) {
+                snprintf(notify_socket, sizeof(notify_socket), NOTIFY_SOCKET_ENV_VAR "=%s",
+                        g_ctx.notify_socket);
+                supervisor_environment[supervisor_environment_size++] = notify_socket;
+            }
+            if (g_ctx.log_socket[0] != '\0') {
+                snprintf(log_socket, sizeof(log_socket), LOG_SOCKET_ENV_VAR "=%s", g_ctx.log_socket);
+                supervisor_environment[supervisor_environment_size++] = log_socket;
+            }
+            if (SRV(service).is_instance) {
+                snprintf(instance, sizeof(instance), "INSTANCE=%u", SRV(service).instance);
+                supervisor_environment[supervisor_environment_size++] = instance;
+            }
+            if (SRV(service).watchdog_interval > 0) {
+                snprintf(watchdog_usec, sizeof(watchdog_usec), "WATCHDOG_USEC=%llu",
+                        SRV(service).watchdog_interval * 1000ULL);
+                snprintf(watchdog_pid, sizeof(watchdog_pid), "WATCHDOG_PID=%d", getpid());
+                supervisor_environment[supervisor_environment_size++] = watchdog_usec;
+                supervisor_environment[supervisor_environment_size++] = watchdog_pid;
+            }
+            if (num_listen_fds > 0) {
+                snprintf(listen_fds, sizeof(listen_fds), "LISTEN_FDS=%zu", num_listen_fds);
+                snprintf(listen_pid, sizeof(listen_pid), "LISTEN_PID=%d", getpid());
+                supervisor_environment[supervisor_environment_size++] = listen_fds;
+                supervisor_environment[supervisor_environment_size++] = listen_pid;
+
+                // Names are separated by colons.
+                size_t len = snprintf(listen_fdnames, sizeof(listen_fdnames), "LISTEN_FDNAMES=");
+                for (unsigned int i = 0; i < num_listen_fds; i++) {
+                    const char *name = i < SRV(service).num_listen_fds ?
+                        LISTEN_FD_NAME :
+                        SRV(service).stored_fd_names[i - SRV(service).num_listen_fds];
+                    len += snprintf(listen_fdnames + len, sizeof(listen_fdnames) - len,
+                            "%s%s", i > 0 ? ":" : "", name);
+                }
+                supervisor_environment[supervisor_environment_size++] = listen_fdnames;
+            }
+
+            size_t env_p_size = 0;
+            while (env_p[env_p_size] != NULL) {
+                env_p_size++;
+            }
+            char *full_environment[env_p_size + supervisor_environment_size + 1];
+            if (supervisor_environment_size > 0) {
+                memcpy(full_environment, env_p, env_p_size * sizeof(char *));
+                memcpy(full_environment + env_p_size, supervisor_environment,
+                        supervisor_environment_size * sizeof(char *));
+                full_environment[env_p_size + supervisor_environment_size] = NULL;
+                env_p = full_environment;
+            }
+
+            // Set CPU affinity.
+            if (SRV(service).cpu_affinity_set) {
+                if (sched_setaffinity(0, sizeof(SRV(service).cpu_affinity), &SRV(service).cpu_affinity) < 0) {
+                    err(50, "sched_setaffinity");
+                }
+            }
+
+            // Set NUMA memory policy. The node set is used as a bitmask of
+            // nodes.
+            if (SRV(service).numa_policy_set) {
+                bool has_nodes = CPU_COUNT(&SRV(service).numa_nodes) > 0;
+                if (syscall(SYS_set_mempolicy,
+                            SRV(service).numa_policy,
+                            has_nodes ? (unsigned long *)&SRV(service).numa_nodes : NULL,
+                            has_nodes ? CPU_SETSIZE + 1 : 0) < 0) {
+                    err(50, "set_mempolicy");
+                }
+            }
+
+            // Set scheduling policy.
+            if (SRV(service).sched_policy_set) {
+                struct sched_param param = { .sched_priority = 0 };
+                if (sched_setscheduler(0, SRV(service).sched_policy, &param) < 0) {
+                    err(50, "sched_setscheduler(%d)", SRV(service).sched_policy);
+                }
+            }
+
+            // Set I/O priority. The level is ignored by the idle class.
+            if (SRV(service).ioprio_class != IOPRIO_CLASS_NONE) {
+                int ioprio = IOPRIO_PRIO_VALUE(SRV(service).ioprio_class,
+                        SRV(service).ioprio_class == IOPRIO_CLASS_IDLE ? 0 : SRV(service).ioprio_level);
+                if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio) < 0) {
+                    err(50, "ioprio_set(%d)", ioprio);
+                }
+            }
+
+            // Set timer slack.
+            if (SRV(service).timerslack_set) {
+                if (prctl(PR_SET_TIMERSLACK, (unsigned long)SRV(service).timerslack, 0, 0, 0) < 0) {
+                    err(50, "prctl(PR_SET_TIMERSLACK, %u)", SRV(service).timerslack);
+                }
+            }
+
+            // Set OOM score adjustment. Lowering it requires privileges
+            // that the container may not have, so failure is not fatal.
+            if (SRV(service).oom_score_adj_set) {
+                char value[16];
+                int fd = open("/proc/self/oom_score_adj", O_WRONLY | O_CLOEXEC);
+                int len = snprintf(value, sizeof(value), "%d", SRV(service).oom_score_adj);
+                if (fd < 0 || write(fd, value, len) != len) {
+                    warn("could not set oom_score_adj to %d", SRV(service).oom_score_adj);
+                }
+                if (fd >= 0) {
+                    close(fd);
+                }
+            }
+
             // Set priority (niceness).
             if (SRV(service).priority != 0) {
                 if (setpriority(PRIO_PROCESS, 0, SRV(service).priority) < 0) {
@@ -1140,6 +2679,16 @@ static pid_t fork_and_exec(int service)
                 }
             }
 
+            // Set resource limits. This is done before dropping privileges,
+            // since raising a hard limit requires them.
+            for (int i = 0; i < RLIMIT_NLIMITS; i++) {
+                if (SRV(service).rlimit_set[i]) {
+                    if (setrlimit(i, &SRV(service).rlimits[i]) < 0) {
+                        err(50, "setrlimit(%d)", i);
+                    }
+                }
+            }
+
             // Set umask.
             umask(SRV(service).umask);
 
@@ -1176,24 +2725,68 @@ static pid_t fork_and_exec(int service)
         default:
         {
             // Parent.
-#ifdef SINGLE_CHILD_STDOUT_STDERR_STREAM
-            // Keep the master file descriptor.
-            SRV(service).output_fd = pty_master;
-#else
-            // Keep master file descriptors of pseudo-terminals.
-            SRV(service).stdout_fd = pty_stdout[0];
-            SRV(service).stderr_fd = pty_stderr[0];
-
-            // Slave file descriptors of pseudo-terminals are not needed. We
-            // are not sending anything to child process.
-            close_fd(&pty_stdout[1]);
-            close_fd(&pty_stderr[1]);
-#endif
+
+            // Keep our side of the links. With a single pseudo-terminal, the
+            // stderr file descriptor is not set.
+            SRV(service).stdout_fd = stdout_link[0];
+            SRV(service).stderr_fd = stderr_link[0];
+
+            // Child side of the links are not needed. We are not sending
+            // anything to child process.
+            close_fd(&stdout_link[1]);
+            close_fd(&stderr_link[1]);
             return p;
         }
     }
 }
 
+/**
+ * Start probing the liveness of a running service.
+ *
+ * The count of consecutive failures is reset.
+ *
+ * @param[in] sid Index of the service.
+ */
+static void arm_liveness_probe(int sid)
+{
+    if (SRV(sid).liveness.type != PROBE_TYPE_NONE) {
+        probe_set_service(sid, &SRV(sid).liveness, SRV(sid).directory, SRV(sid).pid);
+    }
+}
+
+/**
+ * Set the watchdog deadline of a running service one interval from now.
+ *
+ * @param[in] sid Index of the service.
+ */
+static void arm_watchdog(int sid)
+{
+    if (SRV(sid).watchdog_interval > 0) {
+        SRV(sid).watchdog_deadline = get_time() + SRV(sid).watchdog_interval;
+    }
+}
+
+/**
+ * Stop a logger thread of a service and wait for its termination.
+ *
+ * @param[in] sid Index of the service.
+ * @param[in] logger The logger thread.
+ * @param[in,out] arg Argument of the logger thread, freed.
+ */
+static void join_logger(int sid, pthread_t logger, logger_arg_t **arg)
+{
+    log_debug("waiting termination of logger thread of service '%s'...",
+            SRV(sid).name);
+    atomic_store(&(*arg)->exit, true);
+    int rc = pthread_join(logger, NULL);
+    ASSERT_LOG(rc == 0, "Failed to join logger thread of service '%s': %s.",
+            SRV(sid).name, strerror(rc));
+    log_debug("logger thread of service '%s' successfully terminated.",
+            SRV(sid).name);
+    free(*arg);
+    *arg = NULL;
+}
+
 /**
  * Start a service.
  *
@@ -1217,6 +2810,9 @@ static void start_service(int service)
 
     // Change the working directory to the service directory.
     chdir_to_service(SRV(service).name);
+    if (!getcwd(SRV(service).directory, sizeof(SRV(service).directory))) {
+        ThrowMessageWithErrno("could not get service directory");
+    }
 
     // Fork and exec service, put PID in data structure.
     for (int count = 0; count < 4; count++) {
@@ -1224,6 +2820,12 @@ static void start_service(int service)
         if (SRV(service).pid > 0) {
             log_debug("started service '%s'.", SRV(service).name);
             SRV(service).start_time = get_time();
+            SRV(service).pgid = SRV(service).pid;
+            SRV(service).active_time = SRV(service).start_time;
+            SRV(service).idle_stopped = false;
+            sampler_set_service(service, SRV(service).name, SRV(service).pid);
+            arm_liveness_probe(service);
+            arm_watchdog(service);
 
             // Service has been successfully started. Now create its logger
             // thread.
@@ -1232,21 +2834,23 @@ static void start_service(int service)
                     "Logger thread already started for service '%s'.",
                     SRV(service).name);
 
-            // Create and start the logger thread.
-            int *service_arg = malloc(sizeof(int));
-            if (!service_arg) {
+            // Create and start the logger thread. Its argument is kept until
+            // the thread is joined.
+            logger_arg_t *logger_arg = malloc(sizeof(logger_arg_t));
+            if (!logger_arg) {
                 ThrowMessage("out of memory");
             }
-            *service_arg = service;
-            atomic_store(&SRV(service).logger_exit, false);
-            int rc = pthread_create(&SRV(service).logger, NULL, service_logger, service_arg);
+            logger_arg->service = service;
+            atomic_init(&logger_arg->exit, false);
+            int rc = pthread_create(&SRV(service).logger, NULL, service_logger, logger_arg);
             if (rc != 0) {
-                free(service_arg);
+                free(logger_arg);
                 ThrowMessage("Failed to create logger thread of service '%s': %s",
                         SRV(service).name,
                         strerror(rc));
             }
 
+            SRV(service).logger_arg = logger_arg;
             SRV(service).logger_started = true;
             return;
         }
@@ -1255,6 +2859,62 @@ static void start_service(int service)
     ThrowMessageWithErrno("could not fork");
 }
 
+/**
+ * Pause or resume the processes of a service.
+ *
+ * The cgroup of the service is frozen when available.  Otherwise, the
+ * process group of the service is stopped.
+ *
+ * @param[in] sid Index of the service.
+ * @param[in] pause Whether to pause or resume the service.
+ */
+static void pause_service(int sid, bool pause)
+{
+    if (SRV(sid).cgroup_created &&
+        cgroup_write(SRV(sid).name, "cgroup.freeze", pause ? "1" : "0") == 0) {
+        return;
+    }
+    else if (SRV(sid).pgid > 0) {
+        kill(-SRV(sid).pgid, pause ? SIGSTOP : SIGCONT);
+    }
+}
+
+/**
+ * Send a signal to the processes of a service, according to its kill mode.
+ *
+ * @param[in] service Index of the service.
+ * @param[in] sig Signal to send.
+ */
+static void signal_service(int service, int sig)
+{
+    switch (SRV(service).kill_mode) {
+        case KILL_MODE_CGROUP:
+            if (SRV(service).cgroup_created && cgroup_kill(SRV(service).name, sig) >= 0) {
+                break;
+            }
+            // Fall back to the process group.
+            // fall through
+        case KILL_MODE_GROUP:
+            if (SRV(service).pgid > 0) {
+                kill(-SRV(service).pgid, sig);
+                break;
+            }
+            // fall through
+        case KILL_MODE_PROCESS:
+            if (SRV(service).pid > 0) {
+                kill(SRV(service).pid, sig);
+            }
+            break;
+    }
+
+    // A stopped process handles the signal only once continued.
+    if (sig != SIGKILL && sig != SIGCONT && SRV(service).shed &&
+        SRV(service).shed_mode == SHED_MODE_PAUSE) {
+        pause_service(service, false);
+        SRV(service).shed = false;
+    }
+}
+
 /**
  * Stop a service.
  *
@@ -1281,63 +2941,503 @@ static void stop_service(int service)
         exec_service_cmd(service, "./kill", "kill", tmp);
     }
 
-    /* Send SIGTERM signal. */
-    kill(SRV(service).pid, SIGTERM);
+    // Send the stop signal. If processes are still alive after the stop
+    // timeout, they are killed by check_stopping_services().
+    if (!SRV(service).stopping) {
+        SRV(service).stopping = true;
+        SRV(service).stop_killed = false;
+        SRV(service).stop_time = get_time();
+    }
+    signal_service(service, SRV(service).stop_signal);
 }
 
 /**
- * Load a service and its dependencies.
+ * Move the current run of a service aside, so a new instance can be started
+ * while it keeps running.
  *
- * @param[in] service Name of the service to start.
- * @param[in] dependent Index of the dependent service, if any.
+ * @param[in] sid Index of the service.
  */
-static void load_service_with_deps(const char *service, int dependent)
+static void retire_service_run(int sid)
 {
-    CEXCEPTION_T e;
-
-    int sid = -1;
+    service_run_t *prev = &SRV(sid).previous;
+
+    prev->pid = SRV(sid).pid;
+    prev->pgid = SRV(sid).pgid;
+    prev->start_time = SRV(sid).start_time;
+    prev->stdout_fd = SRV(sid).stdout_fd;
+    prev->stderr_fd = SRV(sid).stderr_fd;
+    prev->logger = SRV(sid).logger;
+    prev->logger_arg = SRV(sid).logger_arg;
+    prev->stopping = false;
+    prev->stop_killed = false;
+
+    SRV(sid).pid = 0;
+    SRV(sid).pgid = 0;
+    SRV(sid).stdout_fd = -1;
+    SRV(sid).stderr_fd = -1;
+    SRV(sid).logger_arg = NULL;
+    SRV(sid).logger_started = false;
+}
 
-    ASSERT_VALID_SERVICE_NAME(service);
+/**
+ * Make the previous run of a service the current one again.
+ *
+ * @param[in] sid Index of the service.
+ */
+static void restore_service_run(int sid)
+{
+    service_run_t *prev = &SRV(sid).previous;
+
+    SRV(sid).pid = prev->pid;
+    SRV(sid).pgid = prev->pgid;
+    SRV(sid).start_time = prev->start_time;
+    SRV(sid).stdout_fd = prev->stdout_fd;
+    SRV(sid).stderr_fd = prev->stderr_fd;
+    SRV(sid).logger = prev->logger;
+    SRV(sid).logger_arg = prev->logger_arg;
+    SRV(sid).logger_started = true;
+
+    prev->pid = 0;
+    prev->pgid = 0;
+    prev->stdout_fd = -1;
+    prev->stderr_fd = -1;
+    prev->logger_arg = NULL;
+
+    sampler_set_service(sid, SRV(sid).name, SRV(sid).pid);
+    arm_liveness_probe(sid);
+    arm_watchdog(sid);
+}
 
-    // Check if service is already loaded.
-    if (find_service(service) >= 0) {
-        return;
-    }
+/**
+ * Send a signal to the processes of the previous run of a service.
+ *
+ * Both runs share the cgroup of the service, so the process group is
+ * signaled instead with the cgroup kill mode.
+ *
+ * @param[in] sid Index of the service.
+ * @param[in] sig Signal to send.
+ */
+static void signal_previous_run(int sid, int sig)
+{
+    service_run_t *prev = &SRV(sid).previous;
 
-    // Load the service.
-    log("loading service '%s'...", service);
-    Try {
-        sid = load_service(service);
+    if (SRV(sid).kill_mode != KILL_MODE_PROCESS && prev->pgid > 0) {
+        kill(-prev->pgid, sig);
     }
-    Catch (e) {
-        ThrowMessage("could not load service '%s': %s", service, e.mMessage);
+    else if (prev->pid > 0) {
+        kill(prev->pid, sig);
     }
+}
 
-    // Return now if service disabled.
-    if (SRV(sid).disabled) {
-        log("service '%s' is disabled.", service);
+/**
+ * Stop the previous run of a service.
+ *
+ * @param[in] sid Index of the service.
+ */
+static void stop_previous_run(int sid)
+{
+    service_run_t *prev = &SRV(sid).previous;
+
+    if (prev->pid == 0 || prev->stopping) {
         return;
     }
 
-    // Update the start order.
-    add_to_start_order(sid, dependent);
+    log("stopping previous instance of service '%s' (pid %d)...", SRV(sid).name, prev->pid);
 
-    // Load dependencies.
-    {
-        struct dirent *dir;
-        DIR *dirstream = opendir(".");
-        if (!dirstream) {
-            ThrowMessageWithErrno("could not load service '%s': "
-                                  "could not open stream for service directory",
-                                  service);
-        }
+    // Run the service's (optional) kill program.
+    chdir_to_service(SRV(sid).name);
+    if (access("kill", X_OK) == 0) {
+        char tmp[FMT_LONG];
+        snprintf(tmp, sizeof(tmp), "%d", prev->pid);
+        exec_service_cmd(sid, "./kill", "kill", tmp);
+    }
 
-        while ((dir = readdir(dirstream)) != NULL) {
-            bool depends;
+    prev->stopping = true;
+    prev->stop_killed = false;
+    prev->stop_time = get_time();
+    signal_previous_run(sid, SRV(sid).stop_signal);
+}
 
-            if (strcmp(dir->d_name, ".") == 0 || strcmp(dir->d_name, "..") == 0) {
-                continue;
-            }
+/**
+ * Release resources of the terminated previous run of a service.
+ *
+ * @param[in] sid Index of the service.
+ */
+static void finish_previous_run(int sid)
+{
+    service_run_t *prev = &SRV(sid).previous;
+
+    prev->pid = 0;
+    if (!prev->stopping) {
+        prev->pgid = 0;
+    }
+    if (prev->logger_arg) {
+        join_logger(sid, prev->logger, &prev->logger_arg);
+    }
+    close_fd(&prev->stdout_fd);
+    close_fd(&prev->stderr_fd);
+}
+
+/**
+ * Check if the previous run of a service is overlapping the current one.
+ *
+ * @param[in] sid Index of the service.
+ *
+ * @return true if the previous run is alive and not being stopped.
+ */
+static bool is_overlapping(int sid)
+{
+    return SRV(sid).previous.pid > 0 && !SRV(sid).previous.stopping;
+}
+
+/**
+ * Reload the configuration of a running service.
+ *
+ * The service's reload program is run when present.  Otherwise, the reload
+ * signal is sent to the main process of the service.  With an 'is_ready'
+ * program, the readiness of the service is then confirmed by
+ * check_reloading_services().
+ *
+ * @param[in] sid Index of the service.
+ */
+static void reload_service(int sid)
+{
+    ASSERT_VALID_SERVICE_INDEX(sid);
+
+    if (SRV(sid).pid == 0 || SRV(sid).stopping) {
+        ThrowMessage("service not running");
+    }
+
+    log("reloading service '%s'...", SRV(sid).name);
+
+    // Change the working directory to the service directory.
+    chdir_to_service(SRV(sid).name);
+
+    if (access("reload", X_OK) == 0) {
+        char tmp[FMT_LONG];
+        snprintf(tmp, sizeof(tmp), "%d", SRV(sid).pid);
+        int rc = exec_service_cmd(sid, "./reload", "reload", tmp);
+        if (rc != 0) {
+            ThrowMessage("reload program failed (exit code %d)", rc);
+        }
+    }
+    else if (SRV(sid).reload_signal > 0) {
+        if (kill(SRV(sid).pid, SRV(sid).reload_signal) < 0) {
+            ThrowMessageWithErrno("could not send %s",
+                    signal_to_str(SRV(sid).reload_signal));
+        }
+    }
+    else {
+        ThrowMessage("no reload program or signal defined");
+    }
+
+    if (access("is_ready", X_OK) == 0) {
+        SRV(sid).reloading = true;
+        SRV(sid).reload_unready = false;
+        SRV(sid).reload_time = get_time();
+    }
+    else {
+        log("service '%s' reloaded.", SRV(sid).name);
+    }
+}
+
+/**
+ * Check if processes of a service being stopped are still alive.
+ *
+ * @param[in] service Index of the service.
+ *
+ * @return true if some processes are still alive.
+ */
+static bool service_processes_alive(int service)
+{
+    if (SRV(service).pid > 0) {
+        return true;
+    }
+
+    switch (SRV(service).kill_mode) {
+        case KILL_MODE_CGROUP:
+            if (SRV(service).cgroup_created) {
+                return cgroup_kill(SRV(service).name, 0) > 0;
+            }
+            // Fall back to the process group.
+            // fall through
+        case KILL_MODE_GROUP:
+            return SRV(service).pgid > 0 && kill(-SRV(service).pgid, 0) == 0;
+        case KILL_MODE_PROCESS:
+            break;
+    }
+
+    return false;
+}
+
+/**
+ * Kill services that did not stop within their stop timeout.
+ *
+ * A service is considered stopped once all its processes, according to its
+ * kill mode, are gone.
+ */
+static void check_stopping_services()
+{
+    FOR_EACH_SERVICE(sid) {
+        if (!SRV(sid).stopping) {
+            continue;
+        }
+        else if (!service_processes_alive(sid)) {
+            SRV(sid).stopping = false;
+            SRV(sid).pgid = 0;
+            continue;
+        }
+        else if (SRV(sid).stop_killed) {
+            continue;
+        }
+
+        if (get_time() - SRV(sid).stop_time >= SRV(sid).stop_timeout) {
+            log_err("service '%s' didn't stop within %u msec, killing it...",
+                    SRV(sid).name, SRV(sid).stop_timeout);
+            signal_service(sid, SIGKILL);
+            SRV(sid).stop_killed = true;
+        }
+    }
+
+    // Same for previous runs replaced by an overlapped restart.
+    FOR_EACH_SERVICE(sid) {
+        service_run_t *prev = &SRV(sid).previous;
+
+        if (!prev->stopping) {
+            continue;
+        }
+        else if (prev->pid == 0 &&
+                 (SRV(sid).kill_mode == KILL_MODE_PROCESS || prev->pgid == 0 ||
+                  kill(-prev->pgid, 0) != 0)) {
+            prev->stopping = false;
+            prev->pgid = 0;
+            continue;
+        }
+        else if (prev->stop_killed) {
+            continue;
+        }
+
+        if (get_time() - prev->stop_time >= SRV(sid).stop_timeout) {
+            log_err("previous instance of service '%s' didn't stop within %u msec, killing it...",
+                    SRV(sid).name, SRV(sid).stop_timeout);
+            signal_previous_run(sid, SIGKILL);
+            prev->stop_killed = true;
+        }
+    }
+}
+
+/**
+ * Complete overlapped restarts of services.
+ *
+ * Once the new instance of a service ran for its minimum running time and
+ * its (optional) 'is_ready' program succeeds, the previous instance is
+ * stopped.  If the new instance terminates or is not ready within the ready
+ * timeout, it is discarded and the previous instance is kept.
+ */
+static void check_overlapped_restarts()
+{
+    CEXCEPTION_T e;
+
+    FOR_EACH_SERVICE(sid) {
+        if (!is_overlapping(sid)) {
+            continue;
+        }
+        else if (SRV(sid).pid == 0) {
+            // Wait until all processes of the new instance are gone.
+            if (!SRV(sid).stopping) {
+                log_err("new instance of service '%s' failed, keeping the previous one.",
+                        SRV(sid).name);
+                restore_service_run(sid);
+            }
+            continue;
+        }
+        else if (SRV(sid).stopping) {
+            continue;
+        }
+
+        unsigned long elapsed = get_time() - SRV(sid).start_time;
+
+        Try {
+            if (elapsed >= SRV(sid).ready_timeout) {
+                log_err("new instance of service '%s' not ready after %u msec, "
+                        "keeping the previous one.",
+                        SRV(sid).name, SRV(sid).ready_timeout);
+                stop_service(sid);
+                ExitTry();
+            }
+            else if (elapsed < SRV(sid).min_running_time) {
+                ExitTry();
+            }
+
+            chdir_to_service(SRV(sid).name);
+            if (access("is_ready", X_OK) == 0) {
+                char arg[FMT_LONG];
+                snprintf(arg, sizeof(arg), "%d", SRV(sid).pid);
+                if (exec_service_cmd(sid, "./is_ready", "is_ready", arg) != 0) {
+                    ExitTry();
+                }
+            }
+
+            log("new instance of service '%s' is ready.", SRV(sid).name);
+            stop_previous_run(sid);
+        }
+        Catch (e) {
+            log_err("failed to complete restart of service '%s': %s",
+                    SRV(sid).name, e.mMessage);
+        }
+    }
+}
+
+/**
+ * Confirm the readiness of reloaded services.
+ *
+ * Right after the reload request, the service may still report readiness
+ * with its previous configuration.  Thus, readiness is confirmed once the
+ * service went from not ready to ready, or once it is ready after its
+ * minimum running time.  A reloaded service not ready within its ready
+ * timeout is restarted.
+ */
+static void check_reloading_services()
+{
+    CEXCEPTION_T e;
+
+    FOR_EACH_SERVICE(sid) {
+        if (!SRV(sid).reloading) {
+            continue;
+        }
+        else if (SRV(sid).pid == 0 || SRV(sid).stopping) {
+            SRV(sid).reloading = false;
+            continue;
+        }
+
+        Try {
+            char arg[FMT_LONG];
+            snprintf(arg, sizeof(arg), "%d", SRV(sid).pid);
+
+            chdir_to_service(SRV(sid).name);
+            unsigned long elapsed = get_time() - SRV(sid).reload_time;
+            bool ready = (exec_service_cmd(sid, "./is_ready", "is_ready", arg) == 0);
+            if (ready && (SRV(sid).reload_unready || elapsed >= SRV(sid).min_running_time)) {
+                log("service '%s' reloaded.", SRV(sid).name);
+                SRV(sid).reloading = false;
+            }
+            else if (elapsed >= SRV(sid).ready_timeout) {
+                log_err("service '%s' not ready %u msec after reload, restarting it...",
+                        SRV(sid).name, SRV(sid).ready_timeout);
+                SRV(sid).reloading = false;
+                stop_service(sid);
+                SRV(sid).restart_requested = true;
+            }
+            else if (!ready) {
+                SRV(sid).reload_unready = true;
+            }
+        }
+        Catch (e) {
+            log_err("failed to check readiness of service '%s': %s",
+                    SRV(sid).name, e.mMessage);
+        }
+    }
+}
+
+/**
+ * Update the length of log prefixes, according to names of services.
+ */
+static void update_log_prefix_length()
+{
+    FOR_EACH_SERVICE(sid) {
+        if (SRV(sid).disabled || SRV(sid).is_service_group) {
+            continue;
+        }
+        if (strlen(SRV(sid).name) > g_ctx.log_prefix_length) {
+            g_ctx.log_prefix_length = strlen(SRV(sid).name);
+        }
+    }
+}
+
+/**
+ * Load a service and its dependencies.
+ *
+ * @param[in] service Name of the service to start.
+ * @param[in] dependent Index of the dependent service, if any.
+ * @param[out] failed When set, a service that cannot be loaded is skipped
+ *                    and this flag is set, instead of throwing.
+ */
+static void load_service_with_deps(const char *service, int dependent, bool *failed)
+{
+    CEXCEPTION_T e;
+
+    int sid = -1;
+
+    ASSERT_VALID_SERVICE_NAME(service);
+
+    // Check if service is already loaded. During a rescan, services loaded
+    // before are kept, but their dependencies are walked again.
+    sid = find_service(service);
+    if (sid >= 0 && SRV(sid).scanned) {
+        return;
+    }
+
+    Try {
+        if (sid >= 0) {
+            chdir_to_service(service);
+        }
+        else {
+            // Load the service.
+            log("loading service '%s'...", service);
+            sid = load_service(service);
+            if (SRV(sid).is_template) {
+                instantiate_template(sid);
+            }
+        }
+    }
+    Catch (e) {
+        if (!failed) {
+            ThrowMessage("could not load service '%s': %s", service, e.mMessage);
+        }
+        log_err("could not load service '%s': %s", service, e.mMessage);
+        *failed = true;
+        return;
+    }
+    SRV(sid).scanned = true;
+
+    // Return now if service disabled.
+    if (SRV(sid).disabled) {
+        log("service '%s' is disabled.", service);
+        return;
+    }
+
+    // Update the start order. Instances of a template take its place, after
+    // dependencies of the template.
+    add_to_start_order(sid, dependent);
+    int first = sid;
+    if (SRV(sid).is_template) {
+        FOR_EACH_SERVICE(inst) {
+            if (is_instance_of(inst, sid)) {
+                add_to_start_order(inst, sid);
+                SRV(inst).scanned = true;
+                if (first == sid) {
+                    first = inst;
+                }
+            }
+        }
+    }
+
+    // Load dependencies.
+    {
+        struct dirent *dir;
+        DIR *dirstream = opendir(".");
+        if (!dirstream) {
+            ThrowMessageWithErrno("could not load service '%s': "
+                                  "could not open stream for service directory",
+                                  service);
+        }
+
+        while ((dir = readdir(dirstream)) != NULL) {
+            bool depends;
+
+            if (strcmp(dir->d_name, ".") == 0 || strcmp(dir->d_name, "..") == 0) {
+                continue;
+            }
             if (dir->d_type != DT_REG) {
                 continue;
             }
@@ -1357,7 +3457,7 @@ static void load_service_with_deps(const char *service, int dependent)
             *p = '\0';
 
             // Load service.
-            load_service_with_deps(dir->d_name, sid);
+            load_service_with_deps(dir->d_name, first, failed);
         }
         closedir(dirstream);
     }
@@ -1365,9 +3465,12 @@ static void load_service_with_deps(const char *service, int dependent)
 
 /**
  * Load all services.
+ *
+ * @param[out] failed When set, a service that cannot be loaded is skipped
+ *                    and this flag is set, instead of throwing.
  */
 #ifdef LOAD_ALL_DEFINED_SERVICES
-static void load_services()
+static void load_services(bool *failed)
 {
     DIR *dirstream = opendir(SRV_ROOT());
     if (!dirstream) {
@@ -1382,7 +3485,7 @@ static void load_services()
         if (dir->d_type != DT_DIR) {
             continue;
         }
-        load_service_with_deps(dir->d_name, -1);
+        load_service_with_deps(dir->d_name, -1, failed);
     }
 
     closedir(dirstream);
@@ -1400,138 +3503,224 @@ static void unload_services()
 }
 
 /**
- * Start all services, in order.
+ * Start a service and wait until it is up.
+ *
+ * Depending on its definition, the service is waited for termination, for
+ * its minimum running time and for its readiness.
+ *
+ * @param[in] sid Index of the service.
  */
-static void start_services()
+static void start_service_and_wait(int sid)
 {
     CEXCEPTION_T e;
 
-    for (int i = 0; i < DIM(g_ctx.start_order); i++) {
-        int sid = g_ctx.start_order[i];
-        if (sid < 0) {
-            break;
-        }
-        else if (SRV(sid).is_service_group) {
-            continue;
-        }
-
-        // We may have received a shutdown request during the startup.
-        BREAK_IF_SHUTDOWN_REQUESTED();
+    if (SRV(sid).is_service_group) {
+        return;
+    }
+    else if (SRV(sid).start_mode == START_MODE_ON_DEMAND) {
+        log_debug("service '%s' will be started on demand.", SRV(sid).name);
+        return;
+    }
 
-        Try {
-            // Start service.
-            start_service(sid);
-
-            // Check if we need to wait for the service to terminate.
-            if (SRV(sid).sync) {
-                int status;
-
-                log_debug("waiting for service '%s' to terminate...", SRV(sid).name);
-                while (waitpid(SRV(sid).pid, &status, 0) < 0) {
-                    if (errno == EINTR) {
-                        if (SHUTDOWN_REQUESTED()) {
-                            ExitTry();
-                        }
-                        continue;
+    Try {
+        // Start service.
+        start_service(sid);
+
+        // Check if we need to wait for the service to terminate.
+        if (SRV(sid).sync) {
+            int status;
+            struct rusage usage;
+
+            log_debug("waiting for service '%s' to terminate...", SRV(sid).name);
+            while (wait4(SRV(sid).pid, &status, 0, &usage) < 0) {
+                if (errno == EINTR) {
+                    if (SHUTDOWN_REQUESTED()) {
+                        ExitTry();
                     }
-
-                    ThrowMessageWithErrno("could not wait for termination of service '%s'",
-                            SRV(sid).name);
-                }
-                handle_killed(SRV(sid).pid, status);
-                if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
-                    ThrowMessage("termined with error");
+                    continue;
                 }
 
-                // Skip to next service.
-                ExitTry();
+                ThrowMessageWithErrno("could not wait for termination of service '%s'",
+                        SRV(sid).name);
             }
-
-            // Skip to next service if an interval is configured.
-            if (SRV(sid).interval > 0) {
-                // Skip to next service.
-                ExitTry();
+            handle_killed(SRV(sid).pid, status, &usage);
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                ThrowMessage("termined with error");
             }
 
-            // Check that the service ran for a minimum amount of time before
-            // considering it as ready/up.
-            while (true) {
-                int rc;
-                int status;
+            // Skip to next service.
+            ExitTry();
+        }
 
-                // Exit now if shutdown has been requested.
-                if (SHUTDOWN_REQUESTED()) {
-                    ExitTry();
-                }
+        // Skip to next service if an interval is configured.
+        if (SRV(sid).interval > 0) {
+            // Skip to next service.
+            ExitTry();
+        }
 
-                // Check if minimum uptime is met.
-                if (get_time() - SRV(sid).start_time >= SRV(sid).min_running_time) {
-                    // Minimum uptime met.
-                    break;
-                }
+        // Don't wait for a service with listening sockets: connections
+        // of dependent services are queued until it accepts them.
+        if (SRV(sid).num_listen_fds > 0) {
+            // Skip to next service.
+            ExitTry();
+        }
 
-                // Check if service is still up.
-                rc = waitpid(SRV(sid).pid, &status, WNOHANG);
-                if (rc == SRV(sid).pid) {
-                    // Service died.
-                    handle_killed(SRV(sid).pid, status);
-                    ThrowMessage("minimum uptime not met");
-                }
-                else if (rc < 0) {
-                    ThrowMessageWithErrno("could not wait for termination of service '%s'",
-                            SRV(sid).name);
+        // Check that the service ran for a minimum amount of time before
+        // considering it as ready/up.
+        while (true) {
+            int rc;
+            int status;
+            struct rusage usage;
 
-                }
-                msleep(500);
+            // Exit now if shutdown has been requested.
+            if (SHUTDOWN_REQUESTED()) {
+                ExitTry();
             }
 
-            // Change the working directory to the service directory.
-            chdir_to_service(SRV(sid).name);
+            // Check if minimum uptime is met.
+            if (get_time() - SRV(sid).start_time >= SRV(sid).min_running_time) {
+                // Minimum uptime met.
+                break;
+            }
 
-            // Wait for the service to be ready.
-            if (access("is_ready", X_OK) == 0) {
-                char arg[FMT_LONG];
-                snprintf(arg, sizeof(arg), "%d", SRV(sid).pid);
+            // Check if service is still up.
+            rc = wait4(SRV(sid).pid, &status, WNOHANG, &usage);
+            if (rc == SRV(sid).pid) {
+                // Service died.
+                handle_killed(SRV(sid).pid, status, &usage);
+                ThrowMessage("minimum uptime not met");
+            }
+            else if (rc < 0) {
+                ThrowMessageWithErrno("could not wait for termination of service '%s'",
+                        SRV(sid).name);
 
-                log_debug("waiting for service '%s' to be ready...", SRV(sid).name);
-                while (true) {
-                    if (get_time() - SRV(sid).start_time >= SRV(sid).ready_timeout) {
-                        ThrowMessage("not ready after %d msec, giving up", SRV(sid).ready_timeout);
-                    }
-                    else if (kill(SRV(sid).pid, 0) != 0) {
-                        // Service died, stop waiting.
-                        ThrowMessage("terminated before being ready");
-                    }
-                    else if (exec_service_cmd(sid, "./is_ready", "is_ready", arg) == 0) {
-                        // Service is ready, stop waiting.
-                        break;
-                    }
-                    else if (SHUTDOWN_REQUESTED()) {
-                        ExitTry();
-                    }
+            }
+            msleep(500);
+        }
+
+        // Change the working directory to the service directory.
+        chdir_to_service(SRV(sid).name);
 
-                    msleep(SERVICE_READINESS_CHECK_INTERVAL);
+        // Wait for the service to be ready.
+        if (access("is_ready", X_OK) == 0) {
+            char arg[FMT_LONG];
+            snprintf(arg, sizeof(arg), "%d", SRV(sid).pid);
+
+            log_debug("waiting for service '%s' to be ready...", SRV(sid).name);
+            while (true) {
+                if (get_time() - SRV(sid).start_time >= SRV(sid).ready_timeout) {
+                    ThrowMessage("not ready after %d msec, giving up", SRV(sid).ready_timeout);
+                }
+                else if (kill(SRV(sid).pid, 0) != 0) {
+                    // Service died, stop waiting.
+                    ThrowMessage("terminated before being ready");
+                }
+                else if (exec_service_cmd(sid, "./is_ready", "is_ready", arg) == 0) {
+                    // Service is ready, stop waiting.
+                    break;
+                }
+                else if (SHUTDOWN_REQUESTED()) {
+                    ExitTry();
                 }
+
+                msleep(SERVICE_READINESS_CHECK_INTERVAL);
             }
         }
-        Catch (e) {
-            if (SRV(sid).ignore_failure) {
-                log_err("service '%s' failed to be started: %s.", SRV(sid).name, e.mMessage);
-            }
-            else {
-                ThrowMessage("service '%s' failed to be started: %s.", SRV(sid).name, e.mMessage);
-            }
+    }
+    Catch (e) {
+        if (SRV(sid).ignore_failure) {
+            log_err("service '%s' failed to be started: %s.", SRV(sid).name, e.mMessage);
+        }
+        else {
+            ThrowMessage("service '%s' failed to be started: %s.", SRV(sid).name, e.mMessage);
         }
     }
 }
 
+/**
+ * Start all services, in order.
+ */
+static void start_services()
+{
+    for (int i = 0; i < DIM(g_ctx.start_order); i++) {
+        int sid = g_ctx.start_order[i];
+        if (sid < 0) {
+            break;
+        }
+
+        // We may have received a shutdown request during the startup.
+        BREAK_IF_SHUTDOWN_REQUESTED();
+
+        start_service_and_wait(sid);
+    }
+}
+
+/**
+ * Log a line from the log ring buffer of a service.
+ *
+ * @param[in] line The line.
+ * @param[in] data Unused.
+ */
+static void dump_log_line(const char *line, void *data)
+{
+    log("  | %s", line);
+}
+
+/**
+ * Convert a time value to microseconds.
+ *
+ * @param[in] tv The time value.
+ *
+ * @return The number of microseconds.
+ */
+static unsigned long long timeval_to_usec(const struct timeval *tv)
+{
+    return (unsigned long long)tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+/**
+ * Account the resource usage of a terminated service run.
+ *
+ * @param[in] sid Index of the service.
+ * @param[in] usage Resource usage of the run.
+ * @param[in] verbose Whether the summary should be logged.
+ */
+static void account_service_usage(int sid, const struct rusage *usage, bool verbose)
+{
+    service_usage_t *total = &SRV(sid).usage;
+
+    total->runs++;
+    total->utime += timeval_to_usec(&usage->ru_utime);
+    total->stime += timeval_to_usec(&usage->ru_stime);
+    total->max_rss = MAX(total->max_rss, usage->ru_maxrss);
+    total->minflt += usage->ru_minflt;
+    total->majflt += usage->ru_majflt;
+    total->nvcsw += usage->ru_nvcsw;
+    total->nivcsw += usage->ru_nivcsw;
+
+    // Usage includes children of the service that have been waited for.
+    if (verbose || g_ctx.debug) {
+        log("service '%s' resource usage: user=%.3fs sys=%.3fs max_rss=%ldKiB "
+            "minflt=%ld majflt=%ld nvcsw=%ld nivcsw=%ld.",
+                SRV(sid).name,
+                timeval_to_usec(&usage->ru_utime) / 1000000.0,
+                timeval_to_usec(&usage->ru_stime) / 1000000.0,
+                usage->ru_maxrss,
+                usage->ru_minflt,
+                usage->ru_majflt,
+                usage->ru_nvcsw,
+                usage->ru_nivcsw);
+    }
+}
+
 /**
  * Handle a killed service.
  *
  * @param[in] pid PID of the killed service.
  * @param[in] status Status information of the killed service.
+ * @param[in] usage Resource usage of the killed service.
  */
-static void handle_killed(pid_t killed, int status)
+static void handle_killed(pid_t killed, int status, const struct rusage *usage)
 {
     CEXCEPTION_T e;
 
@@ -1545,8 +3734,11 @@ static void handle_killed(pid_t killed, int status)
         return;
     }
     else if ((sid = find_service_by_pid(killed)) >= 0) {
+        // Successful runs of interval services are not reported.
+        bool verbose = !WIFEXITED(status) || WEXITSTATUS(status) != 0 || SRV(sid).interval == 0;
+
         if (WIFEXITED(status)) {
-            if (WEXITSTATUS(status) != 0 || SRV(sid).interval == 0 || g_ctx.debug) {
+            if (verbose || g_ctx.debug) {
                 log("service '%s' exited (with status %d).",
                         SRV(sid).name,
                         WEXITSTATUS(status));
@@ -1561,29 +3753,42 @@ static void handle_killed(pid_t killed, int status)
             log("service '%s' exited.", SRV(sid).name);
         }
 
+        account_service_usage(sid, usage, verbose);
+
         // Update service table.
         SRV(sid).pid = 0;
+        SRV(sid).memory_soft_limit_reached = false;
+        SRV(sid).reloading = false;
+        if (!SRV(sid).stopping) {
+            SRV(sid).pgid = 0;
+        }
+        sampler_set_service(sid, SRV(sid).name, 0);
+        probe_set_service(sid, NULL, NULL, 0);
+
+        // A paused service may have been killed. Make sure its cgroup is not
+        // left frozen for the next run.
+        if (SRV(sid).shed && SRV(sid).shed_mode == SHED_MODE_PAUSE) {
+            pause_service(sid, false);
+            SRV(sid).shed = false;
+        }
 
         // Join the logger thread if it was started.
         if (SRV(sid).logger_started) {
-            log_debug("waiting termination of logger thread of service '%s'...",
-                    SRV(sid).name);
-            atomic_store(&SRV(sid).logger_exit, true);
-            int rc = pthread_join(SRV(sid).logger, NULL);
-            ASSERT_LOG(rc == 0, "Failed to join logger thread of service '%s': %s.",
-                    SRV(sid).name, strerror(rc));
-            log_debug("logger thread of service '%s' successfully terminated.",
-                    SRV(sid).name);
+            join_logger(sid, SRV(sid).logger, &SRV(sid).logger_arg);
             SRV(sid).logger_started = false;
         }
 
         // Close file descriptors.
-#ifdef SINGLE_CHILD_STDOUT_STDERR_STREAM
-        close_fd(&SRV(sid).output_fd);
-#else
         close_fd(&SRV(sid).stdout_fd);
         close_fd(&SRV(sid).stderr_fd);
-#endif
+
+        // Dump the most recent lines of the service if it terminated
+        // abnormally.
+        if (SRV(sid).log_ring && !SRV(sid).restart_requested && !SHUTDOWN_REQUESTED() &&
+            (!WIFEXITED(status) || WEXITSTATUS(status) != 0)) {
+            log("last output lines of service '%s':", SRV(sid).name);
+            log_ring_read(SRV(sid).log_ring, SRV(sid).log_ring_size, dump_log_line, NULL);
+        }
 
         // Run the service's finish script.
         Try {
@@ -1607,7 +3812,9 @@ static void handle_killed(pid_t killed, int status)
         }
 
         // Check if termination of this service should trigger a shutdown.
-        if (!SHUTDOWN_REQUESTED() && !SRV(sid).restart_requested && SRV(sid).shutdown_on_terminate) {
+        // A failed new instance is replaced by the previous one.
+        if (!SHUTDOWN_REQUESTED() && !SRV(sid).restart_requested && !SRV(sid).idle_stopped &&
+            !is_overlapping(sid) && SRV(sid).shutdown_on_terminate) {
             // Termination of the service should cause a shutdown.
             log("service '%s' exited, shutting down...", SRV(sid).name);
             REQUEST_SHUTDOWN();
@@ -1625,132 +3832,1728 @@ static void handle_killed(pid_t killed, int status)
             }
         }
     }
+    else if ((sid = find_service_by_previous_pid(killed)) >= 0) {
+        if (WIFSIGNALED(status)) {
+            log("previous instance of service '%s' exited (got signal %s).",
+                    SRV(sid).name,
+                    signal_to_str(WTERMSIG(status)));
+        }
+        else {
+            log("previous instance of service '%s' exited.", SRV(sid).name);
+        }
+
+        account_service_usage(sid, usage, false);
+        finish_previous_run(sid);
+    }
+}
+
+/**
+ * Reap child processes that have died.
+ *
+ * @param[in] period The minimum amount of time (in milliseconds) the function
+ *                   should perform reaping. A value of -1 means until all
+ *                   child processes have been reaped.
+ * @param[in] service When set, the function will perform reaping until the
+ *                    specified service gets reaped.
+ *
+ * @return True if *all* children have been reaped, false otherwise.
+ */
+static bool child_handler(int period, int service)
+{
+    time_t now = get_time();
+    pid_t killed;
+
+    while (true) {
+        int status;
+        struct rusage usage;
+
+        do {
+            killed = wait4(-1, &status, WNOHANG, &usage);
+            handle_killed(killed, status, &usage);
+        } while (killed && killed != (pid_t)-1);
+
+        if (killed == (pid_t)-1) {
+            // All processes have terminated.
+            break;
+        }
+
+        // Check if it's time to stop because of the specified period.
+        if (period == 0 || (period > 0 && get_time() - now >= period)) {
+            break;
+        }
+
+        // Check if it't time to stop beause of the specified service.
+        if (service >= 0 && killed != 0) {
+            ASSERT_VALID_SERVICE_INDEX(service);
+            if (SRV(service).pid == 0) {
+                break;
+            }
+        }
+
+        msleep(50);
+    }
+
+    return (killed == (pid_t)-1);
+}
+
+/**
+ * Wait for processes of services being stopped to terminate.
+ *
+ * Services not stopped within their stop timeout are killed.
+ *
+ * @return True if *all* children have been reaped, false otherwise.
+ */
+static bool wait_for_stopping_services()
+{
+    unsigned long start = get_time();
+    unsigned int timeout = 0;
+
+    FOR_EACH_SERVICE(sid) {
+        if (SRV(sid).stopping || SRV(sid).previous.stopping) {
+            timeout = MAX(timeout, SRV(sid).stop_timeout + SERVICE_KILL_TIMEOUT);
+        }
+    }
+
+    while (get_time() - start < timeout) {
+        bool stopping = false;
+
+        check_stopping_services();
+        FOR_EACH_SERVICE(sid) {
+            stopping |= SRV(sid).stopping || SRV(sid).previous.stopping;
+        }
+        if (!stopping) {
+            break;
+        }
+
+        if (child_handler(100, -1)) {
+            // Remaining processes are not our children (we are not PID
+            // 1), so we can't be notified of their termination.
+            msleep(100);
+        }
+    }
+
+    return child_handler(0, -1);
+}
+
+/**
+ * Proceed with the container shutdown.
+ *
+ * The shutdown sequence consists in the following steps:
+ *
+ *   1) All services are stopped in reverse order. We wait for a maximum of
+ *      250msec before proceeding to the next service.
+ *   2) Wait for processes of services to terminate. Services not stopped
+ *      within their stop timeout are killed.
+ *   3) If some processes are still alive, a TERM signal is sent to everyone.
+ *   4) Processes are reaped for a maximum of 5 seconds.
+ *   5) If some processes are still alive, a KILL signal is sent to everyone.
+ *   6) Wait until all processes are reaped.
+ */ 
+static void cinit_shutdown()
+{
+    CEXCEPTION_T e;
+
+    // Stop previous instances of services being restarted.
+    FOR_EACH_SERVICE(sid) {
+        Try {
+            stop_previous_run(sid);
+        }
+        Catch (e) {
+            log_err("failed to stop previous instance of service '%s': %s",
+                    SRV(sid).name, e.mMessage);
+        }
+    }
+
+    // Stop all services in reverse order.
+    for (int i = DIM(g_ctx.start_order) - 1; i >= 0; i--) {
+        int sid = g_ctx.start_order[i];
+        if (sid < 0) {
+            continue;
+        }
+        else if (SRV(sid).is_service_group) {
+            continue;
+        }
+        else if (SRV(sid).pid == 0) {
+            continue;
+        }
+
+        Try {
+            stop_service(sid);
+        }
+        Catch (e) {
+            log_err("failed to stop service '%s': %s", SRV(sid).name, e.mMessage);
+        }
+
+        if (child_handler(250, sid)) {
+            // All children have terminated. Processes of stopped services
+            // may still be alive if we are not PID 1.
+            break;
+        }
+    }
+
+    // Wait for processes of services to terminate.
+    if (wait_for_stopping_services()) {
+        // All processes have terminated.
+        return;
+    }
+
+    // Send a SIGTERM to everyone.
+    log("sending SIGTERM to all processes...");
+    kill(-1, SIGTERM);
+
+    // Allow some time (default 5 seconds) for remaining processes to gracefully
+    // terminate.
+    if (child_handler(g_ctx.services_gracetime, -1)) {
+        // All processes have terminated.
+        return;
+    }
+
+    // Now force-kill everyone.
+    log("sending SIGKILL to all processes...");
+    kill(-1, SIGKILL);
+
+    // Wait until we reap all processes.
+    child_handler(-1, -1);
+}
+
+static void cinit_exit(int status)
+{
+    // Make sure all queued messages are written.
+    log_queue_stop();
+
+    // Replace ourself with the exit script, if it exists.
+    if (chdir(SRV_ROOT()) == 0 && access("exit", X_OK) == 0) {
+        char arg[FMT_LONG];
+        char *argv[] = { "exit", arg, NULL };
+        snprintf(arg, sizeof(arg), "%d", status);
+        execve("./exit", argv, environ);
+    }
+    _exit(status);
+}
+
+/**
+ * Open the named pipe (FIFO) where the reply of a command should be written.
+ *
+ * The reader is given a short time to open its side of the named pipe.  The
+ * named pipe is enlarged, when allowed, so replies can be written without
+ * waiting for the reader.
+ *
+ * @param[in] path Path of the named pipe.
+ *
+ * @return File descriptor of the named pipe or -1 on error.
+ */
+static int open_cmd_reply(const char *path)
+{
+    unsigned long start = get_time();
+    struct stat st;
+
+    // Only named pipes are accepted.
+    if (lstat(path, &st) != 0 || !S_ISFIFO(st.st_mode)) {
+        return -1;
+    }
+
+    while (true) {
+        int fd = open(path, O_WRONLY | O_NONBLOCK | O_NOFOLLOW | O_CLOEXEC);
+        if (fd >= 0) {
+            if (fstat(fd, &st) != 0 || !S_ISFIFO(st.st_mode)) {
+                close(fd);
+                return -1;
+            }
+            fcntl(fd, F_SETPIPE_SZ, CMD_REPLY_PIPE_SIZE);
+            return fd;
+        }
+        else if (errno != ENXIO || get_time() - start >= CMD_REPLY_TIMEOUT) {
+            return -1;
+        }
+
+        // No reader yet.
+        msleep(10);
+    }
+}
+
+/**
+ * Write to the reply of a command.
+ *
+ * The reply is written without blocking: supervision must not be stalled by a
+ * reader that doesn't consume its reply.  If the reply cannot be written, the
+ * file descriptor is closed and further writes are ignored.
+ *
+ * @param[in,out] fd Pointer to the file descriptor of the reply.
+ * @param[in] fmt Format of the reply.
+ * @param[in] ... Argument(s) of the reply.
+ */
+static void cmd_reply(int *fd, const char *fmt, ...)
+{
+    char buf[1024];
+    const char *ptr = buf;
+
+    if (*fd < 0) {
+        return;
+    }
+
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    if (len < 0) {
+        return;
+    }
+    else if (len >= sizeof(buf)) {
+        len = sizeof(buf) - 1;
+    }
+
+    while (len > 0) {
+        ssize_t n = write(*fd, ptr, len);
+        if (n >= 0) {
+            ptr += n;
+            len -= n;
+            continue;
+        }
+        else if (errno == EINTR) {
+            continue;
+        }
+        else if (errno == EAGAIN) {
+            log_debug("reply pipe full, dropping rest of the reply.");
+        }
+
+        // Reader is gone or too slow.
+        close_fd(fd);
+        break;
+    }
+}
+
+/**
+ * Shed load of a sheddable service, or restore it.
+ *
+ * Depending on its mode, a running service is either paused or stopped.  A
+ * stopped service is restarted once load shedding ends.
+ *
+ * @param[in] sid Index of the service.
+ * @param[in] shed Whether to shed or restore the service.
+ */
+static void shed_service(int sid, bool shed)
+{
+    CEXCEPTION_T e;
+
+    if (SRV(sid).shed == shed) {
+        return;
+    }
+    else if (shed && SRV(sid).pid == 0) {
+        // Nothing to shed.
+        return;
+    }
+
+    switch (SRV(sid).shed_mode) {
+        case SHED_MODE_PAUSE:
+            log("%s service '%s'.", shed ? "pausing" : "resuming", SRV(sid).name);
+            pause_service(sid, shed);
+            if (!shed) {
+                // Failures while paused are not relevant.
+                arm_liveness_probe(sid);
+                arm_watchdog(sid);
+            }
+            break;
+        case SHED_MODE_STOP:
+            if (shed) {
+                Try {
+                    stop_service(sid);
+                    SRV(sid).restart_requested = true;
+                }
+                Catch (e) {
+                    log_err("failed to stop service '%s': %s", SRV(sid).name, e.mMessage);
+                    return;
+                }
+            }
+            break;
+        case SHED_MODE_NONE:
+            return;
+    }
+
+    SRV(sid).shed = shed;
+}
+
+/**
+ * Start or end load shedding.
+ *
+ * @param[in] enable Whether to start or end load shedding.
+ */
+static void set_load_shedding(bool enable)
+{
+    g_ctx.load_shedding = enable;
+
+    FOR_EACH_SERVICE(sid) {
+        if (SRV(sid).shed_mode != SHED_MODE_NONE) {
+            shed_service(sid, enable);
+        }
+    }
+}
+
+/**
+ * Handle a pressure event.
+ *
+ * @param[in] resource Resource under pressure.
+ */
+static void handle_pressure_event(psi_resource_t resource)
+{
+    g_ctx.load_shedding_time = get_time();
+    if (!g_ctx.load_shedding) {
+        log("%s pressure above %u%%, shedding load...",
+                psi_resource_name(resource),
+                g_ctx.load_shedding_threshold);
+        set_load_shedding(true);
+    }
+}
+
+/**
+ * End load shedding if the pressure went down.
+ *
+ * Load shedding ends when, for some time after the latest event, the
+ * pressure of all monitored resources went back below the threshold.
+ */
+static void check_load_shedding_end()
+{
+    if (!g_ctx.load_shedding) {
+        return;
+    }
+    else if (get_time() - g_ctx.load_shedding_time < LOAD_SHEDDING_MIN_DURATION) {
+        return;
+    }
+
+    for (int i = 0; i < PSI_NUM_RESOURCES; i++) {
+        double avg10;
+        if (g_ctx.psi_fds[i] >= 0 && psi_read_avg10(i, &avg10) == 0 &&
+            avg10 >= g_ctx.load_shedding_threshold) {
+            return;
+        }
+    }
+
+    log("pressure back below %u%%, restoring shed services...", g_ctx.load_shedding_threshold);
+    set_load_shedding(false);
+}
+
+/**
+ * Check if a file descriptor refers to a file already passed to a service.
+ *
+ * Files are compared by device and inode, which identify sockets as well.
+ *
+ * @param[in] sid Index of the service.
+ * @param[in] fd The file descriptor.
+ *
+ * @return True if the file is stored or is a listening socket of the service.
+ */
+static bool is_service_fd(int sid, int fd)
+{
+    struct stat st;
+    struct stat other;
+
+    if (fstat(fd, &st) < 0) {
+        return false;
+    }
+
+    for (size_t i = 0; i < SRV(sid).num_listen_fds + SRV(sid).num_stored_fds; i++) {
+        int known = i < SRV(sid).num_listen_fds ?
+            SRV(sid).listen_fds[i] :
+            SRV(sid).stored_fds[i - SRV(sid).num_listen_fds];
+        if (fstat(known, &other) == 0 && other.st_dev == st.st_dev && other.st_ino == st.st_ino) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Store file descriptors sent by a service.
+ *
+ * Stored file descriptors are passed to the next runs of the service.
+ * Descriptors of files already passed to the service, for example sent again
+ * after a restart, are not stored twice.  Descriptors that are not stored are
+ * left to the caller.
+ *
+ * @param[in] sid Index of the service.
+ * @param[in] name Name of the file descriptors.
+ * @param[in,out] fds File descriptors, set to -1 when stored.
+ * @param[in] num_fds Number of file descriptors.
+ */
+static void store_service_fds(int sid, const char *name, int *fds, size_t num_fds)
+{
+    for (size_t i = 0; i < num_fds; i++) {
+        size_t n = SRV(sid).num_stored_fds;
+        if (is_service_fd(sid, fds[i])) {
+            log_debug("file descriptor sent by service '%s' already stored, discarded.",
+                    SRV(sid).name);
+            continue;
+        }
+        else if (n >= SRV(sid).fdstore_max) {
+            log_err("file descriptor store of service '%s' is full, "
+                    "%zu file descriptor(s) discarded.", SRV(sid).name, num_fds - i);
+            return;
+        }
+        SRV(sid).stored_fds[n] = fds[i];
+        snprintf(SRV(sid).stored_fd_names[n], STORED_FD_NAME_SIZE, "%s", name);
+        SRV(sid).num_stored_fds++;
+        fds[i] = -1;
+        log_debug("file descriptor of service '%s' stored as '%s'.", SRV(sid).name, name);
+    }
+}
+
+/**
+ * Remove stored file descriptors of a service.
+ *
+ * @param[in] sid Index of the service.
+ * @param[in] name Name of the file descriptors to remove.
+ */
+static void remove_service_fds(int sid, const char *name)
+{
+    size_t n = 0;
+
+    for (size_t i = 0; i < SRV(sid).num_stored_fds; i++) {
+        if (strcmp(SRV(sid).stored_fd_names[i], name) == 0) {
+            close_fd(&SRV(sid).stored_fds[i]);
+        }
+        else {
+            // Keep the order of remaining file descriptors.
+            SRV(sid).stored_fds[n] = SRV(sid).stored_fds[i];
+            memmove(SRV(sid).stored_fd_names[n], SRV(sid).stored_fd_names[i], STORED_FD_NAME_SIZE);
+            n++;
+        }
+    }
+    SRV(sid).num_stored_fds = n;
+}
+
+/**
+ * Parse the value of a load metric.
+ *
+ * @param[in] str String to parse.
+ * @param[out] value Where to store the value.
+ *
+ * @return -1 if the value is invalid, 0 otherwise.
+ */
+static int parse_metric(const char *str, double *value)
+{
+    char *end;
+
+    errno = 0;
+    double v = strtod(str, &end);
+    if (errno != 0 || end == str || !isfinite(v) || v < 0) {
+        return -1;
+    }
+
+    // Only trailing whitespaces are allowed.
+    while (isspace((unsigned char)*end)) {
+        end++;
+    }
+    if (*end != '\0') {
+        return -1;
+    }
+
+    *value = v;
+    return 0;
+}
+
+/**
+ * Process messages received on the notification socket.
+ *
+ * Messages follow the sd_notify(3) format: newline-separated assignments.
+ * 'WATCHDOG=1' pushes the watchdog deadline of the sending service one
+ * interval further, 'WATCHDOG=trigger' restarts the service immediately.
+ * 'FDSTORE=1' stores file descriptors sent with the message and
+ * 'FDSTOREREMOVE=1' removes stored ones, both under the name given by
+ * 'FDNAME='.  'METRIC=' reports the load of an autoscaled instance.  Other
+ * assignments are ignored.
+ *
+ * @return true if a service has been restarted.
+ */
+static bool process_notify_messages()
+{
+    CEXCEPTION_T e;
+    char buf[NOTIFY_MAX_MSG_SIZE];
+    int fds[RECEIVE_DGRAM_MAX_FDS];
+    size_t num_fds;
+    pid_t pid;
+    bool restarted = false;
+
+    while (receive_dgram(g_ctx.notify_fd, buf, sizeof(buf), &pid, fds, &num_fds) >= 0) {
+        bool ping = false;
+        bool trigger = false;
+        bool fdstore = false;
+        bool fdstoreremove = false;
+        const char *fdname = STORED_FD_DEFAULT_NAME;
+        int sid = -1;
+
+        // Keepalives are frequent: only look for the sender when the
+        // message is relevant.
+        if (num_fds > 0 || strstr(buf, "WATCHDOG=") || strstr(buf, "FDSTORE") ||
+            strstr(buf, "METRIC=")) {
+            sid = pid > 0 ? find_service_by_member(pid) : -1;
+            if (sid < 0) {
+                log_debug("ignoring notification from unknown process %d.", pid);
+            }
+        }
+
+        char *saveptr = NULL;
+        for (char *line = strtok_r(buf, "\n", &saveptr);
+             line != NULL && sid >= 0;
+             line = strtok_r(NULL, "\n", &saveptr)) {
+            if (strcmp(line, "WATCHDOG=1") == 0) {
+                ping = true;
+            }
+            else if (strcmp(line, "WATCHDOG=trigger") == 0) {
+                trigger = true;
+            }
+            else if (strcmp(line, "FDSTORE=1") == 0) {
+                fdstore = true;
+            }
+            else if (strcmp(line, "FDSTOREREMOVE=1") == 0) {
+                fdstoreremove = true;
+            }
+            else if (strncmp(line, "METRIC=", 7) == 0) {
+                if (parse_metric(line + 7, &SRV(sid).metric) < 0) {
+                    log_err("invalid metric received from service '%s'.", SRV(sid).name);
+                }
+                else {
+                    SRV(sid).metric_set = true;
+                }
+            }
+            else if (strncmp(line, "FDNAME=", 7) == 0) {
+                // Colons separate names passed to services.
+                if (line[7] == '\0' || strlen(line + 7) >= STORED_FD_NAME_SIZE || strchr(line + 7, ':')) {
+                    log_err("invalid file descriptor name received from service '%s'.",
+                            SRV(sid).name);
+                }
+                else {
+                    fdname = line + 7;
+                }
+            }
+        }
+
+        if (sid >= 0 && fdstoreremove) {
+            remove_service_fds(sid, fdname);
+        }
+        if (sid >= 0 && fdstore && num_fds > 0) {
+            // File descriptors are also stored by a stopping service, to be
+            // passed to its next run.
+            if (SRV(sid).fdstore_max == 0) {
+                log_err("service '%s' sent file descriptors to store, but its store is disabled.",
+                        SRV(sid).name);
+            }
+            else {
+                store_service_fds(sid, fdname, fds, num_fds);
+            }
+        }
+
+        // Close file descriptors that have not been stored.
+        for (size_t i = 0; i < num_fds; i++) {
+            if (fds[i] >= 0) {
+                close(fds[i]);
+            }
+        }
+
+        if (sid < 0 || SRV(sid).watchdog_interval == 0 || SRV(sid).restart_requested) {
+            continue;
+        }
+        else if (trigger) {
+            log_err("service '%s' triggered its watchdog, restarting...", SRV(sid).name);
+            Try {
+                stop_service(sid);
+                SRV(sid).restart_requested = true;
+            }
+            Catch (e) {
+                log_err("failed to stop service '%s': %s", SRV(sid).name, e.mMessage);
+            }
+            restarted = true;
+        }
+        else if (ping) {
+            SRV(sid).watchdog_deadline = get_time() + SRV(sid).watchdog_interval;
+        }
+    }
+
+    return restarted;
+}
+
+/**
+ * Get the earliest watchdog deadline of running services.
+ *
+ * Keepalives only push deadlines further, so the returned value stays a
+ * valid lower bound until a service is started or resumed.
+ *
+ * @return The earliest deadline, ULONG_MAX if no watchdog is armed.
+ */
+static unsigned long next_watchdog_deadline()
+{
+    unsigned long deadline = ULONG_MAX;
+
+    FOR_EACH_SERVICE(sid) {
+        if (SRV(sid).watchdog_interval > 0 && SRV(sid).pid > 0 &&
+            !SRV(sid).restart_requested && !SRV(sid).shed) {
+            deadline = MIN(deadline, SRV(sid).watchdog_deadline);
+        }
+    }
+
+    return deadline;
+}
+
+/**
+ * Check if an on-demand service waits for a connection to be started.
+ *
+ * @param[in] sid Index of the service.
+ *
+ * @return true if the service waits for a connection.
+ */
+static bool is_waiting_for_connection(int sid)
+{
+    if (SRV(sid).start_mode != START_MODE_ON_DEMAND || SRV(sid).is_service_group ||
+        SRV(sid).retiring) {
+        return false;
+    }
+    else if (SRV(sid).pid > 0 || SRV(sid).stopping || SRV(sid).activated ||
+             SRV(sid).restart_requested) {
+        return false;
+    }
+    else if (g_ctx.load_shedding && SRV(sid).shed_mode != SHED_MODE_NONE) {
+        // Started once load shedding ends.
+        return false;
+    }
+    else if (get_time() - SRV(sid).start_time <= SERVICE_RESTART_DELAY) {
+        // A service that crashed or failed to start while connections are
+        // pending is not started again before the restart delay.
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Wait for events.
+ *
+ * Pressure events update the load shedding state, while notifications from
+ * services are processed as they arrive.  A connection to a listening socket
+ * of an on-demand service marks the service as activated.  The wait ends
+ * after the timeout, on a pressure event or an activation, when a signal is
+ * received or when a watchdog deadline is reached.
+ *
+ * @param[in] timeout Maximum time (in msec) to wait for events.
+ */
+static void wait_for_events(unsigned int timeout)
+{
+    unsigned long end = MIN(get_time() + timeout, next_watchdog_deadline());
+    bool done = false;
+
+    while (!done) {
+        struct pollfd fds[PSI_NUM_RESOURCES + 1 + MAX_NUM_SERVICES * MAX_NUM_SERVICE_LISTEN_FDS];
+        int owners[DIM(fds)]; // Resource or index of the service.
+        nfds_t num_psi_fds = 0;
+        nfds_t nfds = 0;
+
+        unsigned long now = get_time();
+        unsigned long wakeup = end;
+        if (now >= end) {
+            break;
+        }
+
+        for (int i = 0; i < PSI_NUM_RESOURCES; i++) {
+            if (g_ctx.psi_fds[i] >= 0) {
+                fds[nfds].fd = g_ctx.psi_fds[i];
+                fds[nfds].events = POLLPRI;
+                fds[nfds].revents = 0;
+                owners[nfds] = i;
+                nfds++;
+            }
+        }
+        num_psi_fds = nfds;
+        if (g_ctx.notify_fd >= 0) {
+            fds[nfds].fd = g_ctx.notify_fd;
+            fds[nfds].events = POLLIN;
+            fds[nfds].revents = 0;
+            nfds++;
+        }
+        FOR_EACH_SERVICE(sid) {
+            if (is_waiting_for_connection(sid)) {
+                for (size_t i = 0; i < SRV(sid).num_listen_fds; i++) {
+                    fds[nfds].fd = SRV(sid).listen_fds[i];
+                    fds[nfds].events = POLLIN;
+                    fds[nfds].revents = 0;
+                    owners[nfds] = sid;
+                    nfds++;
+                }
+            }
+            else if (SRV(sid).start_mode == START_MODE_ON_DEMAND && SRV(sid).pid == 0 &&
+                     now - SRV(sid).start_time <= SERVICE_RESTART_DELAY) {
+                // Wait for connections again once the restart delay passed.
+                wakeup = MIN(wakeup, SRV(sid).start_time + SERVICE_RESTART_DELAY + 1);
+            }
+        }
+
+        int rc = poll(fds, nfds, wakeup - now);
+        if (rc < 0) {
+            // Interrupted by a signal, e.g. a terminated service.
+            break;
+        }
+        else if (rc == 0) {
+            continue;
+        }
+
+        for (nfds_t i = 0; i < nfds; i++) {
+            if (fds[i].revents == 0) {
+                continue;
+            }
+            else if (i >= num_psi_fds && fds[i].fd == g_ctx.notify_fd) {
+                done |= process_notify_messages();
+            }
+            else if (i >= num_psi_fds) {
+                // Several sockets of the service may be ready.
+                SRV(owners[i]).activated = true;
+                done = true;
+            }
+            else if (fds[i].revents & (POLLERR | POLLNVAL)) {
+                log_err("%s pressure trigger no longer available.",
+                        psi_resource_name(owners[i]));
+                close_fd(&g_ctx.psi_fds[owners[i]]);
+                done = true;
+            }
+            else if (fds[i].revents & POLLPRI) {
+                handle_pressure_event(owners[i]);
+                done = true;
+            }
+        }
+    }
+
+    check_load_shedding_end();
+}
+
+/**
+ * Start activated on-demand services and stop the ones that are idle.
+ *
+ * A service is idle when none of its listening sockets has a connection,
+ * accepted or pending.
+ */
+static void check_on_demand_services()
+{
+    CEXCEPTION_T e;
+
+    FOR_EACH_SERVICE(sid) {
+        if (SRV(sid).start_mode != START_MODE_ON_DEMAND) {
+            continue;
+        }
+        else if (SRV(sid).activated) {
+            SRV(sid).activated = false;
+            if (SRV(sid).pid > 0 || SRV(sid).stopping) {
+                continue;
+            }
+            log("connection to service '%s' received.", SRV(sid).name);
+
+            // Failed starts also delay the next one.
+            SRV(sid).start_time = get_time();
+            Try {
+                start_service(sid);
+            }
+            Catch (e) {
+                log_err("failed to start service '%s': %s", SRV(sid).name, e.mMessage);
+            }
+        }
+        else if (SRV(sid).idle_timeout > 0 && SRV(sid).pid > 0 && !SRV(sid).stopping &&
+                 !SRV(sid).restart_requested && !SRV(sid).shed) {
+            unsigned long now = get_time();
+
+            for (size_t i = 0; i < SRV(sid).num_listen_fds; i++) {
+                // On error, consider the service as active.
+                if (count_socket_connections(SRV(sid).listen_fds[i]) != 0) {
+                    SRV(sid).active_time = now;
+                    break;
+                }
+            }
+
+            if (now - SRV(sid).active_time >= SRV(sid).idle_timeout) {
+                log("service '%s' idle for %u msec, stopping...",
+                        SRV(sid).name, SRV(sid).idle_timeout);
+                SRV(sid).idle_stopped = true;
+                Try {
+                    stop_service(sid);
+                }
+                Catch (e) {
+                    log_err("failed to stop service '%s': %s", SRV(sid).name, e.mMessage);
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Get the load of an autoscaled template.
+ *
+ * @param[in] tid Index of the template.
+ * @param[in] num_instances Number of instances of the template.
+ * @param[out] load Where to store the load, per instance.
+ *
+ * @return false if the load is not available.
+ */
+static bool get_template_load(int tid, unsigned int num_instances, double *load)
+{
+    CEXCEPTION_T e;
+
+    double sum = 0;
+    unsigned int n = 0;
+
+    switch (SRV(tid).scale_metric) {
+        case SCALE_METRIC_CPU:
+            FOR_EACH_SERVICE(sid) {
+                sampler_stats_t sample;
+                if (is_instance_of(sid, tid) && !SRV(sid).retiring && SRV(sid).pid > 0 &&
+                    sampler_get(sid, &sample)) {
+                    sum += sample.cpu;
+                    n++;
+                }
+            }
+            break;
+        case SCALE_METRIC_NOTIFY:
+            FOR_EACH_SERVICE(sid) {
+                if (is_instance_of(sid, tid) && !SRV(sid).retiring && SRV(sid).metric_set) {
+                    sum += SRV(sid).metric;
+                    n++;
+                }
+            }
+            break;
+        case SCALE_METRIC_PSI:
+            if (psi_read_avg10(PSI_RESOURCE_CPU, &sum) == 0) {
+                n = 1;
+            }
+            break;
+        case SCALE_METRIC_FILE:
+        {
+            char buf[64];
+            char *ptr = buf;
+            Try {
+                read_file(SRV(tid).scale_metric_file, &ptr, sizeof(buf));
+                if (parse_metric(buf, &sum) < 0) {
+                    ThrowMessage("invalid value");
+                }
+                n = num_instances;
+            }
+            Catch (e) {
+                log_debug("could not read load of service '%s': %s.", SRV(tid).name, e.mMessage);
+            }
+            break;
+        }
+        case SCALE_METRIC_NONE:
+            break;
+    }
+
+    if (n == 0) {
+        return false;
+    }
+    *load = sum / n;
+    return true;
+}
+
+/**
+ * Start the prober and the resource sampler when services need them.
+ *
+ * The prober is started if a service has a liveness probe.  The resource
+ * sampler is required to enforce memory limits and to scale on CPU usage, so
+ * it is started anyway when a service needs it.  Threads already running are
+ * left untouched, so this is also called when services are loaded at
+ * runtime, before they are started.
+ */
+static void start_helper_threads()
+{
+    unsigned int interval = g_ctx.sampler_interval;
+
+    if (!probe_running()) {
+        FOR_EACH_SERVICE(sid) {
+            if (SRV(sid).liveness.type != PROBE_TYPE_NONE) {
+                if (probe_start(DIM(g_ctx.services)) < 0) {
+                    log_err("could not start prober: %s.", strerror(errno));
+                }
+                break;
+            }
+        }
+    }
+
+    if (!sampler_running()) {
+        if (interval == 0) {
+            FOR_EACH_SERVICE(sid) {
+                if (SRV(sid).memory_soft_limit > 0 || SRV(sid).memory_hard_limit > 0 ||
+                    SRV(sid).scale_metric == SCALE_METRIC_CPU) {
+                    interval = DEFAULT_MEMORY_LIMIT_SAMPLER_INTERVAL;
+                    break;
+                }
+            }
+        }
+        if (interval > 0) {
+            if (sampler_start(DIM(g_ctx.services), interval) < 0) {
+                log_err("could not start resource sampler: %s.", strerror(errno));
+            }
+        }
+    }
+}
+
+/**
+ * Add an instance to an autoscaled template.
+ *
+ * If the instance fails to start, it is removed again.
+ *
+ * @param[in] tid Index of the template.
+ */
+static void scale_template_up(int tid)
+{
+    CEXCEPTION_T e;
+    unsigned int instance = 0;
+
+    // Use the lowest free instance number.
+    for (bool used = true; used; ) {
+        used = false;
+        FOR_EACH_SERVICE(sid) {
+            if (is_instance_of(sid, tid) && SRV(sid).instance == instance) {
+                used = true;
+                instance++;
+                break;
+            }
+        }
+    }
+
+    int sid = create_instance(tid, instance);
+    add_to_start_order(sid, tid);
+    SRV(sid).scanned = true;
+    SRV(tid).num_instances++;
+    update_log_prefix_length();
+    start_helper_threads();
+
+    Try {
+        start_service(sid);
+    }
+    Catch (e) {
+        SRV(tid).num_instances--;
+        if (SRV(sid).pid > 0) {
+            // The process is running: unload the instance once terminated.
+            SRV(sid).retiring = true;
+            SRV(sid).restart_requested = true;
+            stop_service(sid);
+        }
+        else {
+            remove_from_start_order(sid);
+            unload_service(sid);
+            update_log_prefix_length();
+        }
+        Throw(e);
+    }
+}
+
+/**
+ * Remove an instance from an autoscaled template.
+ *
+ * The instance with the highest number is stopped.  It is unloaded once
+ * terminated, by check_autoscaling().
+ *
+ * @param[in] tid Index of the template.
+ */
+static void scale_template_down(int tid)
+{
+    int last = -1;
+
+    FOR_EACH_SERVICE(sid) {
+        if (is_instance_of(sid, tid) && !SRV(sid).retiring &&
+            (last < 0 || SRV(sid).instance > SRV(last).instance)) {
+            last = sid;
+        }
+    }
+    if (last < 0) {
+        return;
+    }
+
+    // Termination of the instance must not trigger a shutdown.
+    SRV(last).retiring = true;
+    SRV(last).restart_requested = true;
+    SRV(tid).num_instances--;
+    stop_previous_run(last);
+    stop_service(last);
+}
+
+/**
+ * Scale instances of templates according to their load.
+ *
+ * The load of a template is checked periodically.  An instance is added when
+ * the load goes above the scale up threshold and removed when it goes below
+ * the scale down threshold.  The gap between both thresholds and the cooldown
+ * following each scaling prevent flapping.  No instance is added while load
+ * is shed.
+ */
+static void check_autoscaling()
+{
+    CEXCEPTION_T e;
+    unsigned long now = get_time();
+
+    // Unload removed instances once terminated.
+    FOR_EACH_SERVICE(sid) {
+        if (SRV(sid).retiring && SRV(sid).pid == 0 && !SRV(sid).stopping &&
+            SRV(sid).previous.pid == 0) {
+            log("instance '%s' removed.", SRV(sid).name);
+            remove_from_start_order(sid);
+            unload_service(sid);
+        }
+    }
+
+    FOR_EACH_SERVICE(tid) {
+        double load;
+
+        if (SRV(tid).scale_metric == SCALE_METRIC_NONE || !SRV(tid).is_template) {
+            continue;
+        }
+        else if (now - SRV(tid).scale_check_time < SCALE_CHECK_INTERVAL) {
+            continue;
+        }
+        SRV(tid).scale_check_time = now;
+
+        if (now - SRV(tid).scale_time < SRV(tid).scale_cooldown) {
+            continue;
+        }
+        else if (!get_template_load(tid, SRV(tid).num_instances, &load)) {
+            continue;
+        }
+
+        Try {
+            if (load > SRV(tid).scale_up_threshold &&
+                SRV(tid).num_instances < SRV(tid).instances_max && !g_ctx.load_shedding) {
+                log("load of service '%s' is %.1f, scaling up to %u instance(s)...",
+                        SRV(tid).name, load, SRV(tid).num_instances + 1);
+                SRV(tid).scale_time = now;
+                scale_template_up(tid);
+            }
+            else if (load < SRV(tid).scale_down_threshold &&
+                     SRV(tid).num_instances > SRV(tid).instances_min) {
+                log("load of service '%s' is %.1f, scaling down to %u instance(s)...",
+                        SRV(tid).name, load, SRV(tid).num_instances - 1);
+                SRV(tid).scale_time = now;
+                scale_template_down(tid);
+            }
+        }
+        Catch (e) {
+            log_err("failed to scale service '%s': %s", SRV(tid).name, e.mMessage);
+        }
+    }
+}
+
+/**
+ * Restart services that missed their watchdog deadline.
+ */
+static void check_watchdogs()
+{
+    CEXCEPTION_T e;
+    unsigned long now = get_time();
+
+    FOR_EACH_SERVICE(sid) {
+        if (SRV(sid).watchdog_interval == 0) {
+            continue;
+        }
+        else if (SRV(sid).pid == 0 || SRV(sid).restart_requested || SRV(sid).shed) {
+            continue;
+        }
+
+        if (now >= SRV(sid).watchdog_deadline) {
+            log_err("service '%s' missed its watchdog deadline of %u msec, restarting...",
+                    SRV(sid).name, SRV(sid).watchdog_interval);
+            Try {
+                stop_service(sid);
+                SRV(sid).restart_requested = true;
+            }
+            Catch (e) {
+                log_err("failed to stop service '%s': %s", SRV(sid).name, e.mMessage);
+                arm_watchdog(sid);
+            }
+        }
+    }
+}
+
+/**
+ * Restart services failing their liveness probe.
+ */
+static void check_liveness()
+{
+    CEXCEPTION_T e;
+
+    FOR_EACH_SERVICE(sid) {
+        if (SRV(sid).liveness.type == PROBE_TYPE_NONE) {
+            continue;
+        }
+        else if (SRV(sid).pid == 0 || SRV(sid).restart_requested || SRV(sid).shed) {
+            continue;
+        }
+
+        unsigned int failures = probe_get_failures(sid);
+        if (failures >= SRV(sid).liveness.failure_threshold) {
+            log_err("service '%s' failed %u consecutive liveness probes, restarting...",
+                    SRV(sid).name, failures);
+            Try {
+                stop_service(sid);
+                SRV(sid).restart_requested = true;
+            }
+            Catch (e) {
+                log_err("failed to stop service '%s': %s", SRV(sid).name, e.mMessage);
+            }
+        }
+    }
+}
+
+/**
+ * Enforce memory limits of services.
+ *
+ * The memory usage of a service is the proportional set size of its
+ * processes, as reported by the resource sampler: pages shared between
+ * processes (libraries, forked workers) are counted once.  The resident set
+ * size is used instead when the proportional one is not available.  When a service goes above its soft
+ * limit, the configured signal is sent once.  It is sent again only after
+ * the memory usage went back below a fraction of the soft limit.  When a
+ * service goes above its hard limit, it is restarted.
+ */
+static void check_memory_limits()
+{
+    CEXCEPTION_T e;
+
+    FOR_EACH_SERVICE(sid) {
+        sampler_stats_t sample;
+
+        if (SRV(sid).pid == 0 || SRV(sid).restart_requested) {
+            continue;
+        }
+        else if (SRV(sid).memory_soft_limit == 0 && SRV(sid).memory_hard_limit == 0) {
+            continue;
+        }
+        else if (!sampler_get(sid, &sample)) {
+            continue;
+        }
+        unsigned long long usage = sample.pss > 0 ? sample.pss : sample.rss;
+
+        // Check the hard limit.
+        if (SRV(sid).memory_hard_limit > 0 && usage > SRV(sid).memory_hard_limit) {
+            log_err("service '%s' exceeded its hard memory limit (%llu > %llu bytes), restarting...",
+                    SRV(sid).name, usage, SRV(sid).memory_hard_limit);
+            Try {
+                stop_service(sid);
+                SRV(sid).restart_requested = true;
+            }
+            Catch (e) {
+                log_err("failed to stop service '%s': %s", SRV(sid).name, e.mMessage);
+            }
+            continue;
+        }
+
+        // Check the soft limit.
+        if (SRV(sid).memory_soft_limit == 0) {
+            continue;
+        }
+        else if (SRV(sid).memory_soft_limit_reached) {
+            if (usage < SRV(sid).memory_soft_limit / 100 * MEMORY_SOFT_LIMIT_REARM_PERCENT) {
+                log_debug("service '%s' back below its soft memory limit.", SRV(sid).name);
+                SRV(sid).memory_soft_limit_reached = false;
+            }
+        }
+        else if (usage > SRV(sid).memory_soft_limit) {
+            log("service '%s' exceeded its soft memory limit (%llu > %llu bytes), sending %s.",
+                    SRV(sid).name, usage, SRV(sid).memory_soft_limit,
+                    signal_to_str(SRV(sid).memory_limit_signal));
+            kill(SRV(sid).pid, SRV(sid).memory_limit_signal);
+            SRV(sid).memory_soft_limit_reached = true;
+        }
+    }
+}
+
+/**
+ * Stop services and wait for their termination.
+ *
+ * @param[in] order Order in which services were started.
+ * @param[in] selected Services to stop, indexed by service index.
+ */
+static void stop_selected_services(const int *order, const bool *selected)
+{
+    CEXCEPTION_T e;
+
+    for (int i = MAX_NUM_SERVICES - 1; i >= 0; i--) {
+        int sid = order[i];
+        if (sid < 0 || !selected[sid]) {
+            continue;
+        }
+
+        Try {
+            // Termination of the service must not trigger a shutdown.
+            SRV(sid).restart_requested = true;
+            stop_previous_run(sid);
+            stop_service(sid);
+        }
+        Catch (e) {
+            log_err("failed to stop service '%s': %s", SRV(sid).name, e.mMessage);
+        }
+    }
+
+    wait_for_stopping_services();
+}
+
+/**
+ * Unload stopped services.
+ *
+ * @param[in,out] selected Services to unload, indexed by service index.
+ *                         Services still running are unselected.
+ */
+static void unload_selected_services(bool *selected)
+{
+    FOR_EACH_SERVICE(sid) {
+        if (!selected[sid]) {
+            continue;
+        }
+        else if (SRV(sid).pid > 0 || SRV(sid).stopping || SRV(sid).previous.pid > 0) {
+            log_err("service '%s' is still running, keeping it.", SRV(sid).name);
+            selected[sid] = false;
+            continue;
+        }
+        unload_service(sid);
+    }
+}
+
+/**
+ * Rescan definitions of services.
+ *
+ * Services are loaded again from the root directory and compared to the
+ * running ones, using a hash of their directory.  Changed services are
+ * stopped and loaded again, services not referenced anymore are stopped and
+ * unloaded, and new services are loaded.  Changed and new services are then
+ * started, in order.  Other services are left untouched.
+ *
+ * @param[in,out] reply_fd Reply pipe, -1 if none.
+ */
+static void rescan_services(int *reply_fd)
+{
+    CEXCEPTION_T e;
+
+    int old_order[MAX_NUM_SERVICES];
+    bool kept[MAX_NUM_SERVICES] = { false };
+    bool selected[MAX_NUM_SERVICES] = { false };
+    bool scan_failed = false;
+    unsigned int num_loaded = 0;
+    unsigned int num_removed = 0;
+
+    memcpy(old_order, g_ctx.start_order, sizeof(old_order));
+
+    // Find services whose definition changed.
+    FOR_EACH_SERVICE(sid) {
+        char path[PATH_MAX];
+        uint64_t hash;
+
+        char dir[MEMBER_SIZE(service_t, name)];
+        get_service_directory(SRV(sid).name, dir, sizeof(dir));
+        snprintf(path, sizeof(path), "%s/%s", SRV_ROOT(), dir);
+        if (hash_directory(path, ".dep", &hash) < 0 || hash != SRV(sid).config_hash) {
+            log("definition of service '%s' changed.", SRV(sid).name);
+            selected[sid] = true;
+        }
+    }
+
+    // Stop and unload changed services. They are loaded again below.
+    stop_selected_services(old_order, selected);
+    unload_selected_services(selected);
+    FOR_EACH_SERVICE(sid) {
+        kept[sid] = true;
+        SRV(sid).scanned = false;
+    }
+
+    // Walk dependencies again, loading new and changed services.
+    for (int i = 0; i < DIM(g_ctx.start_order); ++i) {
+        g_ctx.start_order[i] = -1;
+    }
+    Try {
+#ifdef LOAD_ALL_DEFINED_SERVICES
+        load_services(&scan_failed);
+#else
+        load_service_with_deps("default", -1, &scan_failed);
+#endif
+    }
+    Catch (e) {
+        log_err("%s", e.mMessage);
+        scan_failed = true;
+    }
+    if (scan_failed) {
+        log_err("rescan of services incomplete, no service removed.");
+        cmd_reply(reply_fd, "ERROR: rescan of services incomplete, see log for details.\n");
+
+        // Not all services were reached: keep the previous order of kept
+        // services, followed by services loaded again.
+        int new_order[MAX_NUM_SERVICES];
+        int n = 0;
+        memcpy(new_order, g_ctx.start_order, sizeof(new_order));
+        for (int i = 0; i < DIM(g_ctx.start_order); ++i) {
+            g_ctx.start_order[i] = -1;
+        }
+        for (int i = 0; i < DIM(old_order); i++) {
+            if (old_order[i] >= 0 && kept[old_order[i]]) {
+                g_ctx.start_order[n++] = old_order[i];
+            }
+        }
+        for (int i = 0; i < DIM(new_order); i++) {
+            if (new_order[i] >= 0 && !kept[new_order[i]]) {
+                g_ctx.start_order[n++] = new_order[i];
+            }
+        }
+    }
+    update_log_prefix_length();
+    start_helper_threads();
+
+    // Stop and unload services not referenced anymore. Nothing is removed
+    // after a failure, since not all services were reached.
+    if (!scan_failed) {
+        memset(selected, 0, sizeof(selected));
+        FOR_EACH_SERVICE(sid) {
+            if (!SRV(sid).scanned) {
+                log("service '%s' removed.", SRV(sid).name);
+                selected[sid] = true;
+            }
+        }
+        stop_selected_services(old_order, selected);
+        unload_selected_services(selected);
+        for (int i = 0; i < DIM(selected); i++) {
+            num_removed += selected[i];
+        }
+    }
+
+    // Start new and changed services, in order.
+    for (int i = 0; i < DIM(g_ctx.start_order); i++) {
+        int sid = g_ctx.start_order[i];
+        if (sid < 0) {
+            break;
+        }
+        else if (kept[sid]) {
+            continue;
+        }
+
+        BREAK_IF_SHUTDOWN_REQUESTED();
+
+        num_loaded++;
+        Try {
+            start_service_and_wait(sid);
+        }
+        Catch (e) {
+            log_err("%s", e.mMessage);
+        }
+    }
+
+    if (!scan_failed) {
+        log("rescan of services done: %u service(s) loaded, %u removed.", num_loaded, num_removed);
+        cmd_reply(reply_fd, "rescan of services done: %u service(s) loaded, %u removed.\n",
+                num_loaded, num_removed);
+    }
+}
+
+/**
+ * Handle the status command.
+ *
+ * @param[in,out] reply_fd File descriptor of the reply.
+ */
+static void cmd_status(int *reply_fd)
+{
+    log_queue_stats_t stats;
+
+    log_queue_get_stats(&stats);
+    cmd_reply(reply_fd, "log_queue capacity=%zu policy=%s used=%zu high_water=%zu "
+                        "enqueued=%llu written=%llu dropped=%llu blocked=%llu\n",
+            stats.capacity,
+            log_overflow_policy_to_str(stats.policy),
+            stats.used,
+            stats.high_water,
+            stats.enqueued,
+            stats.written,
+            stats.dropped,
+            stats.blocked);
+
+    FOR_EACH_SERVICE(sid) {
+        const char *state;
+        sampler_stats_t sample;
+        char sample_str[160] = "";
+
+        if (SRV(sid).is_template) {
+            state = "template";
+        }
+        else if (SRV(sid).is_service_group) {
+            state = "group";
+        }
+        else if (SRV(sid).disabled) {
+            state = "disabled";
+        }
+        else if (SRV(sid).shed && SRV(sid).pid > 0) {
+            state = "paused";
+        }
+        else if (SRV(sid).shed) {
+            state = "shed";
+        }
+        else if (SRV(sid).reloading) {
+            state = "reloading";
+        }
+        else if (SRV(sid).pid > 0) {
+            state = "running";
+        }
+        else if (SRV(sid).start_mode == START_MODE_ON_DEMAND) {
+            state = "idle";
+        }
+        else {
+            state = "stopped";
+        }
+
+        // Resources currently used by processes of the service.
+        if (sampler_get(sid, &sample)) {
+            snprintf(sample_str, sizeof(sample_str),
+                    " procs=%u rss=%llu pss=%llu cpu=%.1f fds=%u",
+                    sample.num_procs, sample.rss, sample.pss, sample.cpu, sample.num_fds);
+        }
+
+        cmd_reply(reply_fd, "service %s state=%s pid=%d runs=%lu utime=%.3f stime=%.3f "
+                            "max_rss=%ld minflt=%llu majflt=%llu nvcsw=%llu nivcsw=%llu%s\n",
+                SRV(sid).name, state, SRV(sid).pid,
+                SRV(sid).usage.runs,
+                SRV(sid).usage.utime / 1000000.0,
+                SRV(sid).usage.stime / 1000000.0,
+                SRV(sid).usage.max_rss,
+                SRV(sid).usage.minflt,
+                SRV(sid).usage.majflt,
+                SRV(sid).usage.nvcsw,
+                SRV(sid).usage.nivcsw,
+                sample_str);
+    }
+}
+
+/**
+ * Write a line from the log ring buffer of a service to a command's reply.
+ *
+ * @param[in] line The line.
+ * @param[in] data Pointer to the file descriptor of the reply.
+ */
+static void reply_log_line(const char *line, void *data)
+{
+    cmd_reply((int *)data, "%s\n", line);
 }
 
 /**
- * Reap child processes that have died.
+ * Handle the logs command.
  *
- * @param[in] period The minimum amount of time (in milliseconds) the function
- *                   should perform reaping. A value of -1 means until all
- *                   child processes have been reaped.
- * @param[in] service When set, the function will perform reaping until the
- *                    specified service gets reaped.
+ * Arguments have the form '<service>[:<number of lines>][:follow]'.
  *
- * @return True if *all* children have been reaped, false otherwise.
+ * @param[in] args Arguments of the command.
+ * @param[in,out] reply_fd File descriptor of the reply.  Ownership is taken
+ *                         when following the logs.
  */
-static bool child_handler(int period, int service)
+static void cmd_logs(char *args, int *reply_fd)
 {
-    time_t now = get_time();
-    pid_t killed;
+    CEXCEPTION_T e;
 
-    while (true) {
-        int status;
+    size_t num_args = 0;
+    char **arg_list = split(args, ':', &num_args, 0, 0);
+    if (!arg_list) {
+        cmd_reply(reply_fd, "ERROR: out of memory\n");
+        return;
+    }
 
-        do {
-            killed = waitpid(-1, &status, WNOHANG);
-            handle_killed(killed, status);
-        } while (killed && killed != (pid_t)-1);
+    Try {
+        int sid = -1;
+        unsigned int num_lines = 0;
+        bool follow = false;
 
-        if (killed == (pid_t)-1) {
-            // All processes have terminated.
-            break;
+        if (num_args == 0 || arg_list[0][0] == '\0') {
+            ThrowMessage("service name missing");
         }
-
-        // Check if it's time to stop because of the specified period.
-        if (period == 0 || (period > 0 && get_time() - now >= period)) {
-            break;
+        else if ((sid = find_service(arg_list[0])) < 0) {
+            ThrowMessage("service not found: '%s'", arg_list[0]);
+        }
+        else if (!SRV(sid).log_ring) {
+            ThrowMessage("log ring buffer not enabled for service '%s'", SRV(sid).name);
         }
 
-        // Check if it't time to stop beause of the specified service.
-        if (service >= 0 && killed != 0) {
-            ASSERT_VALID_SERVICE_INDEX(service);
-            if (SRV(service).pid == 0) {
-                break;
+        num_lines = SRV(sid).log_ring_size;
+        for (size_t i = 1; i < num_args; i++) {
+            if (strcmp(arg_list[i], "follow") == 0) {
+                follow = true;
+            }
+            else {
+                Try {
+                    string_to_uint(arg_list[i], &num_lines);
+                }
+                Catch (e) {
+                    ThrowMessage("invalid number of lines '%s': %s", arg_list[i], e.mMessage);
+                }
             }
         }
 
-        msleep(50);
+        // Send the most recent lines.
+        log_ring_read(SRV(sid).log_ring, num_lines, reply_log_line, reply_fd);
+
+        // Hand over the reply to the ring buffer if logs need to be
+        // followed.
+        if (follow && *reply_fd >= 0) {
+            if (log_ring_add_follower(SRV(sid).log_ring, *reply_fd) < 0) {
+                ThrowMessage("too much followers for service '%s'", SRV(sid).name);
+            }
+            *reply_fd = -1;
+        }
+    }
+    Catch (e) {
+        cmd_reply(reply_fd, "ERROR: %s\n", e.mMessage);
     }
 
-    return (killed == (pid_t)-1);
+    free(arg_list);
 }
 
 /**
- * Proceed with the container shutdown.
+ * Process a command received from the named pipe.
  *
- * The shutdown sequence consists in the following steps:
+ * A command has the form '<command>[:<argument>][><reply pipe>]'.  When
+ * provided, the reply of the command is written to the reply named pipe.
  *
- *   1) All services are stopped in reverse order. We wait for a maximum of
- *      250msec before proceeding to the next service.
- *   2) If some processes are still alive, a TERM signal is sent to everyone.
- *   3) Processes are reaped for a maximum of 5 seconds.
- *   3) If some processes are still alive, a KILL signal is sent to everyone.
- *   4) Wait until all processes are reaped.
- */ 
-static void cinit_shutdown()
+ * @param[in] cmd The command.
+ */
+static void process_command(char *cmd)
 {
     CEXCEPTION_T e;
 
-    // Stop all services in reverse order.
-    for (int i = DIM(g_ctx.start_order) - 1; i >= 0; i--) {
-        int sid = g_ctx.start_order[i];
-        if (sid < 0) {
-            continue;
-        }
-        else if (SRV(sid).is_service_group) {
-            continue;
+    int reply_fd = -1;
+
+    // Open the reply named pipe, if any.
+    char *reply_path = strrchr(cmd, '>');
+    if (reply_path) {
+        *reply_path++ = '\0';
+        trim(reply_path);
+        reply_fd = open_cmd_reply(reply_path);
+        if (reply_fd < 0) {
+            log_err("could not open reply pipe '%s'.", reply_path);
         }
-        else if (SRV(sid).pid == 0) {
-            continue;
+    }
+    trim(cmd);
+
+    // Restart service command.
+    if (strncmp(cmd, "restart:", strlen("restart:")) == 0) {
+        const char *service = cmd + strlen("restart:");
+        int sid = find_service(service);
+        if (sid >= 0) {
+            Try {
+                log("restart request for service '%s' received.", SRV(sid).name);
+                if (SRV(sid).restart_mode == RESTART_MODE_OVERLAP && SRV(sid).pid > 0 &&
+                    !SRV(sid).stopping && SRV(sid).previous.pid == 0) {
+                    // Start the new instance first. The current one is
+                    // stopped once the new one is ready.
+                    retire_service_run(sid);
+                    Try {
+                        start_service(sid);
+                    }
+                    Catch (e) {
+                        if (SRV(sid).pid == 0) {
+                            restore_service_run(sid);
+                        }
+                        Throw(e);
+                    }
+                    cmd_reply(&reply_fd, "overlapped restart of service '%s' started.\n", SRV(sid).name);
+                }
+                else {
+                    stop_service(sid);
+                    SRV(sid).restart_requested = true;
+                    cmd_reply(&reply_fd, "restart of service '%s' requested.\n", SRV(sid).name);
+                }
+            }
+            Catch (e) {
+                log_err("failed to restart service '%s': %s", SRV(sid).name, e.mMessage);
+                cmd_reply(&reply_fd, "ERROR: failed to restart service '%s': %s\n", SRV(sid).name, e.mMessage);
+            }
         }
-
-        Try {
-            stop_service(sid);
+        else {
+            log("service not found: '%s'", service);
+            cmd_reply(&reply_fd, "ERROR: service not found: '%s'\n", service);
         }
-        Catch (e) {
-            log_err("failed to stop service '%s': %s", SRV(sid).name, e.mMessage);
+    }
+    // Reload service command.
+    else if (strncmp(cmd, "reload:", strlen("reload:")) == 0) {
+        const char *service = cmd + strlen("reload:");
+        int sid = find_service(service);
+        if (sid >= 0) {
+            Try {
+                log("reload request for service '%s' received.", SRV(sid).name);
+                reload_service(sid);
+                cmd_reply(&reply_fd, "reload of service '%s' requested.\n", SRV(sid).name);
+            }
+            Catch (e) {
+                log_err("failed to reload service '%s': %s", SRV(sid).name, e.mMessage);
+                cmd_reply(&reply_fd, "ERROR: failed to reload service '%s': %s\n", SRV(sid).name, e.mMessage);
+            }
         }
-
-        if (child_handler(250, sid)) {
-            // All processes have terminated.
-            return;
+        else {
+            log("service not found: '%s'", service);
+            cmd_reply(&reply_fd, "ERROR: service not found: '%s'\n", service);
         }
     }
-
-    if (child_handler(0, -1)) {
-        // All processes have terminated.
-        return;
+    // Rescan services command.
+    else if (strcmp(cmd, "rescan") == 0) {
+        log("rescan request received.");
+        rescan_services(&reply_fd);
+    }
+    // Status command.
+    else if (strcmp(cmd, "status") == 0) {
+        cmd_status(&reply_fd);
+    }
+    // Logs of a service command.
+    else if (strncmp(cmd, "logs:", strlen("logs:")) == 0) {
+        cmd_logs(cmd + strlen("logs:"), &reply_fd);
+    }
+    else if (cmd[0] != '\0') {
+        log("unknown command: '%s'", cmd);
+        cmd_reply(&reply_fd, "ERROR: unknown command: '%s'\n", cmd);
     }
 
-    // Send a SIGTERM to everyone.
-    log("sending SIGTERM to all processes...");
-    kill(-1, SIGTERM);
+    close_fd(&reply_fd);
+}
 
-    // Allow some time (default 5 seconds) for remaining processes to gracefully
-    // terminate.
-    if (child_handler(g_ctx.services_gracetime, -1)) {
-        // All processes have terminated.
-        return;
-    }
+/**
+ * Log a message received by the log receiver.
+ *
+ * This function is invoked from the log receiver's thread.  Each line of the
+ * message is logged, prefixed with the tag of the message.
+ *
+ * @param[in] tag Tag of the message.
+ * @param[in] pid PID of the sender.
+ * @param[in] severity Severity of the message.
+ * @param[in] msg The message.
+ * @param[in] data Unused.
+ */
+static void log_received_message(const char *tag, pid_t pid, int severity, const char *msg, void *data)
+{
+    const char *line = msg;
 
-    // Now force-kill everyone.
-    log("sending SIGKILL to all processes...");
-    kill(-1, SIGKILL);
+    while (line) {
+        const char *end = strchr(line, '\n');
+        int len = end ? end - line : strlen(line);
 
-    // Wait until we reap all processes.
-    child_handler(-1, -1);
+        if (severity <= LOG_ERR) {
+            log_stderr("[%-*s] %.*s\n", g_ctx.log_prefix_length, tag, len, line);
+        }
+        else {
+            log_stdout("[%-*s] %.*s\n", g_ctx.log_prefix_length, tag, len, line);
+        }
+
+        line = end ? end + 1 : NULL;
+    }
 }
 
-static void cinit_exit(int status)
+/**
+ * Find the service a process belongs to.
+ *
+ * This function is invoked from the log receiver's thread.  The service
+ * table is locked while searching, since the main thread may load or unload
+ * services at the same time.
+ *
+ * @param[in] pid PID of the process.
+ * @param[out] name Where to store the name of the service.
+ * @param[in] size Size of the buffer.
+ * @param[in] data Unused.
+ *
+ * @return -1 if not found, 0 otherwise.
+ */
+static int resolve_service_name(pid_t pid, char *name, size_t size, void *data)
 {
-    // Replace ourself with the exit script, if it exists.
-    if (chdir(SRV_ROOT()) == 0 && access("exit", X_OK) == 0) {
-        char arg[FMT_LONG];
-        char *argv[] = { "exit", arg, NULL };
-        snprintf(arg, sizeof(arg), "%d", status);
-        execve("./exit", argv, environ);
+    pthread_mutex_lock(&g_ctx.services_mutex);
+    int sid = find_service_by_member(pid);
+    if (sid >= 0) {
+        snprintf(name, size, "%s", SRV(sid).name);
     }
-    _exit(status);
+    pthread_mutex_unlock(&g_ctx.services_mutex);
+
+    return sid < 0 ? -1 : 0;
 }
 
 static void parse_args(int argc, char *argv[])
@@ -1868,6 +5671,90 @@ static void parse_args(int argc, char *argv[])
                             optarg, e.mMessage);
                 }
                 break;
+            case 'q':
+                Try {
+                    string_to_uint(optarg, &g_ctx.log_queue_size);
+                }
+                Catch (e) {
+                    ThrowMessage("Invalid log queue size value '%s': %s.",
+                            optarg, e.mMessage);
+                }
+                break;
+            case 'o':
+                if (strcasecmp(optarg, "block") == 0) {
+                    g_ctx.log_overflow_policy = LOG_OVERFLOW_POLICY_BLOCK;
+                }
+                else if (strcasecmp(optarg, "drop-oldest") == 0) {
+                    g_ctx.log_overflow_policy = LOG_OVERFLOW_POLICY_DROP_OLDEST;
+                }
+                else if (strcasecmp(optarg, "drop-newest") == 0) {
+                    g_ctx.log_overflow_policy = LOG_OVERFLOW_POLICY_DROP_NEWEST;
+                }
+                else {
+                    ThrowMessage("Invalid log queue overflow policy '%s'.", optarg);
+                }
+                break;
+            case 'l':
+                if (strlen(optarg) >= sizeof(g_ctx.syslog_socket)) {
+                    ThrowMessage("Syslog socket path too long.");
+                }
+                else if (optarg[0] != '\0' && optarg[0] != '/') {
+                    ThrowMessage("Syslog socket path must be absolute.");
+                }
+                else {
+                    strcpy(g_ctx.syslog_socket, optarg);
+                }
+                break;
+            case 'v':
+                g_ctx.syslog_min_severity = logrecv_string_to_severity(optarg);
+                if (g_ctx.syslog_min_severity < 0) {
+                    ThrowMessage("Invalid syslog minimum severity '%s'.", optarg);
+                }
+                break;
+            case 'n':
+                if (strlen(optarg) >= sizeof(g_ctx.log_socket)) {
+                    ThrowMessage("Log socket path too long.");
+                }
+                else if (optarg[0] != '\0' && optarg[0] != '/') {
+                    ThrowMessage("Log socket path must be absolute.");
+                }
+                else {
+                    strcpy(g_ctx.log_socket, optarg);
+                }
+                break;
+            case 'N':
+                if (strlen(optarg) >= sizeof(g_ctx.notify_socket)) {
+                    ThrowMessage("Notification socket path too long.");
+                }
+                else if (optarg[0] != '\0' && optarg[0] != '/') {
+                    ThrowMessage("Notification socket path must be absolute.");
+                }
+                else {
+                    strcpy(g_ctx.notify_socket, optarg);
+                }
+                break;
+            case 'c':
+                Try {
+                    string_to_uint(optarg, &g_ctx.sampler_interval);
+                }
+                Catch (e) {
+                    ThrowMessage("Invalid sampler interval value '%s': %s.",
+                            optarg, e.mMessage);
+                }
+                break;
+            case 'P':
+                Try {
+                    string_to_uint(optarg, &g_ctx.load_shedding_threshold);
+                }
+                Catch (e) {
+                    ThrowMessage("Invalid load shedding threshold value '%s': %s.",
+                            optarg, e.mMessage);
+                }
+                if (g_ctx.load_shedding_threshold > 100) {
+                    ThrowMessage("Invalid load shedding threshold value '%s': out of range.",
+                            optarg);
+                }
+                break;
             case 'h':
             case '?':
                 ThrowMessage("help");
@@ -1900,6 +5787,25 @@ static void usage(const char *progname)
     printf("                                              set in service's definition directory. No group by default.\n");
     printf("  -m, --default-service-umask <VALUE>         Umask value (in octal notation) to apply when not set in service's\n");
     printf("                                              definition directory. Default is 0022.\n");
+    printf("  -q, --log-queue-size <VALUE>                Maximum amount of data (in bytes) queued in memory for logging.\n");
+    printf("                                              Default is %d bytes.\n", LOG_QUEUE_DEFAULT_SIZE);
+    printf("  -o, --log-queue-overflow-policy <POLICY>    Policy applied when the log queue is full: block, drop-oldest\n");
+    printf("                                              or drop-newest. Default is drop-oldest.\n");
+    printf("  -l, --syslog-socket <PATH>                  Receive syslog messages on the Unix socket PATH (e.g. /dev/log)\n");
+    printf("                                              and forward them to the log. Disabled by default.\n");
+    printf("  -v, --syslog-min-severity <LEVEL>           Discard syslog messages less severe than LEVEL (emerg, alert,\n");
+    printf("                                              crit, err, warning, notice, info or debug). Default is debug.\n");
+    printf("  -n, --log-socket <PATH>                     Receive structured log records from services on the Unix socket\n");
+    printf("                                              PATH. The path is exported to services via the\n");
+    printf("                                              " LOG_SOCKET_ENV_VAR " environment variable. Disabled by default.\n");
+    printf("  -N, --notify-socket <PATH>                  Receive notifications (e.g. watchdog keepalives) from services on\n");
+    printf("                                              the Unix socket PATH. The path is exported to services via the\n");
+    printf("                                              " NOTIFY_SOCKET_ENV_VAR " environment variable. Disabled by default.\n");
+    printf("  -c, --sampler-interval <VALUE>              Interval (in msec) at which resources used by processes of\n");
+    printf("                                              services are sampled. Disabled (0) by default.\n");
+    printf("  -P, --load-shedding-threshold <VALUE>       Pressure (percentage of time some tasks are stalled on CPU,\n");
+    printf("                                              memory or I/O) above which sheddable services are paused or\n");
+    printf("                                              stopped. Disabled (0) by default.\n");
     printf("  -h, --help                                  Display this help and exit.\n");
 }
 
@@ -1909,7 +5815,15 @@ int main(int argc, char *argv[])
 
     int cmd_fd = -1;
     int exit_status = 0;
+    unsigned long long log_dropped = 0;
     struct group *grp = NULL;
+    logrecv_config_t logrecv_config = {
+        .syslog_path = NULL,
+        .native_path = NULL,
+        .resolver = resolve_service_name,
+        .callback = log_received_message,
+        .callback_data = NULL,
+    };
 
     // Get the program name.
     const char *progname = strrchr(argv[0], '/');
@@ -1967,6 +5881,12 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
+    // Start the log queue.
+    if (log_queue_start(g_ctx.log_queue_size, g_ctx.log_overflow_policy) < 0) {
+        printf("Could not start log queue.\n");
+        return EXIT_FAILURE;
+    }
+
     // Update the log prefix length.
     g_ctx.log_prefix_length = MAX(MIN_LOG_PREFIX_LENGTH, strlen(g_ctx.progname));
 
@@ -1984,6 +5904,8 @@ int main(int argc, char *argv[])
 
         sa.sa_handler=sigint; sigaction(SIGINT, &sa, 0);
         sa.sa_handler=sigterm; sigaction(SIGTERM, &sa, 0);
+        sa.sa_handler=sighup; sigaction(SIGHUP, &sa, 0);
+        sa.sa_handler=sigpipe; sigaction(SIGPIPE, &sa, 0);
         
         // SIGCHLD has different behavior (flags).
         sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
@@ -1995,6 +5917,8 @@ int main(int argc, char *argv[])
     // depending on the kernel. At 1073741816, this creates a huge delay with
     // applications trying to close all possible file descriptors.
     // See https://github.com/moby/moby/issues/44547
+    // Services needing a different limit can set their own via the
+    // 'rlimit_nofile' file.
     {
         struct rlimit limit;
         if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
@@ -2013,27 +5937,119 @@ int main(int argc, char *argv[])
         }
     }
 
+    // Get CPUs we are allowed to run on, used for automatic CPU affinity of
+    // services.
+    if (sched_getaffinity(0, sizeof(g_ctx.allowed_cpus), &g_ctx.allowed_cpus) < 0) {
+        log_err("Could not get CPU affinity: %s.", strerror(errno));
+        CPU_ZERO(&g_ctx.allowed_cpus);
+    }
+
+    // Setup cgroups.
+    if (cgroup_init() == 0) {
+        log("cgroups available: services run in their own cgroup.");
+    }
+    else {
+        log_debug("cgroups not available: %s.", strerror(errno));
+    }
+
     // Bring up services.
     Try {
         // Load services.
         log("loading services...");
 #ifdef LOAD_ALL_DEFINED_SERVICES
-        load_services();
+        load_services(NULL);
 #else
-        load_service_with_deps("default", -1);
+        load_service_with_deps("default", -1, NULL);
 #endif
         log("all services loaded.");
 
         // Now that all services are known, update the log prefix length.
+        update_log_prefix_length();
+
+        // Start the log receiver.
+        if (g_ctx.syslog_socket[0] != '\0' || g_ctx.log_socket[0] != '\0') {
+            if (g_ctx.syslog_socket[0] != '\0') {
+                logrecv_config.syslog_path = g_ctx.syslog_socket;
+                logrecv_config.syslog_min_severity = g_ctx.syslog_min_severity;
+            }
+            if (g_ctx.log_socket[0] != '\0') {
+                logrecv_config.native_path = g_ctx.log_socket;
+            }
+
+            // Sockets are independent: one failing doesn't disable the
+            // other.
+            logrecv_status_t status;
+            if (logrecv_start(&logrecv_config, &status) < 0 &&
+                status.syslog_error == 0 && status.native_error == 0) {
+                log_err("could not start log receiver: %s.", strerror(errno));
+                g_ctx.syslog_socket[0] = '\0';
+                g_ctx.log_socket[0] = '\0';
+            }
+            if (logrecv_config.syslog_path) {
+                if (status.syslog_error != 0) {
+                    log_err("could not create syslog socket '%s': %s.",
+                            g_ctx.syslog_socket, strerror(status.syslog_error));
+                    g_ctx.syslog_socket[0] = '\0';
+                }
+                else if (g_ctx.syslog_socket[0] != '\0') {
+                    log("receiving syslog messages on '%s'.", g_ctx.syslog_socket);
+                }
+            }
+            if (logrecv_config.native_path) {
+                if (status.native_error != 0) {
+                    log_err("could not create log socket '%s': %s.",
+                            g_ctx.log_socket, strerror(status.native_error));
+                    g_ctx.log_socket[0] = '\0';
+                }
+                else if (g_ctx.log_socket[0] != '\0') {
+                    log("receiving log records on '%s'.", g_ctx.log_socket);
+                }
+            }
+        }
+
+        // Create the notification socket.
+        if (g_ctx.notify_socket[0] != '\0') {
+            g_ctx.notify_fd = create_dgram_socket(g_ctx.notify_socket);
+            if (g_ctx.notify_fd < 0 ||
+                fcntl(g_ctx.notify_fd, F_SETFL, O_NONBLOCK) < 0) {
+                log_err("could not create notification socket: %s.", strerror(errno));
+                close_fd(&g_ctx.notify_fd);
+            }
+            else {
+                log_debug("receiving notifications on '%s'.", g_ctx.notify_socket);
+
+                // The socket is passed only to services using it.
+                unsetenv(NOTIFY_SOCKET_ENV_VAR);
+            }
+        }
         FOR_EACH_SERVICE(sid) {
-            if (SRV(sid).disabled || SRV(sid).is_service_group) {
-                continue;
+            if (SRV(sid).watchdog_interval > 0 && g_ctx.notify_fd < 0) {
+                log_err("watchdog of service '%s' requires the notification socket.",
+                        SRV(sid).name);
+            }
+            else if (SRV(sid).scale_metric == SCALE_METRIC_NOTIFY && g_ctx.notify_fd < 0) {
+                log_err("scale metric of service '%s' requires the notification socket.",
+                        SRV(sid).name);
             }
-            if (strlen(SRV(sid).name) > g_ctx.log_prefix_length) {
-                g_ctx.log_prefix_length = strlen(SRV(sid).name);
+        }
+
+        // Create pressure triggers used for load shedding.
+        for (int i = 0; i < PSI_NUM_RESOURCES; i++) {
+            g_ctx.psi_fds[i] = -1;
+            if (g_ctx.load_shedding_threshold > 0) {
+                g_ctx.psi_fds[i] = psi_trigger(i,
+                        LOAD_SHEDDING_PSI_WINDOW / 100 * g_ctx.load_shedding_threshold,
+                        LOAD_SHEDDING_PSI_WINDOW);
+                if (g_ctx.psi_fds[i] < 0) {
+                    log_err("could not create %s pressure trigger: %s.",
+                            psi_resource_name(i), strerror(errno));
+                }
             }
         }
 
+        // Start the prober and the resource sampler, if needed.
+        start_helper_threads();
+
         // Start services.
         log("starting services...");
         start_services();
@@ -2051,6 +6067,12 @@ int main(int argc, char *argv[])
         // termination signal.
         BREAK_IF_SHUTDOWN_REQUESTED();
 
+        // Process notifications first: the sender of a notification sent
+        // just before terminating is not known anymore once reaped.
+        if (g_ctx.notify_fd >= 0) {
+            process_notify_messages();
+        }
+
         // Process killed services.
         bool all_children_terminated = child_handler(0, -1);
  
@@ -2064,7 +6086,15 @@ int main(int argc, char *argv[])
             bool services_to_be_restarted = false;
 
             FOR_EACH_SERVICE(sid) {
-                if ((SRV(sid).respawn || SRV(sid).restart_requested) && SRV(sid).pid == 0) {
+                if (SRV(sid).is_service_group || SRV(sid).retiring) {
+                    continue;
+                }
+                else if ((SRV(sid).respawn || SRV(sid).restart_requested) && SRV(sid).pid == 0) {
+                    services_to_be_restarted = true;
+                    break;
+                }
+                else if (SRV(sid).start_mode == START_MODE_ON_DEMAND) {
+                    // Started on the next connection.
                     services_to_be_restarted = true;
                     break;
                 }
@@ -2079,7 +6109,7 @@ int main(int argc, char *argv[])
 
         // Process services that need to run at regular interval.
         FOR_EACH_SERVICE(sid) {
-            if (SRV(sid).interval > 0) {
+            if (SRV(sid).interval > 0 && !SRV(sid).is_service_group) {
                 if ((get_time() - SRV(sid).start_time) >= SRV(sid).interval * 1000) {
                     // Check if service still running.
                     if (SRV(sid).pid > 0) {
@@ -2091,6 +6121,14 @@ int main(int argc, char *argv[])
                         continue;
                     }
 
+                    // Skip the run of a sheddable service while shedding
+                    // load.
+                    if (g_ctx.load_shedding && SRV(sid).shed_mode != SHED_MODE_NONE) {
+                        log_debug("skipping run of service '%s': load is shed.", SRV(sid).name);
+                        SRV(sid).start_time = get_time();
+                        continue;
+                    }
+
                     // Start the service again.
                     Try {
                         start_service(sid);
@@ -2104,10 +6142,48 @@ int main(int argc, char *argv[])
             }
         }
 
+        // Kill services that didn't stop in time.
+        check_stopping_services();
+
+        // Replace or keep previous instances of services being restarted.
+        check_overlapped_restarts();
+
+        // Confirm readiness of reloaded services.
+        check_reloading_services();
+
+        // Enforce memory limits of services.
+        check_memory_limits();
+
+        // Restart services that are not alive anymore.
+        check_liveness();
+        check_watchdogs();
+
+        // Start or stop on-demand services.
+        check_on_demand_services();
+
+        // Add or remove instances of templates according to their load.
+        check_autoscaling();
+
         // Process services that needs to be restarted.
         FOR_EACH_SERVICE(sid) {
-            if ((SRV(sid).respawn || SRV(sid).restart_requested) && SRV(sid).pid == 0) {
-                if (get_time() - SRV(sid).start_time > SERVICE_RESTART_DELAY) {
+            if (SRV(sid).is_service_group || SRV(sid).retiring) {
+                continue;
+            }
+            else if ((SRV(sid).respawn || SRV(sid).restart_requested) && SRV(sid).pid == 0) {
+                if (g_ctx.load_shedding && SRV(sid).shed_mode != SHED_MODE_NONE) {
+                    // Restarted once load shedding ends.
+                    continue;
+                }
+                else if (SRV(sid).stopping) {
+                    // Restarted once all processes of the previous run are
+                    // gone.
+                    continue;
+                }
+                else if (SRV(sid).start_mode == START_MODE_ON_DEMAND && !SRV(sid).restart_requested) {
+                    // Started again on the next connection.
+                    continue;
+                }
+                else if (get_time() - SRV(sid).start_time > SERVICE_RESTART_DELAY) {
                     log("restarting service '%s'.", SRV(sid).name);
                     Try {
                         start_service(sid);
@@ -2121,38 +6197,49 @@ int main(int argc, char *argv[])
             }
         }
 
-        // Process command received from the named pipe.
+        // Rescan services on a HUP signal.
+        if (do_rescan) {
+            int reply_fd = -1;
+            do_rescan = false;
+            log("SIGHUP received, rescanning services...");
+            rescan_services(&reply_fd);
+        }
+
+        // Process commands received from the named pipe.
         {
-            char buf[256];
+            char buf[4096];
             ssize_t len = read(cmd_fd, buf, sizeof(buf) - 1);
             if (len > 0) {
                 buf[len] = '\0';
-                terminate_at_first_eol(buf);
-                trim(buf);
 
-                // Restart service command.
-                if (strncmp(buf, "restart:", strlen("restart:")) == 0) {
-                    const char *service = buf + strlen("restart:");
-                    int sid = find_service(service);
-                    if (sid >= 0) {
-                        Try {
-                            log("restart request for service '%s' received.", SRV(sid).name);
-                            stop_service(sid);
-                            SRV(sid).restart_requested = true;
-                        }
-                        Catch (e) {
-                            log_err("failed to stop service '%s': %s", SRV(sid).name, e.mMessage);
-                        }
-                    }
-                    else {
-                        log("service not found: '%s'", service);
-                    }
+                // Multiple commands may have been received.
+                char *saveptr = NULL;
+                for (char *cmd = strtok_r(buf, "\r\n", &saveptr);
+                     cmd != NULL;
+                     cmd = strtok_r(NULL, "\r\n", &saveptr)) {
+                    process_command(cmd);
                 }
             }
         }
 
-        // Pause for 1 second.
-        msleep(1000);
+        // Report log messages that have been dropped.
+        {
+            log_queue_stats_t stats;
+            log_queue_get_stats(&stats);
+            if (stats.dropped > log_dropped) {
+                log_err("%llu log message(s) dropped because the log queue is full.",
+                        stats.dropped - log_dropped);
+                log_dropped = stats.dropped;
+            }
+        }
+
+        // Pause for 1 second, unless an event needs attention.
+        wait_for_events(1000);
+    }
+
+    // Resume paused services, so they can be stopped.
+    if (g_ctx.load_shedding) {
+        set_load_shedding(false);
     }
 
     if (exit_status == 0 && g_ctx.exit_code != 0) {
@@ -2167,8 +6254,26 @@ int main(int argc, char *argv[])
 
     // Shutdown all services.
     ASSERT_LOG(SHUTDOWN_REQUESTED(), "Performing shutdown without request.");
+    if (shutdown_signal != 0) {
+        log("%s received, shutting down...", signal_to_str(shutdown_signal));
+    }
     cinit_shutdown();
 
+    // Stop the log receiver.
+    logrecv_stop();
+
+    // Stop the resource sampler.
+    sampler_stop();
+
+    // Stop the prober.
+    probe_stop();
+
+    // Destroy the notification socket.
+    if (g_ctx.notify_fd >= 0) {
+        close_fd(&g_ctx.notify_fd);
+        unlink(g_ctx.notify_socket);
+    }
+
     // Unload services.
     unload_services();
 
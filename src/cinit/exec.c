@@ -363,7 +363,7 @@ int exec_cmd(bool disable_output, const char *output_prefix, const char *cmd, ..
             close(stderr_link[1]);
 
             // Read child's output.
-            retval = log_prefixer(output_prefix, stdout_link[0], stderr_link[0], NULL);
+            retval = log_prefixer(output_prefix, stdout_link[0], stderr_link[0], NULL, NULL);
 
             close(stdout_link[0]);
             close(stderr_link[0]);
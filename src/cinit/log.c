@@ -5,6 +5,8 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <errno.h>
+#include <string.h>
+#include <stdbool.h>
 
 #include "log.h"
 #include "utils.h"
@@ -15,12 +17,229 @@
 typedef struct {
     int fds[2];
     const char *prefix;
+    log_ring_t *ring;
     atomic_bool *time_to_exit;
 } log_prefixer_ctx_t;
 
+typedef struct log_msg {
+    struct log_msg *next;
+    int fd;
+    size_t len;
+    char data[];
+} log_msg_t;
+
+typedef struct {
+    bool started;
+    bool stopping;
+    bool writer_done;
+    pthread_t writer;
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    log_msg_t *head;
+    log_msg_t *tail;
+    log_queue_stats_t stats;
+} log_queue_t;
+
 static pthread_mutex_t g_stdout_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t g_stderr_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+static log_queue_t g_queue = {
+    .started = false,
+    .stopping = false,
+    .writer_done = false,
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .not_empty = PTHREAD_COND_INITIALIZER,
+    .not_full = PTHREAD_COND_INITIALIZER,
+    .head = NULL,
+    .tail = NULL,
+};
+
+/**
+ * Write the whole buffer to a file descriptor.
+ *
+ * @param[in] fd File descriptor to write to.
+ * @param[in] buf Data to write.
+ * @param[in] len Length of the data.
+ */
+static void write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // Nothing we can do.
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+/**
+ * Remove the oldest message from the queue.
+ *
+ * NOTE: Queue's mutex must be locked.
+ *
+ * @return The removed message or NULL if queue is empty.
+ */
+static log_msg_t *log_queue_pop()
+{
+    log_msg_t *msg = g_queue.head;
+    if (msg) {
+        g_queue.head = msg->next;
+        if (!g_queue.head) {
+            g_queue.tail = NULL;
+        }
+        g_queue.stats.used -= msg->len;
+    }
+    return msg;
+}
+
+/**
+ * Writer of the log queue.
+ *
+ * This function is intended to be run into a thread.  Messages are written one
+ * at a time, outside the queue's mutex, so callers are not blocked by a slow
+ * output.
+ *
+ * @param[in] p Unused.
+ *
+ * @return NULL.
+ */
+static void *log_queue_writer(void *p)
+{
+    pthread_mutex_lock(&g_queue.mutex);
+    while (true) {
+        log_msg_t *msg = log_queue_pop();
+        if (!msg) {
+            if (g_queue.stopping) {
+                g_queue.writer_done = true;
+                break;
+            }
+            pthread_cond_wait(&g_queue.not_empty, &g_queue.mutex);
+            continue;
+        }
+        pthread_cond_broadcast(&g_queue.not_full);
+        pthread_mutex_unlock(&g_queue.mutex);
+
+        write_all(msg->fd, msg->data, msg->len);
+        free(msg);
+
+        pthread_mutex_lock(&g_queue.mutex);
+        g_queue.stats.written++;
+    }
+    pthread_mutex_unlock(&g_queue.mutex);
+
+    return NULL;
+}
+
+/**
+ * Log a message to the specified file descriptor.
+ *
+ * The message is added to the log queue when it is started.  Else, it is
+ * written directly.
+ *
+ * @param[in] fd File descriptor to log to.
+ * @param[in] mutex Mutex protecting direct writes to the file descriptor.
+ * @param[in] format Format of the message to be logged.
+ * @param[in] args Argument(s) for the message.
+ */
+static void log_to_fd(int fd, pthread_mutex_t *mutex, const char *format, va_list args)
+{
+    log_msg_t *msg = NULL;
+    va_list direct_args;
+
+    // Keep a copy of arguments, in case the message needs to be written
+    // directly.
+    va_copy(direct_args, args);
+
+    pthread_mutex_lock(&g_queue.mutex);
+    bool queue_started = g_queue.started;
+    pthread_mutex_unlock(&g_queue.mutex);
+
+    // Format the message.
+    if (queue_started) {
+        va_list args_copy;
+        va_copy(args_copy, args);
+        int len = vsnprintf(NULL, 0, format, args_copy);
+        va_end(args_copy);
+
+        if (len >= 0) {
+            msg = malloc(sizeof(log_msg_t) + len + 1);
+        }
+        if (msg) {
+            msg->next = NULL;
+            msg->fd = fd;
+            msg->len = len;
+            vsnprintf(msg->data, len + 1, format, args);
+        }
+    }
+
+    if (msg) {
+        pthread_mutex_lock(&g_queue.mutex);
+
+        // Make sure the writer is still there to handle the message.
+        if (!g_queue.started || g_queue.writer_done) {
+            pthread_mutex_unlock(&g_queue.mutex);
+            free(msg);
+            msg = NULL;
+        }
+    }
+
+    // Write directly when the queue is not used.
+    if (!msg) {
+        pthread_mutex_lock(mutex);
+        vdprintf(fd, format, direct_args);
+        pthread_mutex_unlock(mutex);
+        va_end(direct_args);
+        return;
+    }
+    va_end(direct_args);
+
+    // Handle the case where the queue is full.  A message bigger than the
+    // capacity is accepted once the queue is empty.
+    bool waited = false;
+    while (g_queue.head && g_queue.stats.used + msg->len > g_queue.stats.capacity) {
+        if (g_queue.stats.policy == LOG_OVERFLOW_POLICY_DROP_NEWEST) {
+            g_queue.stats.dropped++;
+            pthread_mutex_unlock(&g_queue.mutex);
+            free(msg);
+            return;
+        }
+        else if (g_queue.stats.policy == LOG_OVERFLOW_POLICY_DROP_OLDEST) {
+            free(log_queue_pop());
+            g_queue.stats.dropped++;
+        }
+        else {
+            if (!waited) {
+                g_queue.stats.blocked++;
+                waited = true;
+            }
+            pthread_cond_wait(&g_queue.not_full, &g_queue.mutex);
+        }
+    }
+
+    // Add the message to the queue.
+    if (g_queue.tail) {
+        g_queue.tail->next = msg;
+    }
+    else {
+        g_queue.head = msg;
+    }
+    g_queue.tail = msg;
+    g_queue.stats.used += msg->len;
+    g_queue.stats.enqueued++;
+    if (g_queue.stats.used > g_queue.stats.high_water) {
+        g_queue.stats.high_water = g_queue.stats.used;
+    }
+
+    pthread_cond_signal(&g_queue.not_empty);
+    pthread_mutex_unlock(&g_queue.mutex);
+}
+
 static void log_prefixer_callback(int fd, const char *line, void *data)
 {
     log_prefixer_ctx_t *ctx = (log_prefixer_ctx_t *)data;
@@ -32,6 +251,10 @@ static void log_prefixer_callback(int fd, const char *line, void *data)
         line += 3;
     }
 
+    if (ctx->ring) {
+        log_ring_push(ctx->ring, line);
+    }
+
     if (fd == ctx->fds[STDOUT_IDX]) {
         log_stdout("%s%s\n", prefix, line);
     }
@@ -51,33 +274,221 @@ static bool log_prefixer_exit_callback(void *data)
 
 void log_stdout(const char *format, ...)
 {
-    pthread_mutex_lock(&g_stdout_mutex);
-
     va_list args;
     va_start(args, format);
-    vdprintf(STDOUT_FILENO, format, args);
+    log_to_fd(STDOUT_FILENO, &g_stdout_mutex, format, args);
     va_end(args);
-
-    pthread_mutex_unlock(&g_stdout_mutex);
 }
 
 void log_stderr(const char *format, ...)
 {
-    pthread_mutex_lock(&g_stderr_mutex);
-
     va_list args;
     va_start(args, format);
-    vdprintf(STDERR_FILENO, format, args);
+    log_to_fd(STDERR_FILENO, &g_stderr_mutex, format, args);
     va_end(args);
+}
+
+int log_queue_start(size_t capacity, log_overflow_policy_t policy)
+{
+    int retval = 0;
+
+    pthread_mutex_lock(&g_queue.mutex);
+    if (!g_queue.started) {
+        memset(&g_queue.stats, 0, sizeof(g_queue.stats));
+        g_queue.stats.capacity = capacity;
+        g_queue.stats.policy = policy;
+        g_queue.stopping = false;
+        g_queue.writer_done = false;
+
+        if (pthread_create(&g_queue.writer, NULL, log_queue_writer, NULL) == 0) {
+            g_queue.started = true;
+        }
+        else {
+            retval = -1;
+        }
+    }
+    pthread_mutex_unlock(&g_queue.mutex);
+
+    return retval;
+}
+
+void log_queue_stop()
+{
+    pthread_mutex_lock(&g_queue.mutex);
+    if (!g_queue.started || g_queue.stopping) {
+        pthread_mutex_unlock(&g_queue.mutex);
+        return;
+    }
+    g_queue.stopping = true;
+    pthread_cond_signal(&g_queue.not_empty);
+    pthread_mutex_unlock(&g_queue.mutex);
+
+    // The writer terminates once all messages are written.
+    pthread_join(g_queue.writer, NULL);
+
+    pthread_mutex_lock(&g_queue.mutex);
+    g_queue.started = false;
+    g_queue.stopping = false;
+    pthread_mutex_unlock(&g_queue.mutex);
+}
+
+void log_queue_get_stats(log_queue_stats_t *stats)
+{
+    pthread_mutex_lock(&g_queue.mutex);
+    *stats = g_queue.stats;
+    pthread_mutex_unlock(&g_queue.mutex);
+}
+
+const char *log_overflow_policy_to_str(log_overflow_policy_t policy)
+{
+    switch (policy) {
+        case LOG_OVERFLOW_POLICY_BLOCK:       return "block";
+        case LOG_OVERFLOW_POLICY_DROP_OLDEST: return "drop-oldest";
+        case LOG_OVERFLOW_POLICY_DROP_NEWEST: return "drop-newest";
+        default:                              return "unknown";
+    }
+}
+
+log_ring_t *log_ring_create(size_t size)
+{
+    log_ring_t *ring = calloc(1, sizeof(log_ring_t));
+    if (!ring) {
+        return NULL;
+    }
+
+    ring->slots = calloc(size, sizeof(log_ring_slot_t));
+    if (!ring->slots) {
+        free(ring);
+        return NULL;
+    }
+
+    ring->size = size;
+    atomic_init(&ring->head, 0);
+    for (size_t i = 0; i < size; i++) {
+        atomic_init(&ring->slots[i].seq, 0);
+    }
+    pthread_mutex_init(&ring->mutex, NULL);
+    for (int i = 0; i < LOG_RING_MAX_FOLLOWERS; i++) {
+        ring->followers[i] = -1;
+    }
+
+    return ring;
+}
+
+void log_ring_destroy(log_ring_t *ring)
+{
+    if (!ring) {
+        return;
+    }
+
+    for (int i = 0; i < LOG_RING_MAX_FOLLOWERS; i++) {
+        if (ring->followers[i] >= 0) {
+            close(ring->followers[i]);
+        }
+    }
+    pthread_mutex_destroy(&ring->mutex);
+    free(ring->slots);
+    free(ring);
+}
+
+void log_ring_push(log_ring_t *ring, const char *line)
+{
+    // Writers are serialized: during an overlapped restart, two runs of a
+    // service share the ring.
+    pthread_mutex_lock(&ring->mutex);
+
+    unsigned long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    log_ring_slot_t *slot = &ring->slots[head % ring->size];
+
+    // Mark the slot as being written.
+    atomic_fetch_add_explicit(&slot->seq, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    snprintf(slot->line, sizeof(slot->line), "%s", line);
+
+    // Publish the line.
+    atomic_fetch_add_explicit(&slot->seq, 1, memory_order_release);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+    // Send the line to followers.
+    for (int i = 0; i < LOG_RING_MAX_FOLLOWERS; i++) {
+        if (ring->followers[i] >= 0) {
+            if (dprintf(ring->followers[i], "%s\n", line) < 0 && errno != EAGAIN) {
+                // Follower is gone.
+                close(ring->followers[i]);
+                ring->followers[i] = -1;
+            }
+        }
+    }
+    pthread_mutex_unlock(&ring->mutex);
+}
+
+size_t log_ring_read(log_ring_t *ring, size_t num_lines, log_ring_line_callback_t callback, void *callback_data)
+{
+    char line[LOG_RING_LINE_SIZE];
+    size_t count = 0;
+
+    unsigned long head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    unsigned long first = 0;
+
+    if (num_lines > ring->size) {
+        num_lines = ring->size;
+    }
+    if (head > num_lines) {
+        first = head - num_lines;
+    }
+
+    for (unsigned long i = first; i < head; i++) {
+        log_ring_slot_t *slot = &ring->slots[i % ring->size];
+
+        unsigned int seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (seq & 1) {
+            // Slot is being overwritten.
+            continue;
+        }
+
+        memcpy(line, slot->line, sizeof(line));
+        line[sizeof(line) - 1] = '\0';
+
+        // Make sure the slot has not been overwritten while being copied.
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq) {
+            continue;
+        }
+        else if (atomic_load_explicit(&ring->head, memory_order_relaxed) - i > ring->size) {
+            continue;
+        }
+
+        callback(line, callback_data);
+        count++;
+    }
+
+    return count;
+}
+
+int log_ring_add_follower(log_ring_t *ring, int fd)
+{
+    int retval = -1;
+
+    pthread_mutex_lock(&ring->mutex);
+    for (int i = 0; i < LOG_RING_MAX_FOLLOWERS; i++) {
+        if (ring->followers[i] < 0) {
+            ring->followers[i] = fd;
+            retval = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&ring->mutex);
 
-    pthread_mutex_unlock(&g_stderr_mutex);
+    return retval;
 }
 
-int log_prefixer(const char *prefix, int stdout_fd, int stderr_fd, atomic_bool *time_to_exit)
+int log_prefixer(const char *prefix, int stdout_fd, int stderr_fd, log_ring_t *ring, atomic_bool *time_to_exit)
 {
     log_prefixer_ctx_t ctx = {
         { stdout_fd, stderr_fd },
         prefix,
+        ring,
         time_to_exit,
     };
 
@@ -2,6 +2,67 @@
 #define __CINIT_LOG_H__
 
 #include <stdatomic.h>
+#include <stddef.h>
+#include <pthread.h>
+
+/**
+ * Maximum length of a line kept in a log ring buffer.  Longer lines are
+ * truncated.
+ */
+#define LOG_RING_LINE_SIZE 512
+
+/**
+ * Maximum number of readers following a log ring buffer.
+ */
+#define LOG_RING_MAX_FOLLOWERS 4
+
+/**
+ * Policy applied when a message is logged while the log queue is full.
+ */
+typedef enum {
+    LOG_OVERFLOW_POLICY_BLOCK = 0, /**< Wait until there is room in the queue. */
+    LOG_OVERFLOW_POLICY_DROP_OLDEST, /**< Drop the oldest queued messages. */
+    LOG_OVERFLOW_POLICY_DROP_NEWEST, /**< Drop the message being logged. */
+} log_overflow_policy_t;
+
+/**
+ * Statistics of the log queue.
+ */
+typedef struct {
+    size_t capacity;                /**< Maximum number of bytes queued. */
+    log_overflow_policy_t policy;   /**< Overflow policy. */
+    size_t used;                    /**< Number of bytes currently queued. */
+    size_t high_water;              /**< Highest number of bytes queued. */
+    unsigned long long enqueued;    /**< Number of messages queued. */
+    unsigned long long written;     /**< Number of messages written. */
+    unsigned long long dropped;     /**< Number of messages dropped. */
+    unsigned long long blocked;     /**< Number of times a caller had to wait. */
+} log_queue_stats_t;
+
+/**
+ * Slot of a log ring buffer.
+ */
+typedef struct {
+    atomic_uint seq;                /**< Sequence number, odd while being written. */
+    char line[LOG_RING_LINE_SIZE];  /**< The line. */
+} log_ring_slot_t;
+
+/**
+ * Ring buffer keeping the most recent lines of a service.
+ *
+ * Writers (logger threads of the service) are serialized by a mutex.  Readers
+ * don't take any lock: each slot is protected by a sequence number and a line
+ * overwritten while being read is skipped.
+ */
+typedef struct {
+    size_t size;                    /**< Number of slots. */
+    atomic_ulong head;              /**< Total number of lines written. */
+    log_ring_slot_t *slots;         /**< Table of slots. */
+    pthread_mutex_t mutex;          /**< Serializes writers, protects the table of followers. */
+    int followers[LOG_RING_MAX_FOLLOWERS]; /**< File descriptors of followers. */
+} log_ring_t;
+
+typedef void (*log_ring_line_callback_t)(const char *line, void *data);
 
 /**
  * Log to stdout.
@@ -23,16 +84,112 @@ void log_stdout(const char *format, ...);
  */
 void log_stderr(const char *format, ...);
 
+/**
+ * Start the log queue.
+ *
+ * Once started, messages passed to log_stdout() and log_stderr() are queued in
+ * memory and written by a dedicated thread, so a slow standard output doesn't
+ * block callers.  Before the queue is started, messages are written directly.
+ *
+ * @param[in] capacity Maximum number of bytes that can be queued.
+ * @param[in] policy Policy to apply when the queue is full.
+ *
+ * @return -1 if an error occurred, 0 otherwise.
+ */
+int log_queue_start(size_t capacity, log_overflow_policy_t policy);
+
+/**
+ * Stop the log queue.
+ *
+ * All queued messages are written before the function returns.  Messages
+ * logged afterward are written directly.
+ */
+void log_queue_stop();
+
+/**
+ * Get statistics of the log queue.
+ *
+ * @param[out] stats Where to store the statistics.
+ */
+void log_queue_get_stats(log_queue_stats_t *stats);
+
+/**
+ * Get the string representation of a log overflow policy.
+ *
+ * @param[in] policy The overflow policy.
+ *
+ * @return String representation of the policy.
+ */
+const char *log_overflow_policy_to_str(log_overflow_policy_t policy);
+
+/**
+ * Create a log ring buffer.
+ *
+ * @param[in] size Number of lines kept by the ring buffer.
+ *
+ * @return The ring buffer or NULL on error.
+ */
+log_ring_t *log_ring_create(size_t size);
+
+/**
+ * Destroy a log ring buffer.
+ *
+ * File descriptors of followers are closed.
+ *
+ * @param[in] ring The ring buffer.
+ */
+void log_ring_destroy(log_ring_t *ring);
+
+/**
+ * Add a line to a log ring buffer.
+ *
+ * The line is also sent to followers of the ring buffer.  Lines can be added
+ * from several threads, e.g. by loggers of two runs of a service.
+ *
+ * @param[in] ring The ring buffer.
+ * @param[in] line The line to add.
+ */
+void log_ring_push(log_ring_t *ring, const char *line);
+
+/**
+ * Read the most recent lines of a log ring buffer.
+ *
+ * @param[in] ring The ring buffer.
+ * @param[in] num_lines Maximum number of lines to read.
+ * @param[in] callback Function invoked for each line, from the oldest to the
+ *                     most recent.
+ * @param[in] callback_data Custom data to be passed to the callback.
+ *
+ * @return Number of lines read.
+ */
+size_t log_ring_read(log_ring_t *ring, size_t num_lines, log_ring_line_callback_t callback, void *callback_data);
+
+/**
+ * Add a follower to a log ring buffer.
+ *
+ * Each new line added to the ring buffer is written to the follower's file
+ * descriptor, which should be in non-blocking mode.  Lines are discarded for a
+ * follower that is not ready to receive them.  The follower is removed, and
+ * its file descriptor closed, once it cannot be written anymore.
+ *
+ * @param[in] ring The ring buffer.
+ * @param[in] fd File descriptor of the follower.
+ *
+ * @return -1 if the maximum number of followers is reached, 0 otherwise.
+ */
+int log_ring_add_follower(log_ring_t *ring, int fd);
+
 /**
  * Read from file descriptors and append prefix before logging to stdout/stderr.
  *
  * @param[in] prefix Prefix to be added.
  * @param[in] stdout_fd File descriptor associated to stdout.
  * @param[in] stderr_fd File descriptor associated to stderr.
+ * @param[in] ring Optional ring buffer where to keep lines.
  * @param[in] time_to_exit Pointer to boolean indicating if it's time to stop.
  *
  * @return -1 if an error occurred, 0 otherwise.
  */
-int log_prefixer(const char *prefix, int stdout_fd, int stderr_fd, atomic_bool *time_to_exit);
+int log_prefixer(const char *prefix, int stdout_fd, int stderr_fd, log_ring_t *ring, atomic_bool *time_to_exit);
 
 #endif // __CINIT_LOG_H__
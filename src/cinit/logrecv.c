@@ -0,0 +1,721 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <ctype.h>
+#include <poll.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <sys/socket.h>
+
+#include "logrecv.h"
+#include "utils.h"
+
+/** Maximum size of a received syslog message. */
+#define LOGRECV_MAX_MSG_SIZE 8192
+
+/** Maximum size of a received native record. */
+#define LOGRECV_MAX_NATIVE_MSG_SIZE 65536
+
+/** Tag used for native records that can't be attributed. */
+#define LOGRECV_DEFAULT_NATIVE_TAG "log"
+
+/** Maximum length of the tag of a RFC3164 message. */
+#define LOGRECV_MAX_TAG_LENGTH 48
+
+typedef struct {
+    const logrecv_config_t *config;
+    bool started;
+    pthread_t thread;
+    int wakeup_pipe[2];
+    int syslog_fd;
+    int native_fd;
+} logrecv_ctx_t;
+
+static logrecv_ctx_t g_logrecv = {
+    .config = NULL,
+    .started = false,
+    .wakeup_pipe = { -1, -1 },
+    .syslog_fd = -1,
+    .native_fd = -1,
+};
+
+static const char * const severity_names[] = {
+    "emerg",
+    "alert",
+    "crit",
+    "err",
+    "warning",
+    "notice",
+    "info",
+    "debug",
+};
+
+/**
+ * Close a file descriptor if needed.
+ *
+ * @param fd Pointer to the file descriptor.
+ */
+static void close_fd(int *fd)
+{
+    if (fd && *fd >= 0) {
+        close(*fd);
+        *fd = -1;
+    }
+}
+
+/**
+ * Handle a message received from the syslog socket.
+ *
+ * @param[in] buf The message.
+ * @param[in] sender PID of the sender, 0 if unknown.
+ */
+static void handle_syslog_message(char *buf, pid_t sender)
+{
+    int severity;
+    char *tag;
+    pid_t pid;
+
+    char *msg = logrecv_parse_syslog(buf, &severity, &tag, &pid);
+
+    if (severity > g_logrecv.config->syslog_min_severity) {
+        return;
+    }
+    else if (msg[0] == '\0') {
+        return;
+    }
+
+    g_logrecv.config->callback(tag ? tag : "syslog",
+            sender ? sender : pid,
+            severity,
+            msg,
+            g_logrecv.config->callback_data);
+}
+
+/**
+ * Handle a record received from the native log socket.
+ *
+ * @param[in] buf The record.
+ * @param[in] len Length of the record.
+ * @param[in] sender PID of the sender, 0 if unknown.
+ */
+static void handle_native_message(char *buf, size_t len, pid_t sender)
+{
+    logrecv_record_t record;
+    char name[256];
+    const char *tag = NULL;
+
+    if (logrecv_parse_native(buf, len, &record) < 0) {
+        return;
+    }
+    else if (!record.message || record.message[0] == '\0') {
+        return;
+    }
+
+    // Attribute the record to a service.
+    if (sender && g_logrecv.config->resolver &&
+        g_logrecv.config->resolver(sender, name, sizeof(name), g_logrecv.config->callback_data) == 0) {
+        tag = name;
+    }
+    if (!tag) {
+        tag = record.identifier ? record.identifier : LOGRECV_DEFAULT_NATIVE_TAG;
+    }
+
+    g_logrecv.config->callback(tag,
+            sender,
+            record.severity,
+            record.message,
+            g_logrecv.config->callback_data);
+}
+
+/**
+ * Log receiver.
+ *
+ * This function is intended to be run into a thread.
+ *
+ * @param[in] p Unused.
+ *
+ * @return NULL.
+ */
+static void *logrecv_thread(void *p)
+{
+    char buf[LOGRECV_MAX_NATIVE_MSG_SIZE + 1];
+
+    while (true) {
+        // Negative file descriptors (disabled sockets) are ignored by poll().
+        struct pollfd pfds[] = {
+            { .fd = g_logrecv.wakeup_pipe[0], .events = POLLIN },
+            { .fd = g_logrecv.syslog_fd, .events = POLLIN },
+            { .fd = g_logrecv.native_fd, .events = POLLIN },
+        };
+
+        int rc = poll(pfds, DIM(pfds), -1);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        // Check if it's time to exit.
+        if (pfds[0].revents) {
+            break;
+        }
+
+        if (pfds[1].revents & POLLIN) {
+            pid_t sender;
+            if (receive_dgram(g_logrecv.syslog_fd, buf, LOGRECV_MAX_MSG_SIZE + 1, &sender, NULL, NULL) > 0) {
+                handle_syslog_message(buf, sender);
+            }
+        }
+
+        if (pfds[2].revents & POLLIN) {
+            pid_t sender;
+            ssize_t len = receive_dgram(g_logrecv.native_fd, buf, sizeof(buf), &sender, NULL, NULL);
+            if (len > 0) {
+                handle_native_message(buf, len, sender);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+int logrecv_start(const logrecv_config_t *config, logrecv_status_t *status)
+{
+    status->syslog_error = 0;
+    status->native_error = 0;
+
+    if (g_logrecv.started) {
+        return 0;
+    }
+
+    g_logrecv.config = config;
+
+    if (pipe2(g_logrecv.wakeup_pipe, O_CLOEXEC) < 0) {
+        return -1;
+    }
+
+    if (config->syslog_path) {
+        g_logrecv.syslog_fd = create_dgram_socket(config->syslog_path);
+        if (g_logrecv.syslog_fd < 0) {
+            status->syslog_error = errno;
+        }
+    }
+
+    if (config->native_path) {
+        g_logrecv.native_fd = create_dgram_socket(config->native_path);
+        if (g_logrecv.native_fd < 0) {
+            status->native_error = errno;
+        }
+    }
+
+    if (g_logrecv.syslog_fd < 0 && g_logrecv.native_fd < 0) {
+        int errsv = status->syslog_error ? status->syslog_error : status->native_error;
+        logrecv_stop();
+        errno = errsv;
+        return -1;
+    }
+
+    if (pthread_create(&g_logrecv.thread, NULL, logrecv_thread, NULL) != 0) {
+        logrecv_stop();
+        return -1;
+    }
+
+    g_logrecv.started = true;
+    return 0;
+}
+
+void logrecv_stop()
+{
+    if (g_logrecv.started) {
+        // Wake up the thread and wait for its termination.
+        if (write(g_logrecv.wakeup_pipe[1], "x", 1) == 1) {
+            pthread_join(g_logrecv.thread, NULL);
+        }
+        g_logrecv.started = false;
+    }
+
+    if (g_logrecv.syslog_fd >= 0) {
+        close_fd(&g_logrecv.syslog_fd);
+        unlink(g_logrecv.config->syslog_path);
+    }
+    if (g_logrecv.native_fd >= 0) {
+        close_fd(&g_logrecv.native_fd);
+        unlink(g_logrecv.config->native_path);
+    }
+    close_fd(&g_logrecv.wakeup_pipe[0]);
+    close_fd(&g_logrecv.wakeup_pipe[1]);
+}
+
+int logrecv_string_to_severity(const char *str)
+{
+    for (int i = 0; i < DIM(severity_names); i++) {
+        if (strcasecmp(str, severity_names[i]) == 0) {
+            return i;
+        }
+    }
+
+    if (strcasecmp(str, "panic") == 0) {
+        return LOG_EMERG;
+    }
+    else if (strcasecmp(str, "error") == 0) {
+        return LOG_ERR;
+    }
+    else if (strcasecmp(str, "warn") == 0) {
+        return LOG_WARNING;
+    }
+    else if (str[0] >= '0' && str[0] <= '7' && str[1] == '\0') {
+        return str[0] - '0';
+    }
+
+    return -1;
+}
+
+char *logrecv_parse_syslog(char *buf, int *severity, char **tag, pid_t *pid)
+{
+    char *p = buf;
+
+    // Default values, as defined by RFC3164.
+    *severity = LOG_NOTICE;
+    *tag = NULL;
+    *pid = 0;
+
+    // Get the priority.
+    if (*p == '<') {
+        char *end;
+        long pri = strtol(p + 1, &end, 10);
+        if (end != p + 1 && *end == '>' && pri >= 0 && pri <= 191) {
+            *severity = LOG_PRI(pri);
+            p = end + 1;
+        }
+    }
+
+    if (p[0] == '1' && p[1] == ' ') {
+        // RFC5424 format:
+        // VERSION TIMESTAMP HOSTNAME APP-NAME PROCID MSGID STRUCTURED-DATA MSG
+        char *fields[5] = { "-", "-", "-", "-", "-" };
+
+        p += 2;
+        for (int i = 0; i < DIM(fields) && *p != '\0'; i++) {
+            fields[i] = p;
+            p += strcspn(p, " ");
+            if (*p == ' ') {
+                *p++ = '\0';
+            }
+        }
+
+        if (strcmp(fields[2], "-") != 0) {
+            *tag = fields[2];
+        }
+        if (isdigit(fields[3][0])) {
+            *pid = atoi(fields[3]);
+        }
+
+        // Skip structured data.
+        if (*p == '-') {
+            p++;
+        }
+        else {
+            while (*p == '[') {
+                for (p++; *p != '\0' && *p != ']'; p++) {
+                    if (*p == '\\' && p[1] != '\0') {
+                        p++;
+                    }
+                }
+                if (*p == ']') {
+                    p++;
+                }
+            }
+        }
+        if (*p == ' ') {
+            p++;
+        }
+
+        // Skip the UTF-8 BOM.
+        if ((unsigned char)p[0] == 0xEF && (unsigned char)p[1] == 0xBB && (unsigned char)p[2] == 0xBF) {
+            p += 3;
+        }
+    }
+    else {
+        // RFC3164 format, as sent by syslog(3):
+        // TIMESTAMP TAG[PID]: MSG
+        if (strlen(p) >= 16 && p[3] == ' ' && p[6] == ' ' && p[9] == ':' && p[12] == ':' && p[15] == ' ') {
+            p += 16;
+        }
+
+        size_t len = strcspn(p, "[: ");
+        if (len > 0 && len <= LOGRECV_MAX_TAG_LENGTH && (p[len] == '[' || p[len] == ':')) {
+            char *end = p + len;
+
+            *tag = p;
+            if (*end == '[') {
+                *end++ = '\0';
+                *pid = atoi(end);
+                end += strcspn(end, "]");
+                if (*end == ']') {
+                    end++;
+                }
+            }
+            else {
+                *end = '\0';
+                end++;
+            }
+
+            if (*end == ':') {
+                end++;
+            }
+            if (*end == ' ') {
+                end++;
+            }
+            p = end;
+        }
+    }
+
+    // Remove trailing line-endings.
+    size_t len = strlen(p);
+    while (len > 0 && (p[len - 1] == '\n' || p[len - 1] == '\r')) {
+        p[--len] = '\0';
+    }
+
+    return p;
+}
+
+/**
+ * Set a field of a native record.
+ *
+ * @param[in] key Name of the field.
+ * @param[in] value Value of the field.
+ * @param[out] record The record to update.
+ */
+static void set_native_field(const char *key, char *value, logrecv_record_t *record)
+{
+    if (strcmp(key, "MESSAGE") == 0 ||
+        strcmp(key, "message") == 0 ||
+        strcmp(key, "msg") == 0) {
+        record->message = value;
+    }
+    else if (strcmp(key, "SYSLOG_IDENTIFIER") == 0 ||
+             strcmp(key, "identifier") == 0) {
+        record->identifier = value;
+    }
+    else if (strcmp(key, "PRIORITY") == 0 ||
+             strcmp(key, "priority") == 0 ||
+             strcmp(key, "level") == 0) {
+        int severity = logrecv_string_to_severity(value);
+        if (severity >= 0) {
+            record->severity = severity;
+        }
+    }
+}
+
+/**
+ * Encode a Unicode code point in UTF-8.
+ *
+ * @param[in] cp The code point.
+ * @param[out] out Where to write the encoded character.
+ *
+ * @return Number of bytes written.
+ */
+static size_t utf8_encode(uint32_t cp, char *out)
+{
+    if (cp < 0x80) {
+        out[0] = cp;
+        return 1;
+    }
+    else if (cp < 0x800) {
+        out[0] = 0xC0 | (cp >> 6);
+        out[1] = 0x80 | (cp & 0x3F);
+        return 2;
+    }
+    else if (cp < 0x10000) {
+        out[0] = 0xE0 | (cp >> 12);
+        out[1] = 0x80 | ((cp >> 6) & 0x3F);
+        out[2] = 0x80 | (cp & 0x3F);
+        return 3;
+    }
+    else {
+        out[0] = 0xF0 | (cp >> 18);
+        out[1] = 0x80 | ((cp >> 12) & 0x3F);
+        out[2] = 0x80 | ((cp >> 6) & 0x3F);
+        out[3] = 0x80 | (cp & 0x3F);
+        return 4;
+    }
+}
+
+/**
+ * Parse 4 hexadecimal digits.
+ *
+ * @param[in] s The digits.
+ *
+ * @return The value or -1 if invalid.
+ */
+static long parse_hex4(const char *s)
+{
+    long value = 0;
+
+    for (int i = 0; i < 4; i++) {
+        if (!isxdigit((unsigned char)s[i])) {
+            return -1;
+        }
+        value = (value << 4) | (isdigit((unsigned char)s[i]) ? s[i] - '0' : (tolower((unsigned char)s[i]) - 'a' + 10));
+    }
+
+    return value;
+}
+
+/**
+ * Parse a JSON string, unescaping it in place.
+ *
+ * @param[in,out] p Pointer to the opening quote.  Updated to point after the
+ *                  closing quote.
+ *
+ * @return The unescaped string or NULL if invalid.
+ */
+static char *parse_json_string(char **p)
+{
+    char *r = *p + 1;
+    char *w = r;
+    char *str = r;
+
+    while (*r != '"') {
+        if (*r == '\0') {
+            return NULL;
+        }
+        else if (*r != '\\') {
+            *w++ = *r++;
+            continue;
+        }
+
+        r++;
+        switch (*r) {
+            case '"': *w++ = '"'; break;
+            case '\\': *w++ = '\\'; break;
+            case '/': *w++ = '/'; break;
+            case 'b': *w++ = '\b'; break;
+            case 'f': *w++ = '\f'; break;
+            case 'n': *w++ = '\n'; break;
+            case 'r': *w++ = '\r'; break;
+            case 't': *w++ = '\t'; break;
+            case 'u':
+            {
+                long cp = parse_hex4(r + 1);
+                if (cp < 0) {
+                    return NULL;
+                }
+                r += 4;
+
+                // Combine surrogate pairs.
+                if (cp >= 0xD800 && cp <= 0xDBFF && r[1] == '\\' && r[2] == 'u') {
+                    long low = parse_hex4(r + 3);
+                    if (low >= 0xDC00 && low <= 0xDFFF) {
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                        r += 6;
+                    }
+                }
+                w += utf8_encode(cp, w);
+                break;
+            }
+            default:
+                return NULL;
+        }
+        r++;
+    }
+
+    *w = '\0';
+    *p = r + 1;
+    return str;
+}
+
+/**
+ * Skip a JSON value that is not a string.
+ *
+ * Nested objects and arrays are skipped entirely.  Scalar values are null
+ * terminated in place.
+ *
+ * @param[in,out] p Pointer to the value.  Updated to point after the value.
+ *
+ * @return The scalar value, an empty string for objects and arrays or NULL
+ *         if invalid.
+ */
+static char *skip_json_value(char **p)
+{
+    char *r = *p;
+
+    if (*r == '{' || *r == '[') {
+        int depth = 0;
+        do {
+            if (*r == '\0') {
+                return NULL;
+            }
+            else if (*r == '"') {
+                if (!parse_json_string(&r)) {
+                    return NULL;
+                }
+                continue;
+            }
+            else if (*r == '{' || *r == '[') {
+                depth++;
+            }
+            else if (*r == '}' || *r == ']') {
+                depth--;
+            }
+            r++;
+        } while (depth > 0);
+
+        *p = r;
+        return "";
+    }
+    else {
+        size_t len = strcspn(r, ",} \t\r\n");
+        if (len == 0) {
+            return NULL;
+        }
+        *p = r + len;
+
+        // Terminate the value, unless the delimiter is needed.
+        if (**p != ',' && **p != '}') {
+            **p = '\0';
+            (*p)++;
+        }
+        else {
+            // Move the value one character back to make room for the null
+            // character.
+            memmove(r - 1, r, len);
+            r[len - 1] = '\0';
+            r--;
+        }
+        return r;
+    }
+}
+
+/**
+ * Parse a native record in the JSON format.
+ *
+ * @param[in] buf The record.
+ * @param[out] record The parsed record.
+ *
+ * @return -1 if the record is malformed, 0 otherwise.
+ */
+static int parse_native_json(char *buf, logrecv_record_t *record)
+{
+    char *p = buf + strspn(buf, " \t\r\n");
+
+    if (*p++ != '{') {
+        return -1;
+    }
+
+    while (true) {
+        p += strspn(p, " \t\r\n");
+        if (*p == '}') {
+            return 0;
+        }
+        else if (*p != '"') {
+            return -1;
+        }
+
+        // Key.
+        char *key = parse_json_string(&p);
+        if (!key) {
+            return -1;
+        }
+        p += strspn(p, " \t\r\n");
+        if (*p++ != ':') {
+            return -1;
+        }
+        p += strspn(p, " \t\r\n");
+
+        // Value.
+        char *value = (*p == '"') ? parse_json_string(&p) : skip_json_value(&p);
+        if (!value) {
+            return -1;
+        }
+        set_native_field(key, value, record);
+
+        p += strspn(p, " \t\r\n");
+        if (*p == ',') {
+            p++;
+        }
+        else if (*p != '}') {
+            return -1;
+        }
+    }
+}
+
+/**
+ * Parse a native record in the KEY=VALUE format.
+ *
+ * @param[in] buf The record.
+ * @param[in] len Length of the record.
+ * @param[out] record The parsed record.
+ *
+ * @return -1 if the record is malformed, 0 otherwise.
+ */
+static int parse_native_fields(char *buf, size_t len, logrecv_record_t *record)
+{
+    char *p = buf;
+    char *end = buf + len;
+
+    while (p < end) {
+        char *eol = memchr(p, '\n', end - p);
+        char *eq = memchr(p, '=', (eol ? eol : end) - p);
+        char *value;
+
+        if (eq) {
+            // KEY=VALUE
+            *eq = '\0';
+            value = eq + 1;
+            if (eol) {
+                *eol = '\0';
+            }
+            set_native_field(p, value, record);
+            p = eol ? eol + 1 : end;
+        }
+        else if (eol) {
+            // KEY\n<64-bit little-endian size><VALUE>\n
+            uint64_t size;
+
+            *eol = '\0';
+            value = eol + 1;
+            if (end - value < sizeof(size)) {
+                return -1;
+            }
+            memcpy(&size, value, sizeof(size));
+            size = le64toh(size);
+            value += sizeof(size);
+            if (size > end - value) {
+                return -1;
+            }
+            value[size] = '\0';
+            set_native_field(p, value, record);
+            p = value + size + 1;
+        }
+        else {
+            // Ignore a key without value.
+            break;
+        }
+    }
+
+    return 0;
+}
+
+int logrecv_parse_native(char *buf, size_t len, logrecv_record_t *record)
+{
+    record->message = NULL;
+    record->identifier = NULL;
+    record->severity = LOG_INFO;
+
+    buf[len] = '\0';
+
+    if (buf[strspn(buf, " \t\r\n")] == '{') {
+        return parse_native_json(buf, record);
+    }
+    else {
+        return parse_native_fields(buf, len, record);
+    }
+}
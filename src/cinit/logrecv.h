@@ -0,0 +1,129 @@
+#ifndef __CINIT_LOGRECV_H__
+#define __CINIT_LOGRECV_H__
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * Function invoked for each message received.
+ *
+ * @param[in] tag Tag (program name) of the message.
+ * @param[in] pid PID of the sender, 0 if unknown.
+ * @param[in] severity Severity of the message (LOG_EMERG to LOG_DEBUG).
+ * @param[in] msg The message, without trailing line-ending.
+ * @param[in] data Custom data.
+ */
+typedef void (*logrecv_callback_t)(const char *tag, pid_t pid, int severity, const char *msg, void *data);
+
+/**
+ * Function invoked to find the name of the service a process belongs to.
+ *
+ * @param[in] pid PID of the process.
+ * @param[out] name Where to store the name of the service.
+ * @param[in] size Size of the buffer.
+ * @param[in] data Custom data.
+ *
+ * @return -1 if not found, 0 otherwise.
+ */
+typedef int (*logrecv_resolver_t)(pid_t pid, char *name, size_t size, void *data);
+
+/**
+ * Record received on the native log socket.
+ */
+typedef struct {
+    const char *message;            /**< The message, NULL if not present. */
+    const char *identifier;         /**< Identifier of the sender, NULL if not present. */
+    int severity;                   /**< Severity of the message. */
+} logrecv_record_t;
+
+/**
+ * Configuration of the log receiver.
+ */
+typedef struct {
+    const char *syslog_path;        /**< Path of the syslog socket, NULL to disable. */
+    int syslog_min_severity;        /**< Messages less severe than this are discarded. */
+    const char *native_path;        /**< Path of the native log socket, NULL to disable. */
+    logrecv_resolver_t resolver;    /**< Function used to attribute native records to services. */
+    logrecv_callback_t callback;    /**< Function invoked for each message. */
+    void *callback_data;            /**< Custom data passed to the callback. */
+} logrecv_config_t;
+
+/**
+ * Status of the sockets of the log receiver.
+ */
+typedef struct {
+    int syslog_error;               /**< Error (errno) creating the syslog socket, 0 if none. */
+    int native_error;               /**< Error (errno) creating the native log socket, 0 if none. */
+} logrecv_status_t;
+
+/**
+ * Start the log receiver.
+ *
+ * Sockets are created and a thread is started to receive messages.  Sockets
+ * are independent: one that cannot be created is skipped and its error is
+ * reported in the status.
+ *
+ * @param[in] config Configuration of the receiver.  The structure must remain
+ *                   valid until the receiver is stopped.
+ * @param[out] status Where to store the status of sockets.
+ *
+ * @return -1 if no socket could be created or an error occurred, 0 otherwise.
+ */
+int logrecv_start(const logrecv_config_t *config, logrecv_status_t *status);
+
+/**
+ * Stop the log receiver.
+ *
+ * The receiving thread is terminated and sockets are removed.
+ */
+void logrecv_stop();
+
+/**
+ * Convert a string to a syslog severity.
+ *
+ * The string can be a severity keyword (e.g. 'err', 'warning', 'info') or a
+ * number between 0 and 7.
+ *
+ * @param[in] str Input string to convert.
+ *
+ * @return The severity or -1 if the string is invalid.
+ */
+int logrecv_string_to_severity(const char *str);
+
+/**
+ * Parse a syslog message.
+ *
+ * Both RFC3164 and RFC5424 formats are supported.  The message is modified in
+ * place.
+ *
+ * @param[in] buf The message to parse.
+ * @param[out] severity Severity of the message.
+ * @param[out] tag Tag of the message, NULL if not present.
+ * @param[out] pid PID found in the message, 0 if not present.
+ *
+ * @return Pointer to the content of the message.
+ */
+char *logrecv_parse_syslog(char *buf, int *severity, char **tag, pid_t *pid);
+
+/**
+ * Parse a record received on the native log socket.
+ *
+ * A record is either a JSON object or a list of newline-separated KEY=VALUE
+ * fields.  Like journald, a field can also be sent as the key, a newline, the
+ * size of the value as a little-endian 64-bit integer, the value and a
+ * newline, allowing values containing newlines.
+ *
+ * Recognized fields are MESSAGE, PRIORITY and SYSLOG_IDENTIFIER.  With JSON,
+ * the lowercase 'message', 'msg', 'priority', 'level' and 'identifier' keys
+ * are also recognized.  The record is modified in place.
+ *
+ * @param[in] buf The record to parse.  The buffer must have room for a
+ *                terminating null character.
+ * @param[in] len Length of the record.
+ * @param[out] record The parsed record.
+ *
+ * @return -1 if the record is malformed, 0 otherwise.
+ */
+int logrecv_parse_native(char *buf, size_t len, logrecv_record_t *record);
+
+#endif // __CINIT_LOGRECV_H__
@@ -0,0 +1,517 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "probe.h"
+#include "utils.h"
+
+/** Maximum jitter applied to the interval of probes (percent). */
+#define PROBE_JITTER_PERCENT 10
+
+/** Interval (in msec) at which the termination of a program is checked. */
+#define PROBE_EXEC_CHECK_INTERVAL 10
+
+/** Service slot. */
+typedef struct {
+    probe_t probe;
+    char dir[PATH_MAX];
+    pid_t pid;
+    unsigned long long next_run;    /**< Time of the next probe, 0 when disabled. */
+    unsigned int failures;
+    unsigned int generation;        /**< Incremented each time the slot is set. */
+} probe_slot_t;
+
+typedef struct {
+    bool started;
+    bool exit;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    probe_slot_t *slots;
+    size_t num_slots;
+
+    unsigned int seed;              /**< Seed of the jitter. */
+} probe_ctx_t;
+
+static probe_ctx_t g_probe = {
+    .started = false,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/**
+ * Get the current monotonic time.
+ *
+ * @return The time in milliseconds.
+ */
+static unsigned long long monotonic_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Get the time remaining before a deadline.
+ *
+ * @param[in] deadline The deadline (monotonic time, in msec).
+ *
+ * @return Remaining time (in msec), 0 if the deadline passed.
+ */
+static int remaining_ms(unsigned long long deadline)
+{
+    unsigned long long now = monotonic_ms();
+    return now >= deadline ? 0 : (int)(deadline - now);
+}
+
+int probe_parse(const char *str, probe_t *probe)
+{
+    probe->type = PROBE_TYPE_NONE;
+    probe->path[0] = '\0';
+
+    if (strncmp(str, "tcp:", 4) == 0) {
+        if (parse_inet_address(str + 4, strlen(str + 4), 0, &probe->addr, &probe->addrlen) < 0) {
+            goto invalid;
+        }
+        probe->type = PROBE_TYPE_TCP;
+    }
+    else if (strncmp(str, "unix:", 5) == 0) {
+        struct sockaddr_un *un = (struct sockaddr_un *)&probe->addr;
+        const char *path = str + 5;
+        // The probe runs from any directory: the path must be absolute.
+        if (path[0] != '/' || strlen(path) >= sizeof(un->sun_path)) {
+            goto invalid;
+        }
+        memset(&probe->addr, 0, sizeof(probe->addr));
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, path);
+        probe->addrlen = sizeof(*un);
+        probe->type = PROBE_TYPE_UNIX;
+    }
+    else if (strncmp(str, "http://", 7) == 0) {
+        const char *host = str + 7;
+        const char *path = strchr(host, '/');
+        size_t host_len = path ? (size_t)(path - host) : strlen(host);
+        if (parse_inet_address(host, host_len, 80, &probe->addr, &probe->addrlen) < 0) {
+            goto invalid;
+        }
+        if (snprintf(probe->path, sizeof(probe->path), "%s", path ? path : "/") >= sizeof(probe->path)) {
+            goto invalid;
+        }
+        probe->type = PROBE_TYPE_HTTP;
+    }
+    else if (strncmp(str, "file:", 5) == 0 || strncmp(str, "exec:", 5) == 0) {
+        if (str[5] == '\0' || strlen(str + 5) >= sizeof(probe->path)) {
+            goto invalid;
+        }
+        // Unlike programs, files are not looked up in the service directory.
+        else if (str[0] == 'f' && str[5] != '/') {
+            goto invalid;
+        }
+        strcpy(probe->path, str + 5);
+        probe->type = (str[0] == 'f') ? PROBE_TYPE_FILE : PROBE_TYPE_EXEC;
+    }
+    else {
+        goto invalid;
+    }
+
+    return 0;
+
+invalid:
+    errno = EINVAL;
+    return -1;
+}
+
+/**
+ * Connect to a stream socket.
+ *
+ * @param[in] probe The probe, holding the address to connect to.
+ * @param[in] deadline Time (in msec) at which the connection is abandoned.
+ *
+ * @return -1 if the connection failed, the connected socket otherwise.
+ */
+static int connect_before(const probe_t *probe, unsigned long long deadline)
+{
+    int fd = socket(probe->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (connect(fd, (const struct sockaddr *)&probe->addr, probe->addrlen) < 0) {
+        struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+        int err = 0;
+        socklen_t errlen = sizeof(err);
+
+        if (errno != EINPROGRESS ||
+            poll(&pfd, 1, remaining_ms(deadline)) <= 0 ||
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0 ||
+            err != 0) {
+            close(fd);
+            return -1;
+        }
+    }
+
+    return fd;
+}
+
+/**
+ * Send an HTTP request and check the status of the response.
+ *
+ * @param[in] probe The probe.
+ * @param[in] deadline Time (in msec) at which the probe is abandoned.
+ *
+ * @return -1 if the probe failed, 0 otherwise.
+ */
+static int run_http_probe(const probe_t *probe, unsigned long long deadline)
+{
+    char buf[512];
+    char host[INET6_ADDRSTRLEN];
+    size_t used = 0;
+    int status = 0;
+
+    int fd = connect_before(probe, deadline);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (probe->addr.ss_family == AF_INET6) {
+        inet_ntop(AF_INET6, &((const struct sockaddr_in6 *)&probe->addr)->sin6_addr, host, sizeof(host));
+    }
+    else {
+        inet_ntop(AF_INET, &((const struct sockaddr_in *)&probe->addr)->sin_addr, host, sizeof(host));
+    }
+
+    // The request is small enough to be written at once.
+    int len = snprintf(buf, sizeof(buf),
+            "GET %s HTTP/1.0\r\nHost: %s\r\nUser-Agent: cinit\r\nConnection: close\r\n\r\n",
+            probe->path, host);
+    if (len >= sizeof(buf) || send(fd, buf, len, MSG_NOSIGNAL) != len) {
+        close(fd);
+        return -1;
+    }
+
+    // Read the status line.
+    while (used < sizeof(buf) - 1 && !memchr(buf, '\n', used)) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        if (poll(&pfd, 1, remaining_ms(deadline)) <= 0) {
+            break;
+        }
+        ssize_t n = recv(fd, buf + used, sizeof(buf) - 1 - used, 0);
+        if (n <= 0) {
+            break;
+        }
+        used += n;
+    }
+    buf[used] = '\0';
+    close(fd);
+
+    if (sscanf(buf, "HTTP/%*u.%*u %d", &status) != 1) {
+        return -1;
+    }
+    return (status >= 200 && status < 400) ? 0 : -1;
+}
+
+/**
+ * Execute a program and check its exit status.
+ *
+ * The program is created without termination signal, so it is not reaped by
+ * the process supervisor waiting for its services.
+ *
+ * @param[in] probe The probe.
+ * @param[in] dir Directory from which the program is executed.
+ * @param[in] pid PID of the service.
+ * @param[in] deadline Time (in msec) at which the program is killed.
+ *
+ * @return -1 if the probe failed, 0 otherwise.
+ */
+static int run_exec_probe(const probe_t *probe, const char *dir, pid_t pid, unsigned long long deadline)
+{
+    char arg[16];
+    int status;
+
+    snprintf(arg, sizeof(arg), "%d", pid);
+
+    pid_t child = syscall(SYS_clone, 0, NULL, NULL, NULL, NULL);
+    if (child < 0) {
+        return -1;
+    }
+    else if (child == 0) {
+        // Only async-signal-safe functions can be used here.
+        int null_fd = open("/dev/null", O_RDWR);
+        if (null_fd >= 0) {
+            dup2(null_fd, STDIN_FILENO);
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+        }
+        if (chdir(dir) < 0) {
+            _exit(127);
+        }
+        execl(probe->path, probe->path, arg, (char *)NULL);
+        _exit(127);
+    }
+
+    while (true) {
+        pid_t rc = waitpid(child, &status, WNOHANG | __WCLONE);
+        if (rc == child) {
+            break;
+        }
+        else if (rc < 0 && errno != EINTR) {
+            return -1;
+        }
+        else if (remaining_ms(deadline) == 0) {
+            kill(child, SIGKILL);
+            while (waitpid(child, &status, __WCLONE) < 0 && errno == EINTR);
+            return -1;
+        }
+        usleep(PROBE_EXEC_CHECK_INTERVAL * 1000);
+    }
+
+    return (WIFEXITED(status) && WEXITSTATUS(status) == 0) ? 0 : -1;
+}
+
+/**
+ * Run a probe.
+ *
+ * @param[in] probe The probe.
+ * @param[in] dir Directory from which programs are executed.
+ * @param[in] pid PID of the service.
+ *
+ * @return -1 if the probe failed, 0 otherwise.
+ */
+static int run_probe(const probe_t *probe, const char *dir, pid_t pid)
+{
+    unsigned long long deadline = monotonic_ms() + probe->timeout;
+
+    switch (probe->type) {
+        case PROBE_TYPE_TCP:
+        case PROBE_TYPE_UNIX:
+        {
+            int fd = connect_before(probe, deadline);
+            if (fd < 0) {
+                return -1;
+            }
+            close(fd);
+            return 0;
+        }
+        case PROBE_TYPE_HTTP:
+            return run_http_probe(probe, deadline);
+        case PROBE_TYPE_FILE:
+        {
+            // The file must have been modified within the last interval,
+            // with some tolerance.
+            struct stat st;
+            struct timespec now;
+            if (stat(probe->path, &st) < 0) {
+                return -1;
+            }
+            clock_gettime(CLOCK_REALTIME, &now);
+            long long age = (long long)(now.tv_sec - st.st_mtim.tv_sec) * 1000 +
+                (now.tv_nsec - st.st_mtim.tv_nsec) / 1000000;
+            return age <= (long long)probe->interval + probe->timeout ? 0 : -1;
+        }
+        case PROBE_TYPE_EXEC:
+            return run_exec_probe(probe, dir, pid, deadline);
+        case PROBE_TYPE_NONE:
+            break;
+    }
+
+    return 0;
+}
+
+/**
+ * Get the time of the next probe of a slot.
+ *
+ * @param[in] from Time (in msec) from which the interval starts.
+ * @param[in] interval Interval (in msec) of the probe.
+ *
+ * @return Time (in msec) of the next probe.
+ */
+static unsigned long long next_run(unsigned long long from, unsigned int interval)
+{
+    unsigned int jitter = interval / 100 * PROBE_JITTER_PERCENT;
+    if (jitter == 0) {
+        return from + interval;
+    }
+    return from + interval - jitter + rand_r(&g_probe.seed) % (2 * jitter + 1);
+}
+
+/**
+ * Prober.
+ *
+ * This function is intended to be run into a thread.
+ *
+ * @param[in] p Unused.
+ *
+ * @return NULL.
+ */
+static void *probe_thread(void *p)
+{
+    pthread_mutex_lock(&g_probe.lock);
+    while (!g_probe.exit) {
+        // Find the next probe to run.
+        int slot = -1;
+        for (size_t i = 0; i < g_probe.num_slots; i++) {
+            if (g_probe.slots[i].next_run == 0) {
+                continue;
+            }
+            else if (slot < 0 || g_probe.slots[i].next_run < g_probe.slots[slot].next_run) {
+                slot = i;
+            }
+        }
+
+        unsigned long long now = monotonic_ms();
+        if (slot < 0 || g_probe.slots[slot].next_run > now) {
+            // Wait until the next probe is due or a slot is changed.
+            struct timespec deadline;
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            if (slot < 0) {
+                deadline.tv_sec += 3600;
+            }
+            else {
+                unsigned long long delay = g_probe.slots[slot].next_run - now;
+                deadline.tv_sec += delay / 1000;
+                deadline.tv_nsec += (delay % 1000) * 1000000L;
+                if (deadline.tv_nsec >= 1000000000L) {
+                    deadline.tv_sec++;
+                    deadline.tv_nsec -= 1000000000L;
+                }
+            }
+            pthread_cond_timedwait(&g_probe.cond, &g_probe.lock, &deadline);
+            continue;
+        }
+
+        // Run the probe without holding the lock.
+        probe_slot_t *s = &g_probe.slots[slot];
+        probe_t probe = s->probe;
+        char dir[PATH_MAX];
+        pid_t pid = s->pid;
+        unsigned int generation = s->generation;
+        snprintf(dir, sizeof(dir), "%s", s->dir);
+
+        pthread_mutex_unlock(&g_probe.lock);
+        int rc = run_probe(&probe, dir, pid);
+        pthread_mutex_lock(&g_probe.lock);
+
+        // Ignore the result if the slot changed in the meantime.
+        if (s->generation == generation && s->next_run != 0) {
+            s->failures = (rc == 0) ? 0 : s->failures + 1;
+            s->next_run = next_run(monotonic_ms(), probe.interval);
+        }
+    }
+    pthread_mutex_unlock(&g_probe.lock);
+
+    return NULL;
+}
+
+int probe_start(size_t num_slots)
+{
+    pthread_condattr_t attr;
+
+    if (g_probe.started) {
+        return 0;
+    }
+
+    g_probe.slots = calloc(num_slots, sizeof(*g_probe.slots));
+    if (!g_probe.slots) {
+        errno = ENOMEM;
+        return -1;
+    }
+    g_probe.num_slots = num_slots;
+    g_probe.exit = false;
+    g_probe.seed = (unsigned int)(monotonic_ms() ^ getpid());
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&g_probe.cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    int rc = pthread_create(&g_probe.thread, NULL, probe_thread, NULL);
+    if (rc != 0) {
+        pthread_cond_destroy(&g_probe.cond);
+        free(g_probe.slots);
+        g_probe.slots = NULL;
+        errno = rc;
+        return -1;
+    }
+
+    g_probe.started = true;
+    return 0;
+}
+
+void probe_stop()
+{
+    if (!g_probe.started) {
+        return;
+    }
+
+    pthread_mutex_lock(&g_probe.lock);
+    g_probe.exit = true;
+    pthread_cond_signal(&g_probe.cond);
+    pthread_mutex_unlock(&g_probe.lock);
+    pthread_join(g_probe.thread, NULL);
+
+    free(g_probe.slots);
+    g_probe.slots = NULL;
+    g_probe.num_slots = 0;
+    pthread_cond_destroy(&g_probe.cond);
+
+    g_probe.started = false;
+}
+
+bool probe_running()
+{
+    return g_probe.started;
+}
+
+void probe_set_service(int slot, const probe_t *probe, const char *dir, pid_t pid)
+{
+    if (!g_probe.started || slot < 0 || slot >= g_probe.num_slots) {
+        return;
+    }
+
+    pthread_mutex_lock(&g_probe.lock);
+    probe_slot_t *s = &g_probe.slots[slot];
+    s->generation++;
+    s->failures = 0;
+    if (probe && probe->type != PROBE_TYPE_NONE && pid > 0) {
+        s->probe = *probe;
+        snprintf(s->dir, sizeof(s->dir), "%s", dir ? dir : "/");
+        s->pid = pid;
+        s->next_run = next_run(monotonic_ms(), probe->interval);
+    }
+    else {
+        s->pid = 0;
+        s->next_run = 0;
+    }
+    pthread_cond_signal(&g_probe.cond);
+    pthread_mutex_unlock(&g_probe.lock);
+}
+
+unsigned int probe_get_failures(int slot)
+{
+    unsigned int failures = 0;
+
+    if (!g_probe.started || slot < 0 || slot >= g_probe.num_slots) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&g_probe.lock);
+    failures = g_probe.slots[slot].failures;
+    pthread_mutex_unlock(&g_probe.lock);
+
+    return failures;
+}
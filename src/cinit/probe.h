@@ -0,0 +1,107 @@
+#ifndef __CINIT_PROBE_H__
+#define __CINIT_PROBE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/**
+ * Maximum size of the path of a probe.
+ */
+#define PROBE_PATH_SIZE 256
+
+/**
+ * Type of probe.
+ */
+typedef enum {
+    PROBE_TYPE_NONE = 0,            /**< No probe. */
+    PROBE_TYPE_TCP,                 /**< Connection to a TCP port. */
+    PROBE_TYPE_UNIX,                /**< Connection to a Unix stream socket. */
+    PROBE_TYPE_HTTP,                /**< HTTP request returning a 2xx or 3xx status. */
+    PROBE_TYPE_FILE,                /**< File recently modified. */
+    PROBE_TYPE_EXEC,                /**< Program exiting with status 0. */
+} probe_type_t;
+
+/**
+ * Definition of a probe.
+ */
+typedef struct {
+    probe_type_t type;              /**< Type of probe. */
+    struct sockaddr_storage addr;   /**< Address to connect to (TCP, Unix and HTTP). */
+    socklen_t addrlen;              /**< Length of the address. */
+    char path[PROBE_PATH_SIZE];     /**< HTTP path, file or program. */
+    unsigned int interval;          /**< Interval (in msec) between probes. */
+    unsigned int timeout;           /**< Timeout (in msec) of a probe. */
+    unsigned int failure_threshold; /**< Consecutive failures after which the probe failed. */
+} probe_t;
+
+/**
+ * Parse the definition of a probe.
+ *
+ * Supported definitions are:
+ *   - 'tcp:ADDRESS:PORT'
+ *   - 'unix:PATH'
+ *   - 'http://ADDRESS[:PORT][/PATH]'
+ *   - 'file:PATH'
+ *   - 'exec:PROGRAM'
+ *
+ * Addresses are numeric IPv4 or IPv6 (between brackets) addresses, or
+ * 'localhost'.  Paths of Unix sockets and files must be absolute.  Only the
+ * type and target of the probe are set.
+ *
+ * @param[in] str Definition of the probe.
+ * @param[out] probe Where to store the probe.
+ *
+ * @return -1 if the definition is invalid, 0 otherwise.
+ */
+int probe_parse(const char *str, probe_t *probe);
+
+/**
+ * Start the prober.
+ *
+ * A thread runs probes of services at their interval, with some jitter to
+ * avoid synchronized bursts.  Probes are run one at a time.
+ *
+ * @param[in] num_slots Number of service slots.
+ *
+ * @return -1 if an error occurred, 0 otherwise.
+ */
+int probe_start(size_t num_slots);
+
+/**
+ * Stop the prober.
+ */
+void probe_stop();
+
+/**
+ * Check if the prober is running.
+ *
+ * @return true if the prober is running.
+ */
+bool probe_running();
+
+/**
+ * Set the probe of a slot.
+ *
+ * The count of consecutive failures is reset and the first probe is
+ * scheduled after one interval.
+ *
+ * @param[in] slot Index of the slot.
+ * @param[in] probe The probe, NULL to disable probing.
+ * @param[in] dir Directory from which programs are executed.
+ * @param[in] pid PID of the service, passed as argument to programs.
+ */
+void probe_set_service(int slot, const probe_t *probe, const char *dir, pid_t pid);
+
+/**
+ * Get the number of consecutive failures of a slot's probe.
+ *
+ * @param[in] slot Index of the slot.
+ *
+ * @return Number of consecutive failures.
+ */
+unsigned int probe_get_failures(int slot);
+
+#endif // __CINIT_PROBE_H__
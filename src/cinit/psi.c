@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+
+#include "psi.h"
+#include "cgroup.h"
+
+static const char * const resource_names[] = {
+    [PSI_RESOURCE_CPU] = "cpu",
+    [PSI_RESOURCE_MEMORY] = "memory",
+    [PSI_RESOURCE_IO] = "io",
+};
+
+/** Path of the pressure file used for each resource, once selected. */
+static char g_paths[PSI_NUM_RESOURCES][PATH_MAX];
+
+const char *psi_resource_name(psi_resource_t resource)
+{
+    return resource_names[resource];
+}
+
+/**
+ * Open the pressure file of a resource.
+ *
+ * @param[in] resource The resource.
+ * @param[in] flags Flags passed to open().
+ *
+ * @return -1 if an error occurred, the file descriptor otherwise.
+ */
+static int open_pressure_file(psi_resource_t resource, int flags)
+{
+    char candidates[2][PATH_MAX];
+    int fd;
+
+    if (g_paths[resource][0] != '\0') {
+        return open(g_paths[resource], flags | O_CLOEXEC);
+    }
+
+    snprintf(candidates[0], sizeof(candidates[0]), CGROUP_ROOT "/%s.pressure", resource_names[resource]);
+    snprintf(candidates[1], sizeof(candidates[1]), "/proc/pressure/%s", resource_names[resource]);
+
+    for (int i = 0; i < 2; i++) {
+        fd = open(candidates[i], flags | O_CLOEXEC);
+        if (fd >= 0) {
+            snprintf(g_paths[resource], sizeof(g_paths[resource]), "%s", candidates[i]);
+            return fd;
+        }
+    }
+
+    return -1;
+}
+
+int psi_trigger(psi_resource_t resource, unsigned int stall, unsigned int window)
+{
+    char trigger[64];
+
+    int fd = open_pressure_file(resource, O_RDWR | O_NONBLOCK);
+    if (fd < 0) {
+        return -1;
+    }
+
+    // The terminating null character must be written too.
+    int len = snprintf(trigger, sizeof(trigger), "some %u %u", stall, window) + 1;
+    if (write(fd, trigger, len) != len) {
+        int errsv = errno;
+        close(fd);
+        errno = errsv;
+        return -1;
+    }
+
+    return fd;
+}
+
+int psi_read_avg10(psi_resource_t resource, double *avg10)
+{
+    char buf[256];
+    ssize_t len;
+
+    int fd = open_pressure_file(resource, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    do {
+        len = read(fd, buf, sizeof(buf) - 1);
+    } while (len < 0 && errno == EINTR);
+
+    if (len < 0) {
+        int errsv = errno;
+        close(fd);
+        errno = errsv;
+        return -1;
+    }
+    close(fd);
+    buf[len] = '\0';
+
+    // The first line is in the form 'some avg10=0.00 avg60=0.00 ...'.
+    if (sscanf(buf, "some avg10=%lf", avg10) != 1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
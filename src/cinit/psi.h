@@ -0,0 +1,56 @@
+#ifndef __CINIT_PSI_H__
+#define __CINIT_PSI_H__
+
+/**
+ * Resources for which pressure stall information is available.
+ */
+typedef enum {
+    PSI_RESOURCE_CPU = 0,           /**< cpu */
+    PSI_RESOURCE_MEMORY,            /**< memory */
+    PSI_RESOURCE_IO,                /**< io */
+    PSI_NUM_RESOURCES,
+} psi_resource_t;
+
+/**
+ * Get the name of a resource.
+ *
+ * @param[in] resource The resource.
+ *
+ * @return Name of the resource (e.g. 'memory').
+ */
+const char *psi_resource_name(psi_resource_t resource);
+
+/**
+ * Create a pressure trigger.
+ *
+ * The pressure file of the cgroup v2 hierarchy root is used when available,
+ * since it accounts only processes of the container.  Otherwise, the
+ * system-wide file under /proc/pressure is used.
+ *
+ * The returned file descriptor gets a POLLPRI event each time some tasks
+ * have been stalled on the resource for at least the given time within the
+ * window.  It gets a POLLERR event if the trigger is destroyed.
+ *
+ * @param[in] resource The resource to monitor.
+ * @param[in] stall Stall time threshold (in usec).
+ * @param[in] window Time window (in usec).
+ *
+ * @return -1 if an error occurred, the file descriptor of the trigger
+ *         otherwise.
+ */
+int psi_trigger(psi_resource_t resource, unsigned int stall, unsigned int window);
+
+/**
+ * Get the pressure of a resource averaged over the last 10 seconds.
+ *
+ * The same file as the one used by psi_trigger() is read.
+ *
+ * @param[in] resource The resource.
+ * @param[out] avg10 Where to store the percentage of time some tasks were
+ *                   stalled on the resource.
+ *
+ * @return -1 if an error occurred, 0 otherwise.
+ */
+int psi_read_avg10(psi_resource_t resource, double *avg10);
+
+#endif // __CINIT_PSI_H__
@@ -0,0 +1,534 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <ctype.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "sampler.h"
+#include "cgroup.h"
+#include "utils.h"
+
+#define MAX(a, b) ((a)>=(b)?(a):(b))
+
+/** Maximum length of a service name. */
+#define SAMPLER_NAME_SIZE 256
+
+/**
+ * Process tracked by the sampler.
+ *
+ * File descriptors are kept open between samples, so each sample only needs
+ * to re-read them.
+ */
+typedef struct {
+    pid_t pid;
+    unsigned long long start_time;  /**< Start time, to detect PID reuse. */
+    unsigned long long cpu_ticks;   /**< CPU time at the previous sample. */
+    int stat_fd;                    /**< /proc/<pid>/stat */
+    int smaps_fd;                   /**< /proc/<pid>/smaps_rollup */
+    int slot;                       /**< Slot of the service, -1 if none. */
+    bool seen;                      /**< Whether the process was seen in the current scan. */
+} sampler_proc_t;
+
+/** Service slot. */
+typedef struct {
+    char name[SAMPLER_NAME_SIZE];
+    pid_t pid;
+    bool valid;
+    sampler_stats_t stats;
+} sampler_slot_t;
+
+typedef struct {
+    bool started;
+    bool exit;
+    unsigned int interval;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    sampler_slot_t *slots;
+    size_t num_slots;
+
+    // Only accessed by the sampler thread.
+    sampler_proc_t *procs;
+    size_t num_procs;
+    size_t procs_capacity;
+    sampler_stats_t *work;
+    long page_size;
+    long clock_ticks;
+} sampler_ctx_t;
+
+static sampler_ctx_t g_sampler = {
+    .started = false,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/**
+ * Get the current monotonic time.
+ *
+ * @return The time in milliseconds.
+ */
+static unsigned long long monotonic_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Read a /proc file through an already opened file descriptor.
+ *
+ * @param[in] fd File descriptor of the file.
+ * @param[out] buf Where to store the content, null terminated.
+ * @param[in] bufsize Size of the buffer.
+ *
+ * @return Length of the content, -1 on error.
+ */
+static ssize_t reread(int fd, char *buf, size_t bufsize)
+{
+    ssize_t len = pread(fd, buf, bufsize - 1, 0);
+    if (len >= 0) {
+        buf[len] = '\0';
+    }
+    return len;
+}
+
+/**
+ * Parse the content of /proc/<pid>/stat.
+ *
+ * @param[in] buf Content of the file.
+ * @param[out] pgrp Process group.
+ * @param[out] cpu_ticks User and system CPU time (clock ticks).
+ * @param[out] start_time Start time of the process.
+ * @param[out] rss Resident set size (pages).
+ *
+ * @return -1 if the content is invalid, 0 otherwise.
+ */
+static int parse_stat(char *buf, pid_t *pgrp, unsigned long long *cpu_ticks,
+        unsigned long long *start_time, unsigned long long *rss)
+{
+    // The command name is between parentheses and may contain spaces.
+    char *p = strrchr(buf, ')');
+    if (!p) {
+        return -1;
+    }
+
+    // Fields after the command name start at field 3 (state).
+    char *saveptr;
+    int field = 3;
+    unsigned long long utime = 0;
+    for (char *tok = strtok_r(p + 1, " ", &saveptr); tok; tok = strtok_r(NULL, " ", &saveptr), field++) {
+        switch (field) {
+            case 5: *pgrp = atoi(tok); break;
+            case 14: utime = strtoull(tok, NULL, 10); break;
+            case 15: *cpu_ticks = utime + strtoull(tok, NULL, 10); break;
+            case 22: *start_time = strtoull(tok, NULL, 10); break;
+            case 24: *rss = strtoull(tok, NULL, 10); return 0;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Get the proportional set size of a process.
+ *
+ * @param[in] proc The process.
+ *
+ * @return The PSS in bytes, 0 if not available.
+ */
+static unsigned long long get_pss(sampler_proc_t *proc)
+{
+    char buf[1024];
+
+    if (proc->smaps_fd < 0 || reread(proc->smaps_fd, buf, sizeof(buf)) < 0) {
+        return 0;
+    }
+
+    char *p = strstr(buf, "\nPss:");
+    return p ? strtoull(p + 5, NULL, 10) * 1024 : 0;
+}
+
+/**
+ * Count the open file descriptors of a process.
+ *
+ * @param[in] pid PID of the process.
+ *
+ * @return The number of file descriptors.
+ */
+static unsigned int count_fds(pid_t pid)
+{
+    char path[64];
+    unsigned int count = 0;
+
+    snprintf(path, sizeof(path), "/proc/%d/fd", pid);
+    DIR *dir = opendir(path);
+    if (!dir) {
+        return 0;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] != '.') {
+            count++;
+        }
+    }
+
+    closedir(dir);
+    return count;
+}
+
+/**
+ * Find the slot of a service.
+ *
+ * NOTE: Must be called with the lock held.
+ *
+ * @param[in] pid PID of the process.
+ * @param[in] pgrp Process group of the process.
+ *
+ * @return Index of the slot, -1 if not found.
+ */
+static int find_slot(pid_t pid, pid_t pgrp)
+{
+    for (int i = 0; i < g_sampler.num_slots; i++) {
+        pid_t srv_pid = g_sampler.slots[i].pid;
+        if (srv_pid > 0 && (srv_pid == pid || srv_pid == pgrp)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Find the slot of a service by name.
+ *
+ * NOTE: Must be called with the lock held.
+ *
+ * @param[in] name Name of the service.
+ *
+ * @return Index of the slot, -1 if not found.
+ */
+static int find_slot_by_name(const char *name)
+{
+    for (int i = 0; i < g_sampler.num_slots; i++) {
+        if (g_sampler.slots[i].pid > 0 && strcmp(g_sampler.slots[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Close file descriptors of a process.
+ *
+ * @param[in] proc The process.
+ */
+static void close_proc(sampler_proc_t *proc)
+{
+    if (proc->stat_fd >= 0) {
+        close(proc->stat_fd);
+    }
+    if (proc->smaps_fd >= 0) {
+        close(proc->smaps_fd);
+    }
+}
+
+/**
+ * Get the tracking entry of a process, creating it if needed.
+ *
+ * @param[in] pid PID of the process.
+ *
+ * @return The entry or NULL on error.
+ */
+static sampler_proc_t *get_proc(pid_t pid)
+{
+    char path[64];
+
+    for (size_t i = 0; i < g_sampler.num_procs; i++) {
+        if (g_sampler.procs[i].pid == pid) {
+            return &g_sampler.procs[i];
+        }
+    }
+
+    // New process.
+    if (g_sampler.num_procs == g_sampler.procs_capacity) {
+        size_t capacity = MAX(g_sampler.procs_capacity * 2, 64);
+        sampler_proc_t *procs = realloc(g_sampler.procs, capacity * sizeof(*procs));
+        if (!procs) {
+            return NULL;
+        }
+        g_sampler.procs = procs;
+        g_sampler.procs_capacity = capacity;
+    }
+
+    sampler_proc_t *proc = &g_sampler.procs[g_sampler.num_procs];
+    memset(proc, 0, sizeof(*proc));
+    proc->pid = pid;
+    proc->slot = -1;
+    proc->smaps_fd = -1;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    proc->stat_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (proc->stat_fd < 0) {
+        return NULL;
+    }
+    snprintf(path, sizeof(path), "/proc/%d/smaps_rollup", pid);
+    proc->smaps_fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    g_sampler.num_procs++;
+    return proc;
+}
+
+/**
+ * Take a sample.
+ *
+ * @param[in] elapsed Time (in msec) since the previous sample.
+ */
+static void take_sample(unsigned long long elapsed)
+{
+    char buf[1024];
+
+    memset(g_sampler.work, 0, g_sampler.num_slots * sizeof(*g_sampler.work));
+
+    for (size_t i = 0; i < g_sampler.num_procs; i++) {
+        g_sampler.procs[i].seen = false;
+    }
+
+    DIR *dir = opendir("/proc");
+    if (!dir) {
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (!isdigit(entry->d_name[0])) {
+            continue;
+        }
+
+        pid_t pid = atoi(entry->d_name);
+        pid_t pgrp = 0;
+        unsigned long long cpu_ticks = 0;
+        unsigned long long start_time = 0;
+        unsigned long long rss = 0;
+        sampler_proc_t *proc = get_proc(pid);
+        if (!proc) {
+            continue;
+        }
+
+        if (reread(proc->stat_fd, buf, sizeof(buf)) <= 0 ||
+            parse_stat(buf, &pgrp, &cpu_ticks, &start_time, &rss) < 0) {
+            // Process is gone: the entry is removed below.
+            continue;
+        }
+
+        bool new_proc = (proc->start_time == 0);
+        if (!new_proc && proc->start_time != start_time) {
+            // The PID has been reused. Forget the entry: the new process
+            // will be tracked at the next sample.
+            continue;
+        }
+        proc->seen = true;
+        proc->start_time = start_time;
+
+        // Attribute the process to a service. The process group is checked
+        // at each sample, since it can change.
+        pthread_mutex_lock(&g_sampler.lock);
+        proc->slot = find_slot(pid, pgrp);
+        if (proc->slot < 0 && cgroup_available()) {
+            char name[SAMPLER_NAME_SIZE];
+            if (cgroup_find(pid, name, sizeof(name)) == 0) {
+                proc->slot = find_slot_by_name(name);
+            }
+        }
+        pthread_mutex_unlock(&g_sampler.lock);
+
+        if (proc->slot >= 0) {
+            sampler_stats_t *stats = &g_sampler.work[proc->slot];
+            unsigned long long delta = new_proc ? 0 : cpu_ticks - proc->cpu_ticks;
+
+            stats->num_procs++;
+            stats->rss += rss * g_sampler.page_size;
+            stats->pss += get_pss(proc);
+            stats->num_fds += count_fds(pid);
+            if (elapsed > 0) {
+                stats->cpu += delta * 100000.0 / g_sampler.clock_ticks / elapsed;
+            }
+        }
+        proc->cpu_ticks = cpu_ticks;
+    }
+    closedir(dir);
+
+    // Forget processes that are gone.
+    for (size_t i = 0; i < g_sampler.num_procs;) {
+        if (!g_sampler.procs[i].seen) {
+            close_proc(&g_sampler.procs[i]);
+            g_sampler.procs[i] = g_sampler.procs[--g_sampler.num_procs];
+        }
+        else {
+            i++;
+        }
+    }
+
+    // Publish results.
+    pthread_mutex_lock(&g_sampler.lock);
+    for (size_t i = 0; i < g_sampler.num_slots; i++) {
+        g_sampler.slots[i].stats = g_sampler.work[i];
+        g_sampler.slots[i].valid = (g_sampler.slots[i].pid > 0);
+    }
+    pthread_mutex_unlock(&g_sampler.lock);
+}
+
+/**
+ * Resource sampler.
+ *
+ * This function is intended to be run into a thread.
+ *
+ * @param[in] p Unused.
+ *
+ * @return NULL.
+ */
+static void *sampler_thread(void *p)
+{
+    unsigned long long last = monotonic_ms();
+
+    pthread_mutex_lock(&g_sampler.lock);
+    while (!g_sampler.exit) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += g_sampler.interval / 1000;
+        deadline.tv_nsec += (g_sampler.interval % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        int rc = 0;
+        while (!g_sampler.exit && rc != ETIMEDOUT) {
+            rc = pthread_cond_timedwait(&g_sampler.cond, &g_sampler.lock, &deadline);
+        }
+        if (g_sampler.exit) {
+            break;
+        }
+
+        pthread_mutex_unlock(&g_sampler.lock);
+        unsigned long long now = monotonic_ms();
+        take_sample(now - last);
+        last = now;
+        pthread_mutex_lock(&g_sampler.lock);
+    }
+    pthread_mutex_unlock(&g_sampler.lock);
+
+    return NULL;
+}
+
+int sampler_start(size_t num_slots, unsigned int interval)
+{
+    pthread_condattr_t attr;
+
+    if (g_sampler.started) {
+        return 0;
+    }
+
+    g_sampler.slots = calloc(num_slots, sizeof(*g_sampler.slots));
+    g_sampler.work = calloc(num_slots, sizeof(*g_sampler.work));
+    if (!g_sampler.slots || !g_sampler.work) {
+        free(g_sampler.slots);
+        free(g_sampler.work);
+        errno = ENOMEM;
+        return -1;
+    }
+    g_sampler.num_slots = num_slots;
+    g_sampler.interval = interval;
+    g_sampler.exit = false;
+    g_sampler.page_size = sysconf(_SC_PAGESIZE);
+    g_sampler.clock_ticks = sysconf(_SC_CLK_TCK);
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&g_sampler.cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    int rc = pthread_create(&g_sampler.thread, NULL, sampler_thread, NULL);
+    if (rc != 0) {
+        pthread_cond_destroy(&g_sampler.cond);
+        free(g_sampler.slots);
+        free(g_sampler.work);
+        g_sampler.slots = NULL;
+        g_sampler.work = NULL;
+        errno = rc;
+        return -1;
+    }
+
+    g_sampler.started = true;
+    return 0;
+}
+
+void sampler_stop()
+{
+    if (!g_sampler.started) {
+        return;
+    }
+
+    pthread_mutex_lock(&g_sampler.lock);
+    g_sampler.exit = true;
+    pthread_cond_signal(&g_sampler.cond);
+    pthread_mutex_unlock(&g_sampler.lock);
+    pthread_join(g_sampler.thread, NULL);
+
+    for (size_t i = 0; i < g_sampler.num_procs; i++) {
+        close_proc(&g_sampler.procs[i]);
+    }
+    free(g_sampler.procs);
+    free(g_sampler.slots);
+    free(g_sampler.work);
+    g_sampler.procs = NULL;
+    g_sampler.num_procs = 0;
+    g_sampler.procs_capacity = 0;
+    g_sampler.slots = NULL;
+    g_sampler.work = NULL;
+    g_sampler.num_slots = 0;
+    pthread_cond_destroy(&g_sampler.cond);
+
+    g_sampler.started = false;
+}
+
+bool sampler_running()
+{
+    return g_sampler.started;
+}
+
+void sampler_set_service(int slot, const char *name, pid_t pid)
+{
+    if (!g_sampler.started || slot < 0 || slot >= g_sampler.num_slots) {
+        return;
+    }
+
+    pthread_mutex_lock(&g_sampler.lock);
+    snprintf(g_sampler.slots[slot].name, sizeof(g_sampler.slots[slot].name), "%s", name);
+    g_sampler.slots[slot].pid = pid;
+    g_sampler.slots[slot].valid = false;
+    pthread_mutex_unlock(&g_sampler.lock);
+}
+
+bool sampler_get(int slot, sampler_stats_t *stats)
+{
+    bool valid = false;
+
+    if (!g_sampler.started || slot < 0 || slot >= g_sampler.num_slots) {
+        return false;
+    }
+
+    pthread_mutex_lock(&g_sampler.lock);
+    if (g_sampler.slots[slot].valid) {
+        *stats = g_sampler.slots[slot].stats;
+        valid = true;
+    }
+    pthread_mutex_unlock(&g_sampler.lock);
+
+    return valid;
+}
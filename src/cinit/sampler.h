@@ -0,0 +1,64 @@
+#ifndef __CINIT_SAMPLER_H__
+#define __CINIT_SAMPLER_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * Resources used by the processes of a service, as of the latest sample.
+ */
+typedef struct {
+    unsigned int num_procs;         /**< Number of processes. */
+    unsigned long long rss;         /**< Resident set size (bytes). */
+    unsigned long long pss;         /**< Proportional set size (bytes). */
+    double cpu;                     /**< CPU usage (percent of one CPU). */
+    unsigned int num_fds;           /**< Number of open file descriptors. */
+} sampler_stats_t;
+
+/**
+ * Start the resource sampler.
+ *
+ * A thread periodically scans /proc and computes resources used by the
+ * processes of each service.  A process belongs to a service when it is in
+ * the process group of the service or in its cgroup.
+ *
+ * @param[in] num_slots Number of service slots.
+ * @param[in] interval Interval (in msec) between samples.
+ *
+ * @return -1 if an error occurred, 0 otherwise.
+ */
+int sampler_start(size_t num_slots, unsigned int interval);
+
+/**
+ * Stop the resource sampler.
+ */
+void sampler_stop();
+
+/**
+ * Check if the resource sampler is running.
+ *
+ * @return true if the sampler is running.
+ */
+bool sampler_running();
+
+/**
+ * Set the service associated to a slot.
+ *
+ * @param[in] slot Index of the slot.
+ * @param[in] name Name of the service.
+ * @param[in] pid PID of the service, 0 if not running.
+ */
+void sampler_set_service(int slot, const char *name, pid_t pid);
+
+/**
+ * Get the resources used by a service.
+ *
+ * @param[in] slot Index of the slot.
+ * @param[out] stats Where to store resources used.
+ *
+ * @return false if no sample is available for the service.
+ */
+bool sampler_get(int slot, sampler_stats_t *stats);
+
+#endif // __CINIT_SAMPLER_H__
@@ -8,8 +8,15 @@
 #include <pwd.h>
 #include <grp.h>
 #include <poll.h>
+#include <signal.h>
+#include <dirent.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
 
 #include "utils.h"
 #include "CException.h"
@@ -190,6 +197,35 @@ void remove_all_char(char *s, char c)
     remove_all_char(s + 1, c);
 }
 
+char *replace_all_str(const char *s, const char *pattern, const char *replacement)
+{
+    size_t pattern_len = strlen(pattern);
+    size_t replacement_len = strlen(replacement);
+    size_t count = 0;
+
+    for (const char *p = strstr(s, pattern); p; p = strstr(p + pattern_len, pattern)) {
+        count++;
+    }
+
+    char *result = malloc(strlen(s) + count * replacement_len - count * pattern_len + 1);
+    if (!result) {
+        return NULL;
+    }
+
+    char *out = result;
+    const char *p;
+    while ((p = strstr(s, pattern)) != NULL) {
+        memcpy(out, s, p - s);
+        out += p - s;
+        memcpy(out, replacement, replacement_len);
+        out += replacement_len;
+        s = p + pattern_len;
+    }
+    strcpy(out, s);
+
+    return result;
+}
+
 void terminate_at_first_eol(char *s)
 {
     for (char *ptr = s; *ptr != '\0'; ptr++) {
@@ -483,6 +519,427 @@ void read_file(const char *filepath, char **buf, size_t bufsize)
     close(fd);
 }
 
+int create_dgram_socket(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct stat st;
+    int on = 1;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    // Handle existing socket.
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            close(fd);
+            errno = EEXIST;
+            return -1;
+        }
+        else if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            // Socket is in use.
+            close(fd);
+            errno = EADDRINUSE;
+            return -1;
+        }
+        unlink(path);
+    }
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    // Everyone should be able to send messages.
+    chmod(path, 0666);
+
+    // Receive credentials of the sender with each message.
+    setsockopt(fd, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on));
+
+    return fd;
+}
+
+ssize_t receive_dgram(int fd, char *buf, size_t bufsize, pid_t *pid, int *fds, size_t *num_fds)
+{
+    union {
+        char buf[CMSG_SPACE(sizeof(struct ucred)) + CMSG_SPACE(sizeof(int) * RECEIVE_DGRAM_MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { .iov_base = buf, .iov_len = bufsize - 1 };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+
+    ssize_t len = recvmsg(fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+    if (len < 0) {
+        return -1;
+    }
+    buf[len] = '\0';
+
+    *pid = 0;
+    if (num_fds) {
+        *num_fds = 0;
+    }
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_CREDENTIALS) {
+            struct ucred cred;
+            memcpy(&cred, CMSG_DATA(cmsg), sizeof(cred));
+            *pid = cred.pid;
+        }
+        else if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (size_t i = 0; i < n; i++) {
+                int received;
+                memcpy(&received, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                // File descriptors not wanted by the caller are closed.
+                if (fds && *num_fds < RECEIVE_DGRAM_MAX_FDS) {
+                    fds[(*num_fds)++] = received;
+                }
+                else {
+                    close(received);
+                }
+            }
+        }
+    }
+
+    return len;
+}
+
+int parse_inet_address(const char *str, size_t len, unsigned int default_port,
+        struct sockaddr_storage *addr, socklen_t *addrlen)
+{
+    char host[64];
+    const char *port_str = NULL;
+    const char *end = str + len;
+    unsigned long port = default_port;
+
+    if (len > 0 && str[0] == '[') {
+        const char *close = memchr(str, ']', len);
+        if (!close || (size_t)(close - str - 1) >= sizeof(host)) {
+            return -1;
+        }
+        memcpy(host, str + 1, close - str - 1);
+        host[close - str - 1] = '\0';
+        if (close + 1 < end) {
+            if (close[1] != ':') {
+                return -1;
+            }
+            port_str = close + 2;
+        }
+    }
+    else {
+        const char *colon = memchr(str, ':', len);
+        size_t host_len = colon ? (size_t)(colon - str) : len;
+        if (host_len == 0 || host_len >= sizeof(host)) {
+            return -1;
+        }
+        memcpy(host, str, host_len);
+        host[host_len] = '\0';
+        if (colon) {
+            port_str = colon + 1;
+        }
+    }
+
+    if (port_str) {
+        char buf[8];
+        char *endptr;
+        if (port_str >= end || (size_t)(end - port_str) >= sizeof(buf)) {
+            return -1;
+        }
+        memcpy(buf, port_str, end - port_str);
+        buf[end - port_str] = '\0';
+        port = strtoul(buf, &endptr, 10);
+        if (*endptr != '\0' || port == 0 || port > 65535) {
+            return -1;
+        }
+    }
+    else if (port == 0) {
+        return -1;
+    }
+
+    memset(addr, 0, sizeof(*addr));
+    if (strcmp(host, "localhost") == 0) {
+        snprintf(host, sizeof(host), "127.0.0.1");
+    }
+
+    struct sockaddr_in *in = (struct sockaddr_in *)addr;
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)addr;
+    if (inet_pton(AF_INET, host, &in->sin_addr) == 1) {
+        in->sin_family = AF_INET;
+        in->sin_port = htons(port);
+        *addrlen = sizeof(*in);
+    }
+    else if (inet_pton(AF_INET6, host, &in6->sin6_addr) == 1) {
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons(port);
+        *addrlen = sizeof(*in6);
+    }
+    else {
+        return -1;
+    }
+
+    return 0;
+}
+
+int create_listening_socket(const struct sockaddr_storage *addr, socklen_t addrlen)
+{
+    const struct sockaddr_un *un = (const struct sockaddr_un *)addr;
+    struct stat st;
+    int on = 1;
+
+    int fd = socket(addr->ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (addr->ss_family == AF_UNIX) {
+        // Handle existing socket.
+        if (lstat(un->sun_path, &st) == 0) {
+            if (!S_ISSOCK(st.st_mode)) {
+                close(fd);
+                errno = EEXIST;
+                return -1;
+            }
+            else if (connect(fd, (const struct sockaddr *)addr, addrlen) == 0) {
+                // Socket is in use.
+                close(fd);
+                errno = EADDRINUSE;
+                return -1;
+            }
+            unlink(un->sun_path);
+        }
+    }
+    else {
+        // Allow to bind again while connections of a previous instance are
+        // in the TIME_WAIT state.
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    }
+
+    if (bind(fd, (const struct sockaddr *)addr, addrlen) < 0 ||
+        listen(fd, SOMAXCONN) < 0) {
+        int errsv = errno;
+        close(fd);
+        errno = errsv;
+        return -1;
+    }
+
+    if (addr->ss_family == AF_UNIX) {
+        // Everyone should be able to connect.
+        chmod(un->sun_path, 0666);
+    }
+
+    return fd;
+}
+
+/**
+ * Count TCP connections of a local port listed in a /proc/net file.
+ *
+ * @param[in] path Path of the file (/proc/net/tcp or /proc/net/tcp6).
+ * @param[in] port Local port.
+ *
+ * @return Number of connections.
+ */
+static int count_tcp_connections(const char *path, unsigned int port)
+{
+    char line[256];
+    int count = 0;
+
+    FILE *f = fopen(path, "re");
+    if (!f) {
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        unsigned int local_port;
+        unsigned int state;
+        if (sscanf(line, " %*d: %*[0-9A-Fa-f]:%x %*[0-9A-Fa-f]:%*x %x", &local_port, &state) != 2) {
+            continue;
+        }
+        // Listening sockets and closed connections are not counted.
+        if (local_port == port && state != TCP_LISTEN && state != TCP_TIME_WAIT &&
+            state != TCP_CLOSE) {
+            count++;
+        }
+    }
+
+    fclose(f);
+    return count;
+}
+
+/**
+ * Count Unix stream connections of a path, as listed in /proc/net/unix.
+ *
+ * Accepted connections are listed with the path of the listening socket.
+ *
+ * @param[in] sun_path Path of the listening socket.
+ *
+ * @return Number of connections.
+ */
+static int count_unix_connections(const char *sun_path)
+{
+    char line[PATH_MAX + 128];
+    int count = 0;
+
+    FILE *f = fopen("/proc/net/unix", "re");
+    if (!f) {
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        unsigned int state;
+        int offset = 0;
+        terminate_at_first_eol(line);
+        if (sscanf(line, "%*s %*s %*s %*s %*s %x %*u %n", &state, &offset) != 1 || offset == 0) {
+            continue;
+        }
+        // Connecting (SS_CONNECTING) or connected (SS_CONNECTED).
+        if ((state == 2 || state == 3) && strcmp(line + offset, sun_path) == 0) {
+            count++;
+        }
+    }
+
+    fclose(f);
+    return count;
+}
+
+int count_socket_connections(int fd)
+{
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+    if (getsockname(fd, (struct sockaddr *)&addr, &addrlen) < 0) {
+        return -1;
+    }
+
+    // Connections waiting to be accepted.
+    int count = poll(&pfd, 1, 0) > 0 ? 1 : 0;
+
+    switch (addr.ss_family) {
+        case AF_INET:
+        case AF_INET6:
+        {
+            unsigned int port = ntohs(addr.ss_family == AF_INET ?
+                    ((struct sockaddr_in *)&addr)->sin_port :
+                    ((struct sockaddr_in6 *)&addr)->sin6_port);
+            count += count_tcp_connections("/proc/net/tcp", port);
+            count += count_tcp_connections("/proc/net/tcp6", port);
+            break;
+        }
+        case AF_UNIX:
+            count += count_unix_connections(((struct sockaddr_un *)&addr)->sun_path);
+            break;
+        default:
+            errno = EAFNOSUPPORT;
+            return -1;
+    }
+
+    return count;
+}
+
+/**
+ * Update a 64-bit FNV-1a hash with data.
+ *
+ * @param[in] hash Current hash.
+ * @param[in] data Data to hash.
+ * @param[in] len Length of the data.
+ *
+ * @return Updated hash.
+ */
+static uint64_t fnv1a_update(uint64_t hash, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+int hash_directory(const char *path, const char *ignored_suffix, uint64_t *hash)
+{
+    struct dirent **entries = NULL;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    int rc = 0;
+
+    int num_entries = scandir(path, &entries, NULL, alphasort);
+    if (num_entries < 0) {
+        return -1;
+    }
+
+    for (int i = 0; i < num_entries && rc == 0; i++) {
+        const char *name = entries[i]->d_name;
+        char file[PATH_MAX];
+        struct stat st;
+
+        if (ignored_suffix) {
+            size_t len = strlen(name);
+            size_t suffix_len = strlen(ignored_suffix);
+            if (len >= suffix_len && strcmp(name + len - suffix_len, ignored_suffix) == 0) {
+                continue;
+            }
+        }
+
+        snprintf(file, sizeof(file), "%s/%s", path, name);
+        if (stat(file, &st) < 0) {
+            // Dangling symbolic links are ignored.
+            if (errno != ENOENT) {
+                rc = -1;
+            }
+            continue;
+        }
+        else if (!S_ISREG(st.st_mode)) {
+            continue;
+        }
+
+        mode_t mode = st.st_mode & 07777;
+        h = fnv1a_update(h, name, strlen(name) + 1);
+        h = fnv1a_update(h, &mode, sizeof(mode));
+
+        int fd = open(file, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            rc = -1;
+            continue;
+        }
+        while (true) {
+            char buf[4096];
+            ssize_t n = read(fd, buf, sizeof(buf));
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            else if (n < 0) {
+                rc = -1;
+                break;
+            }
+            else if (n == 0) {
+                break;
+            }
+            h = fnv1a_update(h, buf, n);
+        }
+        close(fd);
+    }
+
+    int errsv = errno;
+    for (int i = 0; i < num_entries; i++) {
+        free(entries[i]);
+    }
+    free(entries);
+    errno = errsv;
+
+    *hash = h;
+    return rc;
+}
+
 void string_to_bool(const char *str, bool *result)
 {
     if (strcmp(str, "1") == 0 ||
@@ -650,6 +1107,198 @@ void string_to_mode(const char *str, mode_t *result)
     *result = val;
 }
 
+void string_to_cpu_set(const char *str, cpu_set_t *result)
+{
+    const char *p = str;
+
+    CPU_ZERO(result);
+
+    while (true) {
+        char *endptr;
+        unsigned long first, last;
+
+        while (isspace(*p)) p++;
+
+        errno = 0;
+        first = strtoul(p, &endptr, 10);
+        if (endptr == p || !isdigit(*p)) {
+            ThrowMessage("invalid CPU list");
+        }
+        p = endptr;
+
+        if (*p == '-') {
+            p++;
+            if (!isdigit(*p)) {
+                ThrowMessage("invalid CPU list");
+            }
+            last = strtoul(p, &endptr, 10);
+            p = endptr;
+        }
+        else {
+            last = first;
+        }
+
+        if (errno == ERANGE || first > last || last >= CPU_SETSIZE) {
+            ThrowMessage("out of range");
+        }
+        for (unsigned long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, result);
+        }
+
+        while (isspace(*p)) p++;
+        if (*p == '\0') {
+            break;
+        }
+        else if (*p != ',') {
+            ThrowMessage("invalid CPU list");
+        }
+        p++;
+    }
+}
+
+/**
+ * Convert a string to a single resource limit value.
+ *
+ * @param[in] str Input string to convert.
+ * @param[in] len Length of the string.
+ *
+ * @return The limit value.
+ */
+static rlim_t string_to_rlim(const char *str, size_t len)
+{
+    char buf[32];
+    char *endptr;
+    unsigned long long val;
+
+    if (len == 0 || len >= sizeof(buf)) {
+        ThrowMessage("invalid limit");
+    }
+    memcpy(buf, str, len);
+    buf[len] = '\0';
+
+    if (strcasecmp(buf, "unlimited") == 0 || strcasecmp(buf, "infinity") == 0) {
+        return RLIM_INFINITY;
+    }
+
+    errno = 0;
+    val = strtoull(buf, &endptr, 10);
+    if (endptr == buf || *endptr != '\0' || !isdigit(buf[0])) {
+        ThrowMessage("not a number");
+    }
+    else if ((val == ULLONG_MAX && errno == ERANGE) || val >= RLIM_INFINITY) {
+        ThrowMessage("out of range");
+    }
+
+    return (rlim_t)val;
+}
+
+void string_to_rlimit(const char *str, struct rlimit *result)
+{
+    const char *sep = strchr(str, ':');
+
+    if (sep) {
+        result->rlim_cur = string_to_rlim(str, sep - str);
+        result->rlim_max = string_to_rlim(sep + 1, strlen(sep + 1));
+    }
+    else {
+        result->rlim_cur = string_to_rlim(str, strlen(str));
+        result->rlim_max = result->rlim_cur;
+    }
+
+    if (result->rlim_max != RLIM_INFINITY &&
+        (result->rlim_cur == RLIM_INFINITY || result->rlim_cur > result->rlim_max)) {
+        ThrowMessage("soft limit greater than hard limit");
+    }
+}
+
+void string_to_size(const char *str, unsigned long long *result)
+{
+    char *endptr;
+    unsigned long long val;
+    unsigned int shift = 0;
+
+    errno = 0;
+    val = strtoull(str, &endptr, 10);
+    if (endptr == str || !isdigit(str[0])) {
+        ThrowMessage("not a number");
+    }
+    else if (val == ULLONG_MAX && errno == ERANGE) {
+        ThrowMessage("out of range");
+    }
+
+    switch (tolower(*endptr)) {
+        case '\0':                 break;
+        case 'k':   shift = 10;     break;
+        case 'm':   shift = 20;     break;
+        case 'g':   shift = 30;     break;
+        case 't':   shift = 40;     break;
+        default:    ThrowMessage("invalid unit");
+    }
+    if (shift > 0) {
+        // Accept an optional 'B' or 'iB' after the unit (e.g. '512MiB').
+        endptr++;
+        if (tolower(endptr[0]) == 'i' && tolower(endptr[1]) == 'b') {
+            endptr += 2;
+        }
+        else if (tolower(endptr[0]) == 'b') {
+            endptr++;
+        }
+        if (*endptr != '\0') {
+            ThrowMessage("invalid unit");
+        }
+        else if (val > (ULLONG_MAX >> shift)) {
+            ThrowMessage("out of range");
+        }
+    }
+
+    *result = val << shift;
+}
+
+void string_to_signal(const char *str, int *result)
+{
+    static const struct {
+        const char *name;
+        int sig;
+    } signals[] = {
+        { "HUP", SIGHUP },
+        { "INT", SIGINT },
+        { "QUIT", SIGQUIT },
+        { "KILL", SIGKILL },
+        { "USR1", SIGUSR1 },
+        { "USR2", SIGUSR2 },
+        { "ALRM", SIGALRM },
+        { "TERM", SIGTERM },
+        { "CONT", SIGCONT },
+        { "STOP", SIGSTOP },
+        { "TSTP", SIGTSTP },
+        { "WINCH", SIGWINCH },
+        { "PWR", SIGPWR },
+    };
+
+    if (isdigit(str[0])) {
+        int sig;
+        string_to_int(str, &sig);
+        if (sig <= 0 || sig >= NSIG) {
+            ThrowMessage("invalid signal");
+        }
+        *result = sig;
+        return;
+    }
+
+    const char *name = str;
+    if (strncasecmp(name, "SIG", 3) == 0) {
+        name += 3;
+    }
+    for (int i = 0; i < DIM(signals); i++) {
+        if (strcasecmp(name, signals[i].name) == 0) {
+            *result = signals[i].sig;
+            return;
+        }
+    }
+
+    ThrowMessage("invalid signal");
+}
+
 bool load_value_as_string(const char *filepath, char **buf, size_t bufsize)
 {
     struct stat fileinfo;
@@ -904,3 +1553,55 @@ bool load_value_as_mode(const char *filepath, mode_t *result)
 
     return true;
 }
+
+bool load_value_as_size(const char *filepath, unsigned long long *result)
+{
+    CEXCEPTION_T e;
+
+    char buf[128];
+    char *bufptr = buf;
+
+    // Get value from file.
+    if (!load_value_as_string(filepath, &bufptr, sizeof(buf))) {
+        return false;
+    }
+
+    terminate_at_first_eol(buf);
+    trim(buf);
+
+    // Convert.
+    Try {
+        string_to_size(buf, result);
+    }
+    Catch (e) {
+        ThrowMessage("could not load '%s': %s", filepath, e.mMessage);
+    }
+
+    return true;
+}
+
+bool load_value_as_signal(const char *filepath, int *result)
+{
+    CEXCEPTION_T e;
+
+    char buf[128];
+    char *bufptr = buf;
+
+    // Get value from file.
+    if (!load_value_as_string(filepath, &bufptr, sizeof(buf))) {
+        return false;
+    }
+
+    terminate_at_first_eol(buf);
+    trim(buf);
+
+    // Convert.
+    Try {
+        string_to_signal(buf, result);
+    }
+    Catch (e) {
+        ThrowMessage("could not load '%s': %s", filepath, e.mMessage);
+    }
+
+    return true;
+}
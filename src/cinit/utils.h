@@ -3,7 +3,11 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <sys/types.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 
 #define DIM(a) (sizeof(a)/sizeof(a[0]))
 
@@ -101,6 +105,17 @@ void remove_duplicated_char(char *s, char c);
  */
 void remove_all_char(char *s, char c);
 
+/**
+ * Replace all occurences of a substring in a string.
+ *
+ * @param[in] s Pointer to the string.
+ * @param[in] pattern Substring to replace, not empty.
+ * @param[in] replacement Replacement of the substring.
+ *
+ * @return Newly allocated string or NULL if out of memory.
+ */
+char *replace_all_str(const char *s, const char *pattern, const char *replacement);
+
 /**
  * Terminate a string at the first EOL character.
  *
@@ -148,6 +163,96 @@ int read_lines(int *fds, size_t num_fds, line_callback_t callback, exit_callback
  */
 void read_file(const char *filepath, char **buf, size_t bufsize);
 
+/**
+ * Create a Unix datagram socket bound to the specified path.
+ *
+ * An existing socket is replaced only if nobody is listening on it, to avoid
+ * hijacking a socket shared with the host.
+ *
+ * @param[in] path Path of the socket.
+ *
+ * @return File descriptor of the socket or -1 on error.
+ */
+int create_dgram_socket(const char *path);
+
+/**
+ * Maximum number of file descriptors received with a message.
+ */
+#define RECEIVE_DGRAM_MAX_FDS 16
+
+/**
+ * Receive a message from a socket, without blocking.
+ *
+ * @param[in] fd File descriptor of the socket.
+ * @param[out] buf Buffer where to store the message, null terminated.
+ * @param[in] bufsize Size of the buffer.
+ * @param[out] pid PID of the sender, 0 if unknown.
+ * @param[out] fds Where to store file descriptors received with the message,
+ *                 at least RECEIVE_DGRAM_MAX_FDS entries.  NULL to close
+ *                 them.
+ * @param[out] num_fds Number of file descriptors received.
+ *
+ * @return Length of the message, -1 on error.
+ */
+ssize_t receive_dgram(int fd, char *buf, size_t bufsize, pid_t *pid, int *fds, size_t *num_fds);
+
+/**
+ * Parse an IP address, optionally followed by a port.
+ *
+ * @param[in] str Address in the form 'ADDRESS[:PORT]', with IPv6 addresses
+ *                between brackets.
+ * @param[in] len Length of the address.
+ * @param[in] default_port Port to use when not specified, 0 if the port is
+ *                         mandatory.
+ * @param[out] addr Where to store the address.
+ * @param[out] addrlen Where to store the length of the address.
+ *
+ * @return -1 if the address is invalid, 0 otherwise.
+ */
+int parse_inet_address(const char *str, size_t len, unsigned int default_port,
+        struct sockaddr_storage *addr, socklen_t *addrlen);
+
+/**
+ * Create a stream socket listening on the specified address.
+ *
+ * For a Unix socket, an existing socket is replaced only if nobody is
+ * listening on it.
+ *
+ * @param[in] addr Address to listen on (IPv4, IPv6 or Unix).
+ * @param[in] addrlen Length of the address.
+ *
+ * @return File descriptor of the socket or -1 on error.
+ */
+int create_listening_socket(const struct sockaddr_storage *addr, socklen_t addrlen);
+
+/**
+ * Count connections of a listening socket.
+ *
+ * Connections accepted from the socket, by any process, and connections
+ * waiting to be accepted are counted.  Connections of TCP sockets are matched
+ * on the local port only.
+ *
+ * @param[in] fd File descriptor of the listening socket.
+ *
+ * @return Number of connections or -1 on error.
+ */
+int count_socket_connections(int fd);
+
+/**
+ * Compute a hash of the content of a directory.
+ *
+ * Names, permissions and content of regular files directly under the
+ * directory are hashed, in alphabetical order.  Symbolic links are followed.
+ *
+ * @param[in] path Path of the directory.
+ * @param[in] ignored_suffix Files whose name ends with this suffix are not
+ *                           hashed, NULL to hash all files.
+ * @param[out] hash Where to store the hash.
+ *
+ * @return -1 if an error occurred, 0 otherwise.
+ */
+int hash_directory(const char *path, const char *ignored_suffix, uint64_t *hash);
+
 /**
  * Convert a string to a boolean value.
  *
@@ -204,6 +309,51 @@ void string_to_gid(const char *str, gid_t *result);
  */
 void string_to_mode(const char *str, mode_t *result);
 
+/**
+ * Convert a list of CPUs to a CPU set.
+ *
+ * The list is made of comma-separated CPU numbers or ranges (e.g.
+ * '0-3,8,10-11').  The same syntax is used for lists of NUMA nodes.
+ *
+ * @param[in] str Input string to convert.
+ * @param[out] result Where to store the converted value.
+ */
+void string_to_cpu_set(const char *str, cpu_set_t *result);
+
+/**
+ * Convert a string to a resource limit.
+ *
+ * The string is in the form 'SOFT[:HARD]', where each value is an unsigned
+ * integer or 'unlimited'.  When the hard limit is omitted, it is set to the
+ * soft limit.
+ *
+ * @param[in] str Input string to convert.
+ * @param[out] result Where to store the converted value.
+ */
+void string_to_rlimit(const char *str, struct rlimit *result);
+
+/**
+ * Convert a string to a size, in bytes.
+ *
+ * The value is an unsigned integer, optionally followed by a binary unit
+ * suffix: 'k', 'm', 'g' or 't' (case insensitive).
+ *
+ * @param[in] str Input string to convert.
+ * @param[out] result Where to store the converted value.
+ */
+void string_to_size(const char *str, unsigned long long *result);
+
+/**
+ * Convert a string to a signal number.
+ *
+ * The string is a signal name, with or without the 'SIG' prefix (e.g.
+ * 'SIGHUP' or 'HUP'), or a signal number.
+ *
+ * @param[in] str Input string to convert.
+ * @param[out] result Where to store the converted value.
+ */
+void string_to_signal(const char *str, int *result);
+
 /**
  * Load configuration item as a string value.
  *
@@ -289,4 +439,24 @@ bool load_value_as_gid(const char *filepath, gid_t *result);
  */
 bool load_value_as_mode(const char *filepath, mode_t *result);
 
+/**
+ * Load configuration item as a size value, in bytes.
+ *
+ * @param[in] filepath Path to the configuration item file to load.
+ * @param[out] result Where the result will be stored.
+ *
+ * @return true if the value was loaded, false if value was not set.
+ */
+bool load_value_as_size(const char *filepath, unsigned long long *result);
+
+/**
+ * Load configuration item as a signal number.
+ *
+ * @param[in] filepath Path to the configuration item file to load.
+ * @param[out] result Where the result will be stored.
+ *
+ * @return true if the value was loaded, false if value was not set.
+ */
+bool load_value_as_signal(const char *filepath, int *result);
+
 #endif // __CINIT_UTILS_H__
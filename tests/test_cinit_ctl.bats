@@ -0,0 +1,40 @@
+#!/bin/env bats
+
+setup() {
+    load setup_common
+    load setup_container_daemon
+}
+
+teardown() {
+    load teardown_container_daemon
+    load teardown_common
+}
+
+@test "Checking the status command of the process supervisor..." {
+    run exec_container_daemon cinit-ctl status
+    echo "====================================================================="
+    echo " OUTPUT"
+    echo "====================================================================="
+    echo "$output"
+    echo "====================================================================="
+    echo " END OUTPUT"
+    echo "====================================================================="
+    echo "STATUS: $status"
+    [ "$status" -eq 0 ]
+    [[ "$output" =~ log_queue\ capacity=[0-9]+ ]]
+    [[ "$output" =~ service\ app\ state=running\ pid=[0-9]+ ]]
+}
+
+@test "Checking the restart command of the process supervisor..." {
+    run exec_container_daemon cinit-ctl restart app
+    echo "$output"
+    [ "$status" -eq 0 ]
+    [[ "$output" =~ "restart of service 'app' requested." ]]
+
+    run exec_container_daemon cinit-ctl restart does-not-exist
+    echo "$output"
+    [ "$status" -eq 0 ]
+    [[ "$output" =~ "ERROR: service not found: 'does-not-exist'" ]]
+}
+
+# vim:ft=sh:ts=4:sw=4:et:sts=4